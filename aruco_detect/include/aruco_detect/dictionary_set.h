@@ -0,0 +1,109 @@
+#ifndef ARUCO_DETECT_DICTIONARY_SET_H
+#define ARUCO_DETECT_DICTIONARY_SET_H
+
+#include <opencv2/aruco.hpp>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The codewords of a dictionary in all four rotations, packed into integers
+// so that a candidate is found by hashing rather than by comparing its bytes
+// against every marker. Results are the same as Dictionary::identify.
+//
+// Matches with errors are found by multi-index hashing. For up to t bits
+// corrected, codewords are split into t + 1 chunks, and any codeword within
+// t bits of a candidate equals it in at least one chunk. Only the markers
+// sharing a chunk with the candidate are compared
+class CodewordIndex {
+public:
+    explicit CodewordIndex(const cv::Ptr<cv::aruco::Dictionary> &dictionary);
+
+    // Find the marker matching the bits inside the border, within
+    // maxCorrectionRate of the dictionary's error correction
+    bool identify(const cv::Mat &bits, int &id, int &rotation, double maxCorrectionRate) const;
+
+    int markerSize() const { return dictionary->markerSize; }
+    int numMarkers() const { return (int)codewords.size() / 4; }
+    // Least number of bits by which the codewords of two markers differ
+    int minSeparation() const { return separation; }
+
+    // Bits in row major order, which must be no more than 64
+    static uint64_t pack(const cv::Mat &bits);
+
+private:
+    struct ChunkTable {
+        int shift;
+        uint64_t mask;
+        // Markers with each value of the chunk in any rotation, in order
+        std::unordered_map<uint64_t, std::vector<int>> markers;
+    };
+
+    int distance(uint64_t candidate, int marker, int &rotation) const;
+    bool identifyLinear(uint64_t candidate, int maxCorrection, int &id, int &rotation) const;
+    bool identifyHashed(uint64_t candidate, int maxCorrection, int &id, int &rotation) const;
+
+    cv::Ptr<cv::aruco::Dictionary> dictionary;
+    // Codeword of marker m in rotation r at m * 4 + r, with rotations
+    // numbered as Dictionary::identify does
+    std::vector<uint64_t> codewords;
+    // First marker and rotation with each codeword
+    std::unordered_map<uint64_t, int> exact;
+    int separation;
+    // Tables for correcting t bits at chunks[t - 1]
+    std::vector<std::vector<ChunkTable>> chunks;
+};
+
+// Several dictionaries decoded from one set of candidate markers, so that
+// thresholding and finding candidates is done once per image. The ids of
+// each dictionary are offset so that they don't collide
+class DictionarySet {
+public:
+    // Add a predefined dictionary by number, or a dictionary file in the
+    // format written by OpenCV. Returns false if it can't be loaded
+    bool add(const std::string &dictionary, int idOffset);
+    void add(const cv::Ptr<cv::aruco::Dictionary> &dictionary, int idOffset);
+
+    bool empty() const { return entries.empty(); }
+    size_t size() const { return entries.size(); }
+
+    // Whether ids [idOffset, idOffset + numMarkers) are any of the ids of a
+    // dictionary already added
+    bool overlaps(int idOffset, int numMarkers) const;
+
+    // Decode candidates against each dictionary in turn, appending the
+    // markers found to corners and ids. Of candidates with the same id within
+    // minMarkerDistanceRate of each other, only the outer is kept. Corners
+    // are refined with subpixel accuracy if refineCorners is set
+    void decode(const cv::Mat &image, const std::vector<std::vector<cv::Point2f>> &candidates,
+                const cv::Ptr<cv::aruco::DetectorParameters> &params, bool refineCorners,
+                std::vector<std::vector<cv::Point2f>> &corners, std::vector<int> &ids) const;
+
+    // A predefined dictionary by number, or a dictionary file. Empty if it
+    // can't be loaded or has markers too large to decode
+    static cv::Ptr<cv::aruco::Dictionary> get(const std::string &dictionary);
+
+    // Load a dictionary file with nmarkers, markersize, maxCorrectionBits
+    // and marker_0 ... marker_n as strings of bits
+    static cv::Ptr<cv::aruco::Dictionary> load(const std::string &filename);
+
+    // Bits of the marker with its border, as read from the image by the
+    // detector
+    static cv::Mat extractBits(const cv::Mat &grey, const std::vector<cv::Point2f> &corners,
+                               int markerSize, const cv::aruco::DetectorParameters &params);
+    static int borderErrors(const cv::Mat &bits, int markerSize, int borderBits);
+
+private:
+    struct Entry {
+        CodewordIndex index;
+        int idOffset;
+
+        Entry(const cv::Ptr<cv::aruco::Dictionary> &dictionary, int idOffset)
+            : index(dictionary), idOffset(idOffset) {}
+    };
+
+    std::vector<Entry> entries;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef ARUCO_DETECT_FRAME_SELECTOR_H
+#define ARUCO_DETECT_FRAME_SELECTOR_H
+
+#include <opencv2/core.hpp>
+
+// Chooses which frames to look for markers in. Frames arrive in slots of a
+// few frames, and only the sharpest frame of each slot is processed. It is
+// skipped too if it is much less sharp than recent frames, since a blurred
+// frame gives no markers or poor corners
+class FrameSelector {
+public:
+    FrameSelector();
+
+    // minRelativeSharpness is the fraction of the recent average sharpness
+    // below which a frame isn't processed, 0 to process every slot
+    void configure(int slotSize, double minRelativeSharpness);
+
+    // Mean squared gradient of a grey copy of the image, reduced in size by
+    // decimation. 0 if the image is too dark or too bright to find markers in
+    static double sharpness(const cv::Mat &image, int decimation);
+
+    // Add a frame. Returns true if it is the sharpest in the slot so far
+    bool add(double sharpness);
+    // Whether the slot has all its frames. If so, the sharpest should be
+    // processed if worthProcessing(), and then nextSlot() called
+    bool slotFull() const { return count >= slotSize; }
+    bool worthProcessing() const;
+    void nextSlot();
+
+    double averageSharpness() const { return average; }
+
+private:
+    int slotSize;
+    double minRelativeSharpness;
+    int count;
+    double best;
+    // Moving average of the sharpness of every frame, so that it follows
+    // changes of scene
+    double average;
+    int numFrames;
+};
+
+#endif
@@ -46,6 +46,7 @@
 #include <cv_bridge/cv_bridge.h>
 #include <sensor_msgs/image_encodings.h>
 #include <dynamic_reconfigure/server.h>
+#include <std_srvs/Empty.h>
 #include <std_srvs/SetBool.h>
 #include <std_msgs/String.h>
 
@@ -53,7 +54,13 @@
 #include "fiducial_msgs/FiducialArray.h"
 #include "fiducial_msgs/FiducialTransform.h"
 #include "fiducial_msgs/FiducialTransformArray.h"
+#include "fiducial_msgs/CompactFiducialArray.h"
+#include "fiducial_msgs/CompactFiducialTransformArray.h"
+#include "fiducial_msgs/compact.h"
+#include "fiducial_msgs/trace.h"
 #include "aruco_detect/DetectorParamsConfig.h"
+#include "aruco_detect/dictionary_set.h"
+#include "aruco_detect/frame_selector.h"
 
 #include <vision_msgs/Detection2D.h>
 #include <vision_msgs/Detection2DArray.h>
@@ -77,6 +84,8 @@ class FiducialsNode {
   private:
     ros::Publisher vertices_pub;
     ros::Publisher pose_pub;
+    ros::Publisher compact_vertices_pub;
+    ros::Publisher compact_pose_pub;
 
     ros::Subscriber caminfo_sub;
     ros::Subscriber vertices_sub;
@@ -86,11 +95,19 @@ class FiducialsNode {
     tf2_ros::TransformBroadcaster broadcaster;
 
     ros::ServiceServer service_enable_detections;
+    ros::ServiceServer service_dump_trace;
+
+    // Stages of recent frames, keyed by image stamp, for finding where
+    // latency comes from
+    fiducial_msgs::TraceBuffer trace;
+    std::string traceFile;
 
     // if set, we publish the images that contain fiducials
     bool publish_images;
     bool enable_detections;
     bool vis_msgs;
+    // if set, we also publish fiducials in the compact message format
+    bool compact_msgs;
 
     double fiducial_len;
 
@@ -104,6 +121,10 @@ class FiducialsNode {
     cv::Mat cameraMatrix;
     cv::Mat distortionCoeffs;
     int frameNum;
+    // Sharpest image of the current slot, and the decimation it is judged at
+    FrameSelector frameSelector;
+    sensor_msgs::ImageConstPtr bestImage;
+    int sharpnessDecimation;
     std::string frameId;
     std::vector<int> ignoreIds;
     std::map<int, double> fiducialLens;
@@ -114,8 +135,14 @@ class FiducialsNode {
 
     cv::Ptr<aruco::DetectorParameters> detectorParams;
     cv::Ptr<aruco::Dictionary> dictionary;
+    // Dictionary given to the detector, which is empty if the main
+    // dictionary is decoded with the others
+    cv::Ptr<aruco::Dictionary> detectorDictionary;
+    // Dictionaries decoded from the candidates the detector rejects
+    DictionarySet dictionarySet;
 
     void handleIgnoreString(const std::string& str);
+    void handleDictionariesString(const std::string& str);
 
     void estimatePoseSingleMarkers(float markerLength,
                                    const cv::Mat &cameraMatrix,
@@ -126,21 +153,36 @@ class FiducialsNode {
 
     void ignoreCallback(const std_msgs::String &msg);
     void imageCallback(const sensor_msgs::ImageConstPtr &msg);
+    void processImage(const sensor_msgs::ImageConstPtr &msg);
     void poseEstimateCallback(const FiducialArrayConstPtr &msg);
     void camInfoCallback(const sensor_msgs::CameraInfo::ConstPtr &msg);
     void configCallback(aruco_detect::DetectorParamsConfig &config, uint32_t level);
 
     bool enableDetectionsCallback(std_srvs::SetBool::Request &req,
                         std_srvs::SetBool::Response &res);
+    bool dumpTraceCallback(std_srvs::Empty::Request &req,
+                           std_srvs::Empty::Response &res);
 
     dynamic_reconfigure::Server<aruco_detect::DetectorParamsConfig> configServer;
     dynamic_reconfigure::Server<aruco_detect::DetectorParamsConfig>::CallbackType callbackType;
 
   public:
     FiducialsNode();
+    ~FiducialsNode();
 };
 
 
+/**
+  * @brief Return whether the detector refines corners with subpixel accuracy
+  */
+static bool subPixRefinement(const cv::Ptr<aruco::DetectorParameters>& params) {
+#if CV_MINOR_VERSION==2 and CV_MAJOR_VERSION==3
+    return params->doCornerRefinement;
+#else
+    return params->cornerRefinementMethod == aruco::CORNER_REFINE_SUBPIX;
+#endif
+}
+
 /**
   * @brief Return object points for the system centered in a single marker, given the marker length
   */
@@ -331,12 +373,46 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg)
         return; //return without doing anything
     }
 
-	frameNum++;
-	if (frameNum % 3 != 0) return; // skip a few frames, reduce CPU
-	
-   
+    frameNum++;
+
+    // Of each few frames, only look for markers in the sharpest, to reduce CPU
+    double sharpness = 1.0;
+    try {
+        sharpness = FrameSelector::sharpness(cv_bridge::toCvShare(msg)->image,
+                                             sharpnessDecimation);
+    }
+    catch(cv_bridge::Exception & e) {
+        ROS_ERROR("cv_bridge exception: %s", e.what());
+    }
+    catch(cv::Exception & e) {
+        ROS_ERROR("cv exception: %s", e.what());
+    }
+
+    if (frameSelector.add(sharpness)) {
+        bestImage = msg;
+    }
+    if (!frameSelector.slotFull()) {
+        return;
+    }
+
+    bool worth = frameSelector.worthProcessing();
+    frameSelector.nextSlot();
+    sensor_msgs::ImageConstPtr image = bestImage;
+    bestImage.reset();
+    if (!worth) {
+        ROS_DEBUG("Skipping blurred or badly exposed image %d", image->header.seq);
+        return;
+    }
+    processImage(image);
+}
+
+void FiducialsNode::processImage(const sensor_msgs::ImageConstPtr & msg)
+{
 	ROS_INFO("Got image %d", msg->header.seq);
 
+    trace.recordAge("image", msg->header.seq, msg->header.stamp);
+    fiducial_msgs::TraceSpan span(trace, "detect", msg->header.seq, msg->header.stamp);
+
     fiducial_msgs::FiducialArray fva;
     fva.header.stamp = msg->header.stamp;
     fva.header.frame_id = frameId;
@@ -347,7 +423,13 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg)
 		
 		cv_ptr->image = ~cv_ptr->image; // invert
 
-        aruco::detectMarkers(cv_ptr->image, dictionary, corners, ids, detectorParams);
+        vector <vector <Point2f> > rejected;
+        aruco::detectMarkers(cv_ptr->image, detectorDictionary, corners, ids, detectorParams,
+                             rejected);
+        if (!dictionarySet.empty()) {
+            dictionarySet.decode(cv_ptr->image, rejected, detectorParams,
+                                 subPixRefinement(detectorParams), corners, ids);
+        }
         ROS_INFO("Detected %d markers", (int)ids.size());
 
         for (size_t i=0; i<ids.size(); i++) {
@@ -371,6 +453,12 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg)
 
         vertices_pub.publish(fva);
 
+        if (compact_msgs && compact_vertices_pub.getNumSubscribers() > 0) {
+            fiducial_msgs::CompactFiducialArray cfa;
+            fiducial_msgs::toCompact(fva, cfa);
+            compact_vertices_pub.publish(cfa);
+        }
+
         if(ids.size() > 0) {
             aruco::drawDetectedMarkers(cv_ptr->image, corners, ids);
         }
@@ -389,6 +477,8 @@ void FiducialsNode::imageCallback(const sensor_msgs::ImageConstPtr & msg)
 
 void FiducialsNode::poseEstimateCallback(const FiducialArrayConstPtr & msg)
 {
+    fiducial_msgs::TraceSpan span(trace, "pose_estimation", msg->image_seq,
+                                  msg->header.stamp);
     vector <Vec3d>  rvecs, tvecs;
 
     vision_msgs::Detection2DArray vma;
@@ -520,6 +610,12 @@ void FiducialsNode::poseEstimateCallback(const FiducialArrayConstPtr & msg)
     	pose_pub.publish(vma);
     else 
 	pose_pub.publish(fta);
+
+    if (compact_msgs && !vis_msgs && compact_pose_pub.getNumSubscribers() > 0) {
+        fiducial_msgs::CompactFiducialTransformArray cfta;
+        fiducial_msgs::toCompact(fta, cfta);
+        compact_pose_pub.publish(cfta);
+    }
 }
 
 void FiducialsNode::handleIgnoreString(const std::string& str)
@@ -555,6 +651,52 @@ void FiducialsNode::handleIgnoreString(const std::string& str)
     }
 }
 
+void FiducialsNode::handleDictionariesString(const std::string& str)
+{
+    /*
+    extra dictionaries take a comma separated list of dictionary: id offset,
+    where the dictionary is a predefined dictionary number or a dictionary
+    file, eg "16: 1000, /home/ubuntu/tags.yml: 2000". A dictionary whose
+    ids would overlap those of the main dictionary, which start from 0, or
+    of another is not decoded, as its markers couldn't be told apart
+    */
+    std::vector<std::string> strs;
+    boost::split(strs, str, boost::is_any_of(","));
+    for (const string& element : strs) {
+        if (boost::trim_copy(element) == "") {
+           continue;
+        }
+        size_t colon = element.rfind(':');
+        if (colon == string::npos) {
+           ROS_ERROR("Malformed extra_dictionaries: %s", element.c_str());
+           continue;
+        }
+        string dict = boost::trim_copy(element.substr(0, colon));
+        int offset;
+        try {
+           offset = std::stoi(element.substr(colon + 1));
+        }
+        catch (std::exception& e) {
+           ROS_ERROR("Malformed extra_dictionaries: %s", element.c_str());
+           continue;
+        }
+        cv::Ptr<aruco::Dictionary> extra = DictionarySet::get(dict);
+        if (extra.empty()) {
+           ROS_ERROR("Cannot load dictionary %s", dict.c_str());
+           continue;
+        }
+        int nmarkers = extra->bytesList.rows;
+        if ((offset < dictionary->bytesList.rows && 0 < offset + nmarkers) ||
+            dictionarySet.overlaps(offset, nmarkers)) {
+           ROS_ERROR("Ids %d to %d of dictionary %s overlap another dictionary, not decoding it",
+                     offset, offset + nmarkers - 1, dict.c_str());
+           continue;
+        }
+        dictionarySet.add(extra, offset);
+        ROS_INFO("Decoding dictionary %s with ids from %d", dict.c_str(), offset);
+    }
+}
+
 bool FiducialsNode::enableDetectionsCallback(std_srvs::SetBool::Request &req,
                                 std_srvs::SetBool::Response &res)
 {
@@ -572,6 +714,21 @@ bool FiducialsNode::enableDetectionsCallback(std_srvs::SetBool::Request &req,
     return true;
 }
 
+bool FiducialsNode::dumpTraceCallback(std_srvs::Empty::Request &req,
+                                      std_srvs::Empty::Response &res)
+{
+    if (!trace.enabled()) {
+        ROS_WARN("Tracing is off, set trace_buffer_size to trace frames");
+        return false;
+    }
+    if (!trace.dump(traceFile, "aruco_detect")) {
+        ROS_ERROR("Cannot write trace to %s", traceFile.c_str());
+        return false;
+    }
+    ROS_INFO("Wrote trace of %d frame stages to %s", (int)trace.size(), traceFile.c_str());
+    return true;
+}
+
 
 FiducialsNode::FiducialsNode() : nh(), pnh("~"), it(nh)
 {
@@ -596,6 +753,25 @@ FiducialsNode::FiducialsNode() : nh(), pnh("~"), it(nh)
     pnh.param<bool>("do_pose_estimation", doPoseEstimation, true);
     pnh.param<bool>("publish_fiducial_tf", publishFiducialTf, true);
     pnh.param<bool>("vis_msgs", vis_msgs, false);
+    pnh.param<bool>("compact_msgs", compact_msgs, false);
+
+    /*
+    Images are taken in slots of frame_slot frames, and only the sharpest of
+    each slot is processed. It is skipped if its sharpness is less than
+    min_relative_sharpness of the recent average, because of motion blur
+    */
+    int frameSlot;
+    double minRelativeSharpness;
+    pnh.param<int>("frame_slot", frameSlot, 3);
+    pnh.param<double>("min_relative_sharpness", minRelativeSharpness, 0.3);
+    pnh.param<int>("sharpness_decimation", sharpnessDecimation, 4);
+    frameSelector.configure(frameSlot, minRelativeSharpness);
+
+    // Number of recent frame stages to keep for tracing latency, 0 to not trace
+    int traceSize;
+    pnh.param<int>("trace_buffer_size", traceSize, 0);
+    pnh.param<string>("trace_file", traceFile, "/tmp/aruco_detect_trace.json");
+    trace.resize(std::max(traceSize, 0));
 
     std::string str;
     std::vector<std::string> strs;
@@ -651,7 +827,33 @@ FiducialsNode::FiducialsNode() : nh(), pnh("~"), it(nh)
     else	
 	pose_pub = nh.advertise<fiducial_msgs::FiducialTransformArray>("fiducial_transforms", 1);
 
+    if (compact_msgs) {
+        compact_vertices_pub = nh.advertise<fiducial_msgs::CompactFiducialArray>(
+            "fiducial_vertices_compact", 1);
+        if (!vis_msgs) {
+            compact_pose_pub = nh.advertise<fiducial_msgs::CompactFiducialTransformArray>(
+                "fiducial_transforms_compact", 1);
+        }
+    }
+
     dictionary = aruco::getPredefinedDictionary(dicno);
+    detectorDictionary = dictionary;
+
+    /*
+    Decode the main dictionary with a precomputed codeword index instead of
+    in the detector, which compares every candidate with every marker. The
+    markers found are the same, and it is faster for large dictionaries
+    */
+    bool hashDecode;
+    pnh.param<bool>("hash_decode", hashDecode, false);
+    if (hashDecode) {
+        dictionarySet.add(dictionary, 0);
+        detectorDictionary = cv::makePtr<aruco::Dictionary>(cv::Mat(), dictionary->markerSize, 0);
+    }
+
+    // Other dictionaries to find in the same images, with their ids offset
+    pnh.param<string>("extra_dictionaries", str, "");
+    handleDictionariesString(str);
 
     img_sub = it.subscribe("camera", 1,
                         &FiducialsNode::imageCallback, this);
@@ -667,6 +869,9 @@ FiducialsNode::FiducialsNode() : nh(), pnh("~"), it(nh)
     service_enable_detections = nh.advertiseService("enable_detections",
                         &FiducialsNode::enableDetectionsCallback, this);
 
+    service_dump_trace = pnh.advertiseService("dump_trace",
+                        &FiducialsNode::dumpTraceCallback, this);
+
     callbackType = boost::bind(&FiducialsNode::configCallback, this, _1, _2);
     configServer.setCallback(callbackType);
 
@@ -712,6 +917,13 @@ FiducialsNode::FiducialsNode() : nh(), pnh("~"), it(nh)
     ROS_INFO("Aruco detection ready");
 }
 
+FiducialsNode::~FiducialsNode()
+{
+    if (trace.enabled()) {
+        trace.dump(traceFile, "aruco_detect");
+    }
+}
+
 int main(int argc, char ** argv) {
     ros::init(argc, argv, "aruco_detect");
 
@@ -719,5 +931,6 @@ int main(int argc, char ** argv) {
 
     ros::spin();
 
+    delete fd_node;
     return 0;
 }
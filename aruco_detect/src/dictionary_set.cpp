@@ -0,0 +1,434 @@
+#include <aruco_detect/dictionary_set.h>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+
+using namespace std;
+using namespace cv;
+
+static int popcount(uint64_t x) { return __builtin_popcountll(x); }
+
+// Quarter turn clockwise
+static Mat rotate90(const Mat &bits) {
+    Mat rotated;
+    transpose(bits, rotated);
+    flip(rotated, rotated, 1);
+    return rotated;
+}
+
+CodewordIndex::CodewordIndex(const Ptr<aruco::Dictionary> &dictionary)
+    : dictionary(dictionary), separation(INT_MAX) {
+    int size = dictionary->markerSize;
+    int n = dictionary->bytesList.rows;
+    CV_Assert(size > 0 && size * size <= 64);
+
+    // Each marker in the four rotations, turning clockwise
+    vector<Mat> bits(n * 4);
+    for (int m = 0; m < n; m++) {
+        bits[m * 4] = aruco::Dictionary::getBitsFromByteList(dictionary->bytesList.row(m), size);
+        for (int k = 1; k < 4; k++) {
+            bits[m * 4 + k] = rotate90(bits[m * 4 + k - 1]);
+        }
+    }
+
+    // Find out how the dictionary numbers rotations by having it identify
+    // the rotations of a marker that looks different in each of them
+    int order[4] = {0, 1, 2, 3};
+    for (int m = 0; m < n; m++) {
+        int found[4];
+        bool distinct = true;
+        for (int k = 0; k < 4 && distinct; k++) {
+            int id;
+            distinct = dictionary->identify(bits[m * 4 + k], id, found[k], 0.0) && id == m;
+            for (int j = 0; j < k && distinct; j++) {
+                distinct = found[j] != found[k];
+            }
+        }
+        if (distinct) {
+            copy(found, found + 4, order);
+            break;
+        }
+    }
+
+    codewords.resize(n * 4);
+    for (int m = 0; m < n; m++) {
+        for (int k = 0; k < 4; k++) {
+            codewords[m * 4 + order[k]] = pack(bits[m * 4 + k]);
+        }
+    }
+
+    // Keep the first marker and rotation with each codeword, which is the one
+    // Dictionary::identify returns for an exact match
+    exact.reserve(codewords.size());
+    for (size_t i = 0; i < codewords.size(); i++) {
+        exact.emplace(codewords[i], (int)i);
+    }
+
+    for (int a = 0; a < n; a++) {
+        for (int b = a + 1; b < n; b++) {
+            for (int ra = 0; ra < 4; ra++) {
+                for (int rb = 0; rb < 4; rb++) {
+                    separation = min(separation,
+                                     popcount(codewords[a * 4 + ra] ^ codewords[b * 4 + rb]));
+                }
+            }
+        }
+    }
+
+    // Correcting as many bits as there are makes everything match, which
+    // needs no index
+    int numBits = size * size;
+    int maxCorrection = min(dictionary->maxCorrectionBits, numBits - 1);
+    chunks.resize(max(maxCorrection, 0));
+    for (int t = 1; t <= maxCorrection; t++) {
+        vector<ChunkTable> &tables = chunks[t - 1];
+        tables.resize(t + 1);
+        for (int i = 0; i <= t; i++) {
+            ChunkTable &table = tables[i];
+            int start = i * numBits / (t + 1);
+            int width = (i + 1) * numBits / (t + 1) - start;
+            table.shift = start;
+            table.mask = width >= 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+            for (int m = 0; m < n; m++) {
+                for (int r = 0; r < 4; r++) {
+                    vector<int> &markers =
+                        table.markers[(codewords[m * 4 + r] >> table.shift) & table.mask];
+                    if (markers.empty() || markers.back() != m) {
+                        markers.push_back(m);
+                    }
+                }
+            }
+        }
+    }
+}
+
+uint64_t CodewordIndex::pack(const Mat &bits) {
+    CV_Assert(bits.rows * bits.cols <= 64);
+    uint64_t packed = 0;
+    int i = 0;
+    for (int y = 0; y < bits.rows; y++) {
+        for (int x = 0; x < bits.cols; x++, i++) {
+            if (bits.at<unsigned char>(y, x) != 0) {
+                packed |= uint64_t(1) << i;
+            }
+        }
+    }
+    return packed;
+}
+
+// Least distance of the candidate from a marker in any rotation, and the
+// first rotation at that distance
+
+int CodewordIndex::distance(uint64_t candidate, int marker, int &rotation) const {
+    int best = INT_MAX;
+    for (int r = 0; r < 4; r++) {
+        int d = popcount(candidate ^ codewords[marker * 4 + r]);
+        if (d < best) {
+            best = d;
+            rotation = r;
+        }
+    }
+    return best;
+}
+
+bool CodewordIndex::identifyLinear(uint64_t candidate, int maxCorrection, int &id,
+                                   int &rotation) const {
+    for (int m = 0; m < numMarkers(); m++) {
+        if (distance(candidate, m, rotation) <= maxCorrection) {
+            id = m;
+            return true;
+        }
+    }
+    id = -1;
+    return false;
+}
+
+// The first marker within maxCorrection bits is the first one within it
+// among those sharing a chunk with the candidate
+
+bool CodewordIndex::identifyHashed(uint64_t candidate, int maxCorrection, int &id,
+                                   int &rotation) const {
+    id = -1;
+    for (const ChunkTable &table : chunks[maxCorrection - 1]) {
+        auto it = table.markers.find((candidate >> table.shift) & table.mask);
+        if (it == table.markers.end()) {
+            continue;
+        }
+        for (int m : it->second) {
+            if (id >= 0 && m >= id) {
+                break;
+            }
+            int r;
+            if (distance(candidate, m, r) <= maxCorrection) {
+                id = m;
+                rotation = r;
+                break;
+            }
+        }
+    }
+    return id >= 0;
+}
+
+bool CodewordIndex::identify(const Mat &bits, int &id, int &rotation,
+                             double maxCorrectionRate) const {
+    CV_Assert(bits.rows == markerSize() && bits.cols == markerSize());
+    int maxCorrection = int(double(dictionary->maxCorrectionBits) * maxCorrectionRate);
+    uint64_t candidate = pack(bits);
+
+    // An exact match is the answer unless a marker earlier in the
+    // dictionary could be within the error correction too
+    if (maxCorrection == 0 || maxCorrection < separation) {
+        auto it = exact.find(candidate);
+        if (it != exact.end()) {
+            id = it->second / 4;
+            rotation = it->second % 4;
+            return true;
+        }
+        if (maxCorrection == 0) {
+            id = -1;
+            return false;
+        }
+    }
+    if (maxCorrection <= (int)chunks.size()) {
+        return identifyHashed(candidate, maxCorrection, id, rotation);
+    }
+    return identifyLinear(candidate, maxCorrection, id, rotation);
+}
+
+bool DictionarySet::add(const string &dictionary, int idOffset) {
+    Ptr<aruco::Dictionary> dict = get(dictionary);
+    if (dict.empty()) {
+        return false;
+    }
+    add(dict, idOffset);
+    return true;
+}
+
+void DictionarySet::add(const Ptr<aruco::Dictionary> &dictionary, int idOffset) {
+    entries.emplace_back(dictionary, idOffset);
+}
+
+bool DictionarySet::overlaps(int idOffset, int numMarkers) const {
+    for (const Entry &e : entries) {
+        if (idOffset < e.idOffset + e.index.numMarkers() && e.idOffset < idOffset + numMarkers) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Ptr<aruco::Dictionary> DictionarySet::get(const string &dictionary) {
+    Ptr<aruco::Dictionary> dict;
+    if (!dictionary.empty() &&
+        all_of(dictionary.begin(), dictionary.end(), [](char c) { return isdigit(c); })) {
+        try {
+            dict = aruco::getPredefinedDictionary(stoi(dictionary));
+        } catch (cv::Exception &e) {
+            return Ptr<aruco::Dictionary>();
+        }
+    } else {
+        dict = load(dictionary);
+    }
+    if (dict.empty() || dict->markerSize * dict->markerSize > 64) {
+        return Ptr<aruco::Dictionary>();
+    }
+    return dict;
+}
+
+Ptr<aruco::Dictionary> DictionarySet::load(const string &filename) {
+    FileStorage fs;
+    try {
+        if (!fs.open(filename, FileStorage::READ)) {
+            return Ptr<aruco::Dictionary>();
+        }
+    } catch (cv::Exception &e) {
+        return Ptr<aruco::Dictionary>();
+    }
+
+    int numMarkers = 0, markerSize = 0, maxCorrectionBits = 0;
+    fs["nmarkers"] >> numMarkers;
+    fs["markersize"] >> markerSize;
+    fs["maxCorrectionBits"] >> maxCorrectionBits;
+    if (numMarkers <= 0 || markerSize <= 0 || maxCorrectionBits < 0) {
+        return Ptr<aruco::Dictionary>();
+    }
+
+    Mat bytes(0, 0, CV_8UC1);
+    for (int i = 0; i < numMarkers; i++) {
+        string code;
+        fs["marker_" + to_string(i)] >> code;
+        if ((int)code.size() != markerSize * markerSize) {
+            return Ptr<aruco::Dictionary>();
+        }
+        Mat bits(markerSize, markerSize, CV_8UC1);
+        for (int j = 0; j < markerSize * markerSize; j++) {
+            if (code[j] != '0' && code[j] != '1') {
+                return Ptr<aruco::Dictionary>();
+            }
+            bits.at<unsigned char>(j / markerSize, j % markerSize) = code[j] - '0';
+        }
+        bytes.push_back(aruco::Dictionary::getByteListFromBits(bits));
+    }
+    return makePtr<aruco::Dictionary>(bytes, markerSize, maxCorrectionBits);
+}
+
+// Remove the perspective from a candidate and read each cell as a bit,
+// the same way as the detector
+
+Mat DictionarySet::extractBits(const Mat &grey, const vector<Point2f> &corners, int markerSize,
+                               const aruco::DetectorParameters &params) {
+    int cellSize = params.perspectiveRemovePixelPerCell;
+    int sizeWithBorders = markerSize + 2 * params.markerBorderBits;
+    int margin = int(params.perspectiveRemoveIgnoredMarginPerCell * cellSize);
+    float side = (float)(sizeWithBorders * cellSize - 1);
+
+    Point2f square[] = {Point2f(0, 0), Point2f(side, 0), Point2f(side, side), Point2f(0, side)};
+    Point2f quad[] = {corners[0], corners[1], corners[2], corners[3]};
+    Mat marker;
+    warpPerspective(grey, marker, getPerspectiveTransform(quad, square),
+                    Size(sizeWithBorders * cellSize, sizeWithBorders * cellSize), INTER_NEAREST);
+
+    Mat bits(sizeWithBorders, sizeWithBorders, CV_8UC1, Scalar::all(0));
+
+    // If there is too little contrast for Otsu, the cells are all the same
+    Mat mean, stddev;
+    Mat inner = marker.colRange(cellSize / 2, marker.cols - cellSize / 2)
+                    .rowRange(cellSize / 2, marker.rows - cellSize / 2);
+    meanStdDev(inner, mean, stddev);
+    if (stddev.ptr<double>(0)[0] < params.minOtsuStdDev) {
+        bits.setTo(Scalar::all(mean.ptr<double>(0)[0] > 127 ? 1 : 0));
+        return bits;
+    }
+
+    threshold(marker, marker, 125, 255, THRESH_BINARY | THRESH_OTSU);
+    for (int y = 0; y < sizeWithBorders; y++) {
+        for (int x = 0; x < sizeWithBorders; x++) {
+            Mat cell = marker(Rect(x * cellSize + margin, y * cellSize + margin,
+                                   cellSize - 2 * margin, cellSize - 2 * margin));
+            if ((size_t)countNonZero(cell) > cell.total() / 2) {
+                bits.at<unsigned char>(y, x) = 1;
+            }
+        }
+    }
+    return bits;
+}
+
+int DictionarySet::borderErrors(const Mat &bits, int markerSize, int borderBits) {
+    int sizeWithBorders = markerSize + 2 * borderBits;
+    int errors = 0;
+    for (int y = 0; y < sizeWithBorders; y++) {
+        for (int k = 0; k < borderBits; k++) {
+            errors += bits.at<unsigned char>(y, k) != 0;
+            errors += bits.at<unsigned char>(y, sizeWithBorders - 1 - k) != 0;
+        }
+    }
+    for (int x = borderBits; x < sizeWithBorders - borderBits; x++) {
+        for (int k = 0; k < borderBits; k++) {
+            errors += bits.at<unsigned char>(k, x) != 0;
+            errors += bits.at<unsigned char>(sizeWithBorders - 1 - k, x) != 0;
+        }
+    }
+    return errors;
+}
+
+// Whether the corners of two markers are closer on average than
+// minMarkerDistanceRate of the smaller one's perimeter, as the detector
+// decides that candidates are the same marker. Both are in the order of the
+// marker's own corners, so corresponding corners are compared
+
+static bool tooClose(const vector<Point2f> &a, const vector<Point2f> &b, double rate) {
+    double minDistance = rate * min(arcLength(a, true), arcLength(b, true));
+    double distanceSq = 0.0;
+    for (int j = 0; j < 4; j++) {
+        Point2f d = a[j] - b[j];
+        distanceSq += d.dot(d);
+    }
+    return distanceSq / 4 < minDistance * minDistance;
+}
+
+void DictionarySet::decode(const Mat &image, const vector<vector<Point2f>> &candidates,
+                           const Ptr<aruco::DetectorParameters> &params, bool refineCorners,
+                           vector<vector<Point2f>> &corners, vector<int> &ids) const {
+    if (entries.empty() || candidates.empty()) {
+        return;
+    }
+
+    Mat grey;
+    if (image.channels() == 3) {
+        cvtColor(image, grey, COLOR_BGR2GRAY);
+    } else {
+        grey = image;
+    }
+
+    size_t firstNew = corners.size();
+    // Bits are read once for each marker size
+    vector<pair<int, Mat>> bitsBySize;
+
+    for (const vector<Point2f> &candidate : candidates) {
+        if (candidate.size() != 4) {
+            continue;
+        }
+        bitsBySize.clear();
+
+        for (const Entry &e : entries) {
+            int size = e.index.markerSize();
+            auto cached = find_if(bitsBySize.begin(), bitsBySize.end(),
+                                  [size](const pair<int, Mat> &b) { return b.first == size; });
+            if (cached == bitsBySize.end()) {
+                bitsBySize.emplace_back(size, extractBits(grey, candidate, size, *params));
+                cached = bitsBySize.end() - 1;
+            }
+            const Mat &bits = cached->second;
+
+            int maxBorderErrors = int(size * size * params->maxErroneousBitsInBorderRate);
+            if (borderErrors(bits, size, params->markerBorderBits) > maxBorderErrors) {
+                continue;
+            }
+
+            int b = params->markerBorderBits;
+            Mat inner = bits.rowRange(b, bits.rows - b).colRange(b, bits.cols - b);
+            int id, rotation;
+            if (!e.index.identify(inner, id, rotation, params->errorCorrectionRate)) {
+                continue;
+            }
+
+            vector<Point2f> rotated(4);
+            for (int j = 0; j < 4; j++) {
+                rotated[j] = candidate[(j + 4 - rotation) % 4];
+            }
+
+            // Nested contours of one marker are both candidates, so keep
+            // the outer one. Separate markers can share an id, so it is
+            // where they are that tells them apart
+            id += e.idOffset;
+            size_t i = firstNew;
+            while (i < corners.size() &&
+                   !(ids[i] == id &&
+                     tooClose(rotated, corners[i], params->minMarkerDistanceRate))) {
+                i++;
+            }
+            if (i == corners.size()) {
+                corners.push_back(rotated);
+                ids.push_back(id);
+            } else if (arcLength(rotated, true) > arcLength(corners[i], true)) {
+                corners[i] = rotated;
+            }
+            break;
+        }
+    }
+
+    if (refineCorners) {
+        TermCriteria criteria(TermCriteria::MAX_ITER | TermCriteria::EPS,
+                              params->cornerRefinementMaxIterations,
+                              params->cornerRefinementMinAccuracy);
+        for (size_t i = firstNew; i < corners.size(); i++) {
+            cornerSubPix(grey, corners[i],
+                         Size(params->cornerRefinementWinSize, params->cornerRefinementWinSize),
+                         Size(-1, -1), criteria);
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#include <aruco_detect/frame_selector.h>
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+
+using namespace cv;
+
+// Weight of each frame in the moving average, and the number of frames
+// before the average is trusted
+static const double averageWeight = 0.1;
+static const int averageFrames = 10;
+
+// Mean grey level outside which an image is too dark or bright for markers
+static const double minBrightness = 8.0;
+static const double maxBrightness = 247.0;
+
+FrameSelector::FrameSelector() { configure(3, 0.3); }
+
+void FrameSelector::configure(int slotSize, double minRelativeSharpness) {
+    this->slotSize = std::max(slotSize, 1);
+    this->minRelativeSharpness = minRelativeSharpness;
+    count = 0;
+    best = -1.0;
+    average = 0.0;
+    numFrames = 0;
+}
+
+double FrameSelector::sharpness(const Mat &image, int decimation) {
+    if (image.empty()) {
+        return 0.0;
+    }
+
+    Mat grey;
+    if (image.channels() == 3) {
+        cvtColor(image, grey, COLOR_BGR2GRAY);
+    } else if (image.channels() == 4) {
+        cvtColor(image, grey, COLOR_BGRA2GRAY);
+    } else {
+        grey = image;
+    }
+    if (grey.depth() != CV_8U) {
+        grey.convertTo(grey, CV_8U, grey.depth() == CV_16U ? 1.0 / 256 : 1.0);
+    }
+
+    Mat small;
+    decimation = std::max(decimation, 1);
+    if (decimation > 1) {
+        resize(grey, small, Size(), 1.0 / decimation, 1.0 / decimation, INTER_AREA);
+    } else {
+        small = grey;
+    }
+
+    double brightness = mean(small)[0];
+    if (brightness < minBrightness || brightness > maxBrightness) {
+        return 0.0;
+    }
+
+    Mat dx, dy;
+    Sobel(small, dx, CV_32F, 1, 0);
+    Sobel(small, dy, CV_32F, 0, 1);
+    return mean(dx.mul(dx) + dy.mul(dy))[0];
+}
+
+bool FrameSelector::add(double sharpness) {
+    if (numFrames == 0) {
+        average = sharpness;
+    } else {
+        average += averageWeight * (sharpness - average);
+    }
+    numFrames++;
+
+    count++;
+    if (sharpness > best) {
+        best = sharpness;
+        return true;
+    }
+    return false;
+}
+
+bool FrameSelector::worthProcessing() const {
+    if (best <= 0.0) {
+        return false;
+    }
+    if (numFrames < averageFrames) {
+        return true;
+    }
+    return best >= minRelativeSharpness * average;
+}
+
+void FrameSelector::nextSlot() {
+    count = 0;
+    best = -1.0;
+}
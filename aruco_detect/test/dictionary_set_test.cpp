@@ -0,0 +1,203 @@
+#include <gtest/gtest.h>
+
+#include <aruco_detect/dictionary_set.h>
+
+#include <opencv2/imgproc.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+
+using namespace cv;
+
+// Compare with Dictionary::identify on random bits, and on markers with
+// a few bits flipped
+static void checkIdentify(int dictionaryNumber) {
+    Ptr<aruco::Dictionary> dictionary = aruco::getPredefinedDictionary(dictionaryNumber);
+    CodewordIndex index(dictionary);
+    int size = dictionary->markerSize;
+    ASSERT_EQ(dictionary->bytesList.rows, index.numMarkers());
+
+    std::mt19937 rng(dictionaryNumber);
+    std::vector<Mat> samples;
+    for (int i = 0; i < 500; i++) {
+        Mat bits(size, size, CV_8UC1);
+        for (int j = 0; j < size * size; j++) {
+            bits.at<unsigned char>(j / size, j % size) = rng() % 2;
+        }
+        samples.push_back(bits);
+    }
+    for (int m = 0; m < std::min(index.numMarkers(), 100); m++) {
+        Mat bits = aruco::Dictionary::getBitsFromByteList(dictionary->bytesList.row(m), size);
+        int turns = rng() % 4;
+        for (int t = 0; t < turns; t++) {
+            transpose(bits, bits);
+            flip(bits, bits, 0);
+        }
+        int flips = m % 5;
+        for (int j = 0; j < flips; j++) {
+            int b = rng() % (size * size);
+            bits.at<unsigned char>(b / size, b % size) ^= 1;
+        }
+        samples.push_back(bits);
+    }
+
+    for (double rate : {0.0, 0.6, 1.0}) {
+        for (const Mat &bits : samples) {
+            int expectedId = -1, expectedRotation = -1, id = -1, rotation = -1;
+            bool expected = dictionary->identify(bits, expectedId, expectedRotation, rate);
+            ASSERT_EQ(expected, index.identify(bits, id, rotation, rate));
+            if (expected) {
+                ASSERT_EQ(expectedId, id);
+                ASSERT_EQ(expectedRotation, rotation);
+            }
+        }
+    }
+}
+
+TEST (CodewordIndex, matches_dictionary) {
+    checkIdentify(aruco::DICT_4X4_50);
+    checkIdentify(aruco::DICT_5X5_1000);
+    checkIdentify(aruco::DICT_6X6_250);
+    checkIdentify(aruco::DICT_ARUCO_ORIGINAL);
+}
+
+TEST (CodewordIndex, wide_correction) {
+    // Few markers allowed to differ by many bits, so that candidates share
+    // chunks with several markers and ties between them are common
+    std::mt19937 rng(3);
+    Mat bytes;
+    for (int m = 0; m < 40; m++) {
+        Mat bits(5, 5, CV_8UC1);
+        for (int j = 0; j < 25; j++) {
+            bits.at<unsigned char>(j / 5, j % 5) = rng() % 2;
+        }
+        bytes.push_back(aruco::Dictionary::getByteListFromBits(bits));
+    }
+    Ptr<aruco::Dictionary> dictionary = makePtr<aruco::Dictionary>(bytes, 5, 8);
+    CodewordIndex index(dictionary);
+
+    for (int i = 0; i < 2000; i++) {
+        Mat bits(5, 5, CV_8UC1);
+        for (int j = 0; j < 25; j++) {
+            bits.at<unsigned char>(j / 5, j % 5) = rng() % 2;
+        }
+        for (double rate : {0.0, 0.25, 0.5, 1.0}) {
+            int expectedId = -1, expectedRotation = -1, id = -1, rotation = -1;
+            bool expected = dictionary->identify(bits, expectedId, expectedRotation, rate);
+            ASSERT_EQ(expected, index.identify(bits, id, rotation, rate));
+            if (expected) {
+                ASSERT_EQ(expectedId, id);
+                ASSERT_EQ(expectedRotation, rotation);
+            }
+        }
+    }
+}
+
+TEST (DictionarySet, load) {
+    Ptr<aruco::Dictionary> original = aruco::getPredefinedDictionary(aruco::DICT_4X4_50);
+    char filename[] = "/tmp/dictionaryXXXXXX.yml";
+    close(mkstemps(filename, 4));
+    {
+        FileStorage fs(filename, FileStorage::WRITE);
+        fs << "nmarkers" << 3;
+        fs << "markersize" << 4;
+        fs << "maxCorrectionBits" << original->maxCorrectionBits;
+        for (int m = 0; m < 3; m++) {
+            Mat bits = aruco::Dictionary::getBitsFromByteList(original->bytesList.row(m), 4);
+            std::string code;
+            for (int j = 0; j < 16; j++) {
+                code += bits.at<unsigned char>(j / 4, j % 4) ? '1' : '0';
+            }
+            fs << "marker_" + std::to_string(m) << code;
+        }
+    }
+
+    Ptr<aruco::Dictionary> loaded = DictionarySet::load(filename);
+    remove(filename);
+    ASSERT_FALSE(loaded.empty());
+    ASSERT_EQ(3, loaded->bytesList.rows);
+    ASSERT_EQ(4, loaded->markerSize);
+    ASSERT_EQ(0, norm(original->bytesList.rowRange(0, 3), loaded->bytesList, NORM_L1));
+
+    ASSERT_TRUE(DictionarySet::load("/nonexistent/dictionary.yml").empty());
+    DictionarySet set;
+    ASSERT_FALSE(set.add("/nonexistent/dictionary.yml", 1000));
+    ASSERT_TRUE(set.add("0", 1000));
+    ASSERT_EQ(1, set.size());
+
+    // The 50 markers of dictionary 0 have ids 1000 to 1049
+    ASSERT_FALSE(set.overlaps(0, 1000));
+    ASSERT_TRUE(set.overlaps(0, 1001));
+    ASSERT_TRUE(set.overlaps(1049, 10));
+    ASSERT_FALSE(set.overlaps(1050, 10));
+}
+
+TEST (DictionarySet, decode) {
+    Ptr<aruco::Dictionary> dictionary = aruco::getPredefinedDictionary(aruco::DICT_4X4_50);
+    Ptr<aruco::DetectorParameters> params = makePtr<aruco::DetectorParameters>();
+
+    // A marker 120 pixels across at (40, 40)
+    Mat image(200, 200, CV_8UC1, Scalar::all(255));
+    Mat marker;
+    aruco::drawMarker(dictionary, 7, 120, marker);
+    marker.copyTo(image(Rect(40, 40, 120, 120)));
+
+    std::vector<Point2f> square = {Point2f(40, 40), Point2f(159, 40), Point2f(159, 159),
+                                   Point2f(40, 159)};
+    // The same corners starting from the bottom left, and a blank patch
+    std::vector<std::vector<Point2f>> candidates = {
+        {square[3], square[0], square[1], square[2]},
+        {Point2f(0, 0), Point2f(30, 0), Point2f(30, 30), Point2f(0, 30)}};
+
+    DictionarySet set;
+    set.add(aruco::getPredefinedDictionary(aruco::DICT_6X6_50), 100);
+    set.add(dictionary, 1000);
+
+    std::vector<std::vector<Point2f>> corners;
+    std::vector<int> ids;
+    set.decode(image, candidates, params, false, corners, ids);
+    ASSERT_EQ(1, ids.size());
+    ASSERT_EQ(1007, ids[0]);
+    for (int j = 0; j < 4; j++) {
+        ASSERT_EQ(square[j], corners[0][j]);
+    }
+}
+
+TEST (DictionarySet, decode_same_id) {
+    Ptr<aruco::Dictionary> dictionary = aruco::getPredefinedDictionary(aruco::DICT_4X4_50);
+    Ptr<aruco::DetectorParameters> params = makePtr<aruco::DetectorParameters>();
+
+    // Two copies of a marker 120 pixels across, at (40, 40) and (240, 40)
+    Mat image(200, 400, CV_8UC1, Scalar::all(255));
+    Mat marker;
+    aruco::drawMarker(dictionary, 7, 120, marker);
+    marker.copyTo(image(Rect(40, 40, 120, 120)));
+    marker.copyTo(image(Rect(240, 40, 120, 120)));
+
+    // The first also found by a contour just inside its border
+    std::vector<std::vector<Point2f>> candidates = {
+        {Point2f(43, 43), Point2f(156, 43), Point2f(156, 156), Point2f(43, 156)},
+        {Point2f(40, 40), Point2f(159, 40), Point2f(159, 159), Point2f(40, 159)},
+        {Point2f(240, 40), Point2f(359, 40), Point2f(359, 159), Point2f(240, 159)}};
+
+    DictionarySet set;
+    set.add(dictionary, 0);
+
+    std::vector<std::vector<Point2f>> corners;
+    std::vector<int> ids;
+    set.decode(image, candidates, params, false, corners, ids);
+    ASSERT_EQ(2, ids.size());
+    ASSERT_EQ(7, ids[0]);
+    ASSERT_EQ(7, ids[1]);
+    for (int j = 0; j < 4; j++) {
+        ASSERT_EQ(candidates[1][j], corners[0][j]);
+        ASSERT_EQ(candidates[2][j], corners[1][j]);
+    }
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include <aruco_detect/frame_selector.h>
+
+#include <opencv2/imgproc.hpp>
+
+using namespace cv;
+
+TEST (FrameSelector, sharpness) {
+    // Checkerboard of 20 pixel squares
+    Mat sharp(240, 320, CV_8UC3, Scalar::all(255));
+    for (int y = 0; y < sharp.rows; y += 20) {
+        for (int x = (y / 20 % 2) * 20; x < sharp.cols; x += 40) {
+            sharp(Rect(x, y, 20, 20)).setTo(Scalar::all(0));
+        }
+    }
+    Mat blurred;
+    GaussianBlur(sharp, blurred, Size(31, 31), 8.0);
+
+    double s = FrameSelector::sharpness(sharp, 4);
+    ASSERT_GT(s, 0.0);
+    ASSERT_LT(FrameSelector::sharpness(blurred, 4), 0.5 * s);
+    ASSERT_GT(FrameSelector::sharpness(sharp, 1), 0.0);
+
+    // Too dark to find anything in
+    ASSERT_EQ(0.0, FrameSelector::sharpness(Mat(240, 320, CV_8UC1, Scalar::all(2)), 4));
+    ASSERT_EQ(0.0, FrameSelector::sharpness(Mat(), 4));
+}
+
+TEST (FrameSelector, slots) {
+    FrameSelector selector;
+    selector.configure(3, 0.5);
+
+    ASSERT_TRUE(selector.add(1.0));
+    ASSERT_TRUE(selector.add(5.0));
+    ASSERT_FALSE(selector.slotFull());
+    ASSERT_FALSE(selector.add(2.0));
+    ASSERT_TRUE(selector.slotFull());
+    ASSERT_TRUE(selector.worthProcessing());
+    selector.nextSlot();
+    ASSERT_FALSE(selector.slotFull());
+
+    for (int i = 0; i < 12; i++) {
+        selector.add(10.0);
+        if (selector.slotFull()) {
+            selector.nextSlot();
+        }
+    }
+
+    // A slot of blurred frames is skipped
+    selector.add(1.0);
+    selector.add(2.0);
+    selector.add(1.0);
+    ASSERT_TRUE(selector.slotFull());
+    ASSERT_FALSE(selector.worthProcessing());
+    selector.nextSlot();
+
+    // Unless only badly exposed frames are skipped
+    selector.configure(1, 0.0);
+    ASSERT_TRUE(selector.add(0.5));
+    ASSERT_TRUE(selector.slotFull());
+    ASSERT_TRUE(selector.worthProcessing());
+    selector.nextSlot();
+    selector.add(0.0);
+    ASSERT_FALSE(selector.worthProcessing());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,169 @@
+#ifndef FIDUCIAL_MSGS_COMPACT_H
+#define FIDUCIAL_MSGS_COMPACT_H
+
+// Conversions between the fiducial messages and their compact forms, which
+// are about half the size on the wire. Positions lose precision beyond
+// float32, and rotations beyond about 1e-6 per quaternion component
+
+#include <fiducial_msgs/CompactFiducialArray.h>
+#include <fiducial_msgs/CompactFiducialTransformArray.h>
+#include <fiducial_msgs/FiducialArray.h>
+#include <fiducial_msgs/FiducialTransformArray.h>
+#include <geometry_msgs/Quaternion.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace fiducial_msgs {
+
+namespace compact {
+
+static const int componentBits = 20;
+static const uint64_t componentMax = (1u << componentBits) - 1;
+static const double componentRange = 0.70710678118654752440;  // 1 / sqrt(2)
+
+}  // namespace compact
+
+// Pack a unit quaternion as its three smallest components, which are each
+// within +-1/sqrt(2), and the index of the largest, which is implied by the
+// others. q and -q are the same rotation, so the largest is made positive
+inline uint64_t packQuaternion(const geometry_msgs::Quaternion &q) {
+    double c[4] = {q.x, q.y, q.z, q.w};
+    double norm = std::sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2] + c[3] * c[3]);
+    if (!(norm > 0.0)) {
+        c[0] = c[1] = c[2] = 0.0;
+        c[3] = norm = 1.0;
+    }
+
+    int largest = 0;
+    for (int i = 1; i < 4; i++) {
+        if (std::fabs(c[i]) > std::fabs(c[largest])) {
+            largest = i;
+        }
+    }
+    double sign = c[largest] < 0 ? -1.0 : 1.0;
+
+    uint64_t packed = (uint64_t)largest << (3 * compact::componentBits);
+    int shift = 2 * compact::componentBits;
+    for (int i = 0; i < 4; i++) {
+        if (i == largest) {
+            continue;
+        }
+        double v = sign * c[i] / norm / compact::componentRange;
+        v = std::max(-1.0, std::min(1.0, v));
+        uint64_t bits = (uint64_t)std::lround((v + 1.0) * 0.5 * compact::componentMax);
+        packed |= bits << shift;
+        shift -= compact::componentBits;
+    }
+    return packed;
+}
+
+inline void unpackQuaternion(uint64_t packed, geometry_msgs::Quaternion &q) {
+    int largest = (int)(packed >> (3 * compact::componentBits)) & 3;
+    double c[4];
+    double sum = 0.0;
+    int shift = 2 * compact::componentBits;
+    for (int i = 0; i < 4; i++) {
+        if (i == largest) {
+            continue;
+        }
+        uint64_t bits = (packed >> shift) & compact::componentMax;
+        c[i] = ((double)bits / compact::componentMax * 2.0 - 1.0) * compact::componentRange;
+        sum += c[i] * c[i];
+        shift -= compact::componentBits;
+    }
+    c[largest] = std::sqrt(std::max(0.0, 1.0 - sum));
+
+    q.x = c[0];
+    q.y = c[1];
+    q.z = c[2];
+    q.w = c[3];
+}
+
+inline void toCompact(const FiducialTransform &ft, CompactFiducialTransform &c) {
+    c.fiducial_id = ft.fiducial_id;
+    c.translation[0] = ft.transform.translation.x;
+    c.translation[1] = ft.transform.translation.y;
+    c.translation[2] = ft.transform.translation.z;
+    c.rotation = packQuaternion(ft.transform.rotation);
+    c.image_error = ft.image_error;
+    c.object_error = ft.object_error;
+    c.fiducial_area = ft.fiducial_area;
+}
+
+inline void fromCompact(const CompactFiducialTransform &c, FiducialTransform &ft) {
+    ft.fiducial_id = c.fiducial_id;
+    ft.transform.translation.x = c.translation[0];
+    ft.transform.translation.y = c.translation[1];
+    ft.transform.translation.z = c.translation[2];
+    unpackQuaternion(c.rotation, ft.transform.rotation);
+    ft.image_error = c.image_error;
+    ft.object_error = c.object_error;
+    ft.fiducial_area = c.fiducial_area;
+}
+
+inline void toCompact(const FiducialTransformArray &fta, CompactFiducialTransformArray &c) {
+    c.header = fta.header;
+    c.image_seq = fta.image_seq;
+    c.transforms.resize(fta.transforms.size());
+    for (size_t i = 0; i < fta.transforms.size(); i++) {
+        toCompact(fta.transforms[i], c.transforms[i]);
+    }
+}
+
+inline void fromCompact(const CompactFiducialTransformArray &c, FiducialTransformArray &fta) {
+    fta.header = c.header;
+    fta.image_seq = c.image_seq;
+    fta.transforms.resize(c.transforms.size());
+    for (size_t i = 0; i < c.transforms.size(); i++) {
+        fromCompact(c.transforms[i], fta.transforms[i]);
+    }
+}
+
+inline void toCompact(const Fiducial &f, CompactFiducial &c) {
+    c.fiducial_id = f.fiducial_id;
+    c.corners[0] = f.x0;
+    c.corners[1] = f.y0;
+    c.corners[2] = f.x1;
+    c.corners[3] = f.y1;
+    c.corners[4] = f.x2;
+    c.corners[5] = f.y2;
+    c.corners[6] = f.x3;
+    c.corners[7] = f.y3;
+}
+
+inline void fromCompact(const CompactFiducial &c, Fiducial &f) {
+    f.fiducial_id = c.fiducial_id;
+    f.direction = 0;
+    f.x0 = c.corners[0];
+    f.y0 = c.corners[1];
+    f.x1 = c.corners[2];
+    f.y1 = c.corners[3];
+    f.x2 = c.corners[4];
+    f.y2 = c.corners[5];
+    f.x3 = c.corners[6];
+    f.y3 = c.corners[7];
+}
+
+inline void toCompact(const FiducialArray &fa, CompactFiducialArray &c) {
+    c.header = fa.header;
+    c.image_seq = fa.image_seq;
+    c.fiducials.resize(fa.fiducials.size());
+    for (size_t i = 0; i < fa.fiducials.size(); i++) {
+        toCompact(fa.fiducials[i], c.fiducials[i]);
+    }
+}
+
+inline void fromCompact(const CompactFiducialArray &c, FiducialArray &fa) {
+    fa.header = c.header;
+    fa.image_seq = c.image_seq;
+    fa.fiducials.resize(c.fiducials.size());
+    for (size_t i = 0; i < c.fiducials.size(); i++) {
+        fromCompact(c.fiducials[i], fa.fiducials[i]);
+    }
+}
+
+}  // namespace fiducial_msgs
+
+#endif
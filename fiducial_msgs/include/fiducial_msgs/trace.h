@@ -0,0 +1,166 @@
+#ifndef FIDUCIAL_MSGS_TRACE_H
+#define FIDUCIAL_MSGS_TRACE_H
+
+// Per-frame trace of the stages that fiducials pass through, from the camera
+// to the pose estimate. Stages are timed on the monotonic clock, which all
+// nodes on a host share, so traces dumped by different nodes line up. They
+// are written in the Chrome trace format, which chrome://tracing and
+// ui.perfetto.dev display, and are matched across nodes by the image stamp
+
+#include <ros/time.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace fiducial_msgs {
+
+// One stage of processing a frame. Times are nanoseconds on the monotonic
+// clock, and name must be a string literal
+struct TraceEvent {
+    const char *name;
+    uint32_t seq;
+    double stamp;
+    int64_t start;
+    int64_t end;
+    uint32_t thread;
+};
+
+// The most recent trace events, overwriting the oldest when full. Recording
+// takes a short lock and doesn't allocate. An empty buffer records nothing
+class TraceBuffer {
+public:
+    explicit TraceBuffer(size_t capacity = 0) : events(capacity), next(0) {}
+
+    // Not safe while events are being recorded
+    void resize(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.assign(capacity, TraceEvent());
+        next = 0;
+    }
+
+    bool enabled() const { return !events.empty(); }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    void record(const char *name, uint32_t seq, const ros::Time &stamp, int64_t start,
+                int64_t end) {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        TraceEvent &e = events[next % events.size()];
+        e.name = name;
+        e.seq = seq;
+        e.stamp = stamp.toSec();
+        e.start = start;
+        e.end = end;
+        e.thread = threadId();
+        next++;
+    }
+
+    // Record the time from the frame's image stamp until now, which covers
+    // the camera, the network and any earlier nodes
+    void recordAge(const char *name, uint32_t seq, const ros::Time &stamp) {
+        if (!enabled()) {
+            return;
+        }
+        int64_t end = now();
+        int64_t age = (ros::Time::now() - stamp).toNSec();
+        if (age >= 0) {
+            record(name, seq, stamp, end - age, end);
+        }
+    }
+
+    // Number of events held, which is at most the capacity
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next < events.size() ? next : events.size();
+    }
+
+    std::vector<TraceEvent> snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<TraceEvent> out;
+        if (events.empty()) {
+            return out;
+        }
+        size_t first = next > events.size() ? next - events.size() : 0;
+        out.reserve(next - first);
+        for (size_t i = first; i < next; i++) {
+            out.push_back(events[i % events.size()]);
+        }
+        return out;
+    }
+
+    // Write the events, oldest first, as a Chrome trace of the process
+    bool dump(const std::string &filename, const std::string &process) const {
+        std::vector<TraceEvent> out = snapshot();
+        FILE *fp = fopen(filename.c_str(), "w");
+        if (fp == nullptr) {
+            return false;
+        }
+        int pid = getpid();
+        fprintf(fp,
+                "{\"traceEvents\":[\n"
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+                pid, process.c_str());
+        for (const TraceEvent &e : out) {
+            fprintf(fp,
+                    ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3lf,"
+                    "\"dur\":%.3lf,\"args\":{\"seq\":%u,\"stamp\":%.6lf}}",
+                    e.name, pid, e.thread, e.start / 1e3, (e.end - e.start) / 1e3, e.seq,
+                    e.stamp);
+        }
+        fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        return fclose(fp) == 0;
+    }
+
+private:
+    // Small ids for threads, which are easier to read in the trace
+    static uint32_t threadId() {
+        static std::atomic<uint32_t> nextId(1);
+        thread_local uint32_t id = nextId++;
+        return id;
+    }
+
+    std::vector<TraceEvent> events;
+    size_t next;
+    mutable std::mutex mutex;
+};
+
+// Records a stage from construction to destruction
+class TraceSpan {
+public:
+    TraceSpan(TraceBuffer &buffer, const char *name, uint32_t seq, const ros::Time &stamp)
+        : buffer(buffer),
+          name(name),
+          seq(seq),
+          stamp(stamp),
+          start(buffer.enabled() ? TraceBuffer::now() : 0) {}
+
+    ~TraceSpan() {
+        if (buffer.enabled()) {
+            buffer.record(name, seq, stamp, start, TraceBuffer::now());
+        }
+    }
+
+private:
+    TraceBuffer &buffer;
+    const char *name;
+    uint32_t seq;
+    ros::Time stamp;
+    int64_t start;
+};
+
+}  // namespace fiducial_msgs
+
+#endif
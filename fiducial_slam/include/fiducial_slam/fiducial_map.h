@@ -0,0 +1,181 @@
+#ifndef FIDUCIAL_MAP_H
+#define FIDUCIAL_MAP_H
+
+#include <fiducial_slam/transform_with_variance.h>
+
+#include <ros/time.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Ids of the fiducials linked to one fiducial, kept as a sorted array
+// rather than a node based set
+class FiducialLinks {
+public:
+    typedef std::vector<int>::const_iterator const_iterator;
+
+    // Add a link, returns false if it was already present
+    bool insert(int id);
+    bool erase(int id);
+    size_t count(int id) const;
+
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+    void clear() { ids.clear(); }
+
+    const_iterator begin() const { return ids.begin(); }
+    const_iterator end() const { return ids.end(); }
+
+private:
+    std::vector<int> ids;
+};
+
+// A single fiducial that is in the map. Poses are in the map frame, which
+// is common to all fiducials so isn't stored with each one
+class Fiducial {
+public:
+    int id;
+    int numObs;
+    bool visible;
+    FiducialLinks links;  // Stores the IDs of connected fiducials
+
+    TransformWithVariance pose;
+    ros::Time lastPublished;
+
+    void update(const TransformWithVariance &newPose);
+
+    Fiducial() : id(-1), numObs(0), visible(false) {}
+
+    Fiducial(int id, const TransformWithVariance &pose);
+};
+
+// Read a fiducial from a line of a map file. Returns false if the line is invalid
+bool parseFiducial(const char *line, Fiducial &f);
+
+// Write a fiducial as a line of a map file
+void writeFiducial(FILE *fp, const Fiducial &f);
+
+// Fiducials stored in order of id, in chunks of contiguous entries so that
+// inserting or erasing one only moves the others in its chunk. A fiducial
+// is found by binary search of the chunks and then within its chunk, so
+// ids can be anywhere in the range of int. The interface follows
+// std::map<int, Fiducial> so that iterating gives (id, fiducial) pairs.
+// Inserting or erasing a fiducial invalidates references to the others.
+//
+// Copies share chunks, and a chunk is only copied when it is first changed
+// through a map that shares it, so a snapshot costs a pointer per chunk
+// and the chunks changed after it. Changes happen through non-const
+// access, so a map that is only read should be read through a const
+// reference. A copy can be read by other threads while the map it came
+// from is changed
+class FiducialMap {
+public:
+    typedef std::pair<int, Fiducial> value_type;
+
+    template <class Map, class Value>
+    class Iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef FiducialMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Value *pointer;
+        typedef Value &reference;
+
+        Iterator() : map(nullptr), chunk(0), pos(0) {}
+
+        // An iterator converts to a const_iterator
+        template <class OtherMap, class OtherValue>
+        Iterator(const Iterator<OtherMap, OtherValue> &other)
+            : map(other.map), chunk(other.chunk), pos(other.pos) {}
+
+        reference operator*() const { return map->entry(chunk, pos); }
+        pointer operator->() const { return &map->entry(chunk, pos); }
+
+        Iterator &operator++() {
+            if (++pos == map->chunkSize(chunk)) {
+                chunk++;
+                pos = 0;
+            }
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const Iterator &other) const {
+            return chunk == other.chunk && pos == other.pos;
+        }
+        bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+    private:
+        friend class FiducialMap;
+        template <class OtherMap, class OtherValue>
+        friend class Iterator;
+
+        Iterator(Map *map, size_t chunk, size_t pos) : map(map), chunk(chunk), pos(pos) {}
+
+        Map *map;
+        size_t chunk;
+        size_t pos;
+    };
+
+    typedef Iterator<FiducialMap, value_type> iterator;
+    typedef Iterator<const FiducialMap, const value_type> const_iterator;
+
+    FiducialMap() : numEntries(0) {}
+
+    iterator begin() { return iterator(this, 0, 0); }
+    iterator end() { return iterator(this, chunks.size(), 0); }
+    const_iterator begin() const { return const_iterator(this, 0, 0); }
+    const_iterator end() const { return const_iterator(this, chunks.size(), 0); }
+
+    size_t size() const { return numEntries; }
+    bool empty() const { return numEntries == 0; }
+    void clear();
+
+    iterator find(int id);
+    const_iterator find(int id) const;
+    size_t count(int id) const { return find(id) != end(); }
+
+    // First fiducial with an id greater than id
+    iterator upper_bound(int id);
+    const_iterator upper_bound(int id) const;
+
+    // Fiducial with the given id, default constructed if not present
+    Fiducial &operator[](int id);
+
+    size_t erase(int id);
+    // Erase any of ids that are present, compacting the chunks once rather
+    // than for each id. Returns the number erased
+    size_t erase(const std::vector<int> &ids);
+
+private:
+    typedef std::vector<value_type> Chunk;
+
+    // Chunks are split when they reach twice this size
+    static const size_t targetChunkSize = 64;
+
+    // Chunks in order of id, none of them empty
+    std::vector<std::shared_ptr<Chunk>> chunks;
+    size_t numEntries;
+
+    // Chunk that id is in or would be inserted into, and its position there.
+    // Returns whether it is present
+    bool locate(int id, size_t &chunk, size_t &pos) const;
+
+    // Chunk that can be changed, copying it first if it is shared
+    Chunk &mutableChunk(size_t chunk);
+
+    size_t chunkSize(size_t chunk) const { return chunks[chunk]->size(); }
+    value_type &entry(size_t chunk, size_t pos) { return mutableChunk(chunk)[pos]; }
+    const value_type &entry(size_t chunk, size_t pos) const { return (*chunks[chunk])[pos]; }
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef FRAME_COLLECTOR_H
+#define FRAME_COLLECTOR_H
+
+#include <fiducial_slam/observation.h>
+
+#include <fiducial_msgs/CompactFiducialTransformArray.h>
+#include <fiducial_msgs/FiducialTransformArray.h>
+#include <ros/time.h>
+
+#include <functional>
+#include <vector>
+
+// Turns fiducial transforms from one or more cameras into frames of
+// observations for the map. Those from different cameras taken at about
+// the same time are combined into one frame, which is passed on once every
+// camera has been heard from, when a camera sends another, or when it is
+// older than the sync window
+class FrameCollector {
+public:
+    // Receives each frame and the time of its latest image. The observations
+    // may be exchanged for an empty buffer to be filled with the next frame
+    typedef std::function<void(std::vector<Observation> &, const ros::Time &)> Sink;
+
+    FrameCollector();
+
+    // With useArea, the variance of each observation is weightingScale over
+    // the fiducial's area in pixels, otherwise weightingScale times its
+    // reprojection error
+    void configure(int numStreams, double syncWindow, bool useArea, double weightingScale,
+                   const Sink &sink);
+
+    void add(const fiducial_msgs::FiducialTransformArray &msg, int stream);
+    void add(const fiducial_msgs::CompactFiducialTransformArray &msg, int stream);
+    void flush();
+    // Pass on a frame that has been waiting longer than the sync window
+    void flushStale(const ros::Time &now);
+
+private:
+    // Start adding the transforms from a message, returning the id of its frame
+    int begin(const std_msgs::Header &header, int stream);
+    void end();
+    double variance(double objectError, double fiducialArea) const;
+
+    double syncWindow;
+    bool useArea;
+    double weightingScale;
+    Sink sink;
+
+    std::vector<Observation> observations;
+    std::vector<bool> streamPending;
+    bool havePending;
+    ros::Time pendingStart;
+    ros::Time pendingTime;
+};
+
+#endif
@@ -31,6 +31,7 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include <ros/callback_queue.h>
 #include <ros/ros.h>
 #include <tf2/LinearMath/Quaternion.h>
 #include <tf2/LinearMath/Transform.h>
@@ -45,9 +46,18 @@
 
 #include <fiducial_msgs/FiducialMapEntry.h>
 #include <fiducial_msgs/FiducialMapEntryArray.h>
+#include <fiducial_msgs/trace.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
 #include <tf2/convert.h>
@@ -55,43 +65,69 @@
 
 #include <std_srvs/Empty.h>
 #include <fiducial_slam/AddFiducial.h>
+#include <fiducial_slam/FitPlane.h>
+#include <fiducial_slam/GetMapStats.h>
+#include <fiducial_slam/ImportMap.h>
+#include <fiducial_slam/MoveOrigin.h>
+#include <fiducial_slam/RemoveFiducial.h>
 
+#include <fiducial_slam/fiducial_map.h>
+#include <fiducial_slam/map_edit.h>
+#include <fiducial_slam/map_params.h>
+#include <fiducial_slam/map_stats.h>
+#include <fiducial_slam/map_tiles.h>
+#include <fiducial_slam/observation.h>
+#include <fiducial_slam/pose_graph.h>
+#include <fiducial_slam/relocalizer.h>
+#include <fiducial_slam/robust_pose.h>
+#include <fiducial_slam/spatial_index.h>
+#include <fiducial_slam/transform_with_covariance.h>
 #include <fiducial_slam/transform_with_variance.h>
 
-// An observation of a single fiducial in a single image
-class Observation {
+// The last pose estimated from fiducials, along with the odometry at the time
+// so that it can be extrapolated, and the epoch of the map it is in
+class PoseFix {
 public:
-    int fid;
-    tf2::Stamped<TransformWithVariance> T_fidCam;
-    tf2::Stamped<TransformWithVariance> T_camFid;
-
-    Observation(){};
-
-    Observation(int fid, const tf2::Stamped<TransformWithVariance> &camFid);
+    TransformWithCovariance T_mapBase;
+    tf2::Transform T_odomBase;
+    ros::Time stamp;
+    geometry_msgs::TransformStamped poseTf;
+    int mapEpoch;
 };
 
-// A single fiducial that is in the map
-class Fiducial {
+// Pose of a camera on the robot, and when it was looked up
+class CameraExtrinsics {
 public:
-    int id;
-    int numObs;
-    bool visible;
-    std::set<int> links;  // Stores the IDs of connected fiducials
-
-    tf2::Stamped<TransformWithVariance> pose;
-    ros::Time lastPublished;
-
-    void update(const tf2::Stamped<TransformWithVariance> &newPose);
+    tf2::Transform T_baseCam;
+    ros::Time lookedUp;
+};
 
-    Fiducial() {}
+// Summary of the map for the statistics service, worked out along with
+// each snapshot from what is kept up to date anyway
+class MapSummary {
+public:
+    int numFiducials;
+    int numLinks;
+    int numComponents;
+    int largestComponent;
+};
 
-    Fiducial(int id, const tf2::Stamped<TransformWithVariance> &pose);
+// Immutable copy of the map for readers. The version goes up by one each
+// time the map changes, so readers can tell if they have already seen it.
+// The epoch only changes when the map is moved or cleared. The fiducials
+// share the chunks that haven't changed with the map and earlier snapshots
+class MapSnapshot {
+public:
+    uint64_t version;
+    int epoch;
+    FiducialMap fiducials;
+    MapSummary summary;
 };
 
 // Class containing map data
 class Map {
 public:
-    tf2_ros::TransformBroadcaster broadcaster;
+    std::unique_ptr<tf2_ros::TransformBroadcaster> broadcaster;
     tf2_ros::Buffer tfBuffer;
     std::unique_ptr<tf2_ros::TransformListener> listener;
 
@@ -102,9 +138,28 @@ public:
 
     ros::ServiceServer clearSrv;
     ros::ServiceServer addSrv;
+    ros::ServiceServer optimizeSrv;
+    ros::ServiceServer statsSrv;
+    ros::ServiceServer moveOriginSrv;
+    ros::ServiceServer fitPlaneSrv;
+    ros::ServiceServer removeSrv;
+    ros::ServiceServer importSrv;
+    ros::ServiceServer dumpTraceSrv;
     bool clearCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res);
     bool addFiducialCallback(fiducial_slam::AddFiducial::Request &req,
                              fiducial_slam::AddFiducial::Response &res);
+    bool optimizeCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res);
+    bool statsCallback(fiducial_slam::GetMapStats::Request &req,
+                       fiducial_slam::GetMapStats::Response &res);
+    bool moveOriginCallback(fiducial_slam::MoveOrigin::Request &req,
+                            fiducial_slam::MoveOrigin::Response &res);
+    bool fitPlaneCallback(fiducial_slam::FitPlane::Request &req,
+                          fiducial_slam::FitPlane::Response &res);
+    bool removeFiducialCallback(fiducial_slam::RemoveFiducial::Request &req,
+                                fiducial_slam::RemoveFiducial::Response &res);
+    bool importMapCallback(fiducial_slam::ImportMap::Request &req,
+                           fiducial_slam::ImportMap::Response &res);
+    bool dumpTraceCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res);
 
     std::string mapFilename;
     std::string mapFrame;
@@ -114,13 +169,22 @@ public:
     double future_date_transforms;
     bool publish_6dof_pose;
     double multiErrorThreshold;
+    RobustPoseSolver poseSolver;
 
-    bool isInitializingMap;
+    std::atomic<bool> isInitializingMap;
     bool readOnly;
+    double tfTimeout;
     int frameNum;
     int initialFrameNum;
     int originFid;
 
+    // Relative poses of the fiducials seen while initializing the map
+    bool multiFiducialInit;
+    int initMinObservations;
+    double initMaxError;
+    PoseGraph initGraph;
+    std::map<int, int> initObservations;
+
     bool overridePublishedCovariance;
     std::vector<double> covarianceDiagonal;
 
@@ -130,28 +194,188 @@ public:
     ros::Time tfPublishTime;
     geometry_msgs::TransformStamped poseTf;
 
-    std::map<int, Fiducial> fiducials;
+    // The map is modified by a single writer with mapMutex held, which is
+    // the map thread or, without one, the frame callback. Anything else
+    // that changes the map queues a command, which the writer applies
+    // between frames. Readers use an immutable snapshot that is replaced
+    // after each batch of updates
+    FiducialMap fiducials;
     int fiducialToAdd;
+    std::mutex mapMutex;
+    uint64_t mapVersion;
+    std::shared_ptr<const MapSnapshot> snapshot;
+    std::vector<std::packaged_task<bool()>> commands;
+    std::vector<std::packaged_task<bool()>> runningCommands;
+
+    // Spatial index of fiducial positions, kept in step with fiducials
+    SpatialIndex fiducialIndex;
+    double visibilityRange;
+    double cameraHfov;
+    double cameraVfov;
+    std::vector<int> visibleFids;
+    std::vector<int> nearbyFids;
+    tf2::Transform lastMapCam;
+    bool haveMapCam;
+    int markerCursor;
+    // When the map thread last went round the markers
+    ros::Time markerRefreshTime;
+
+    // Checks frames against the map after startup or losing track
+    bool relocalize;
+    double relocalizeTimeout;
+    ros::Time lastPoseTime;
+    Relocalizer relocalizer;
+    std::vector<std::pair<int, tf2::Transform>> relocalizeObserved;
+    std::vector<int> relocalizeInliers;
+
+    // Last pose, and the odometry at the time, to predict the next one. These
+    // belong to the frame thread, and are dropped when it sees that the
+    // snapshot it estimates against has a new epoch
+    int poseEpoch;
+    double odomGate;
+    double odomVariance;
+    double odomTimeVariance;
+    TransformWithCovariance lastMapBase;
+    tf2::Transform lastOdomBase;
+    ros::Time lastOdomTime;
+    bool haveOdomPose;
+
+    // Camera poses on the robot by interned frame id, so that observations
+    // from several cameras can be brought into one frame and solved together
+    double extrinsicsRefresh;
+    std::unordered_map<int, CameraExtrinsics> cameraExtrinsics;
+
+    // Reused from frame to frame so that estimating a pose and updating the
+    // map don't allocate
+    std::vector<int> estimateFids;
+    std::vector<int> rejectedFids;
+    MapUpdate inlineUpdate;
+    std::vector<std::pair<int, TransformWithVariance>> mapEstimates;
+    TransformBatch fuseBatch;
+
+    // High rate pose output, with its own queue and thread. The last fix is
+    // an immutable snapshot, so is read without locking. Fixes are taken
+    // from a pool and reused once the timer has let go of them
+    double posePublishRate;
+    ros::Publisher extrapolatedPosePub;
+    ros::CallbackQueue poseQueue;
+    ros::Timer poseTimer;
+    std::unique_ptr<ros::AsyncSpinner> poseSpinner;
+    std::shared_ptr<const PoseFix> lastFix;
+    std::vector<std::shared_ptr<PoseFix>> fixPool;
+    std::shared_ptr<const FiducialMap> relocalizerMap;
+    ros::Time relocalizerBuilt;
+
+    // Parts of the map that are in memory, for maps too large to hold at once
+    MapTiles tiles;
+    double tileRadius;
+
+    // Map maintenance thread, so that updating, optimizing and saving the map
+    // don't delay pose estimates
+    bool backgroundUpdates;
+    int updateQueueSize;
+    MapUpdateQueue updateQueue;
+    std::mutex updateMutex;
+    std::condition_variable updateCv;
+    bool quitUpdates;
+    std::thread updateThread;
+
+    // Frames waiting to be solved together
+    int smoothingWindow;
+    std::vector<MapUpdate> window;
+
+    // Relative observations between fiducials, optimized in the background
+    PoseGraph poseGraph;
+    PoseGraphOptimizer optimizer;
+    int optimizeInterval;
+    int optimizeIterations;
+    double optimizePriorVariance;
+    bool optimizeRequested;
+    // Set when the map has been edited while an optimization of the old
+    // poses was running, so that its result is thrown away
+    bool staleOptimization;
+    // Goes up when the map is moved as a whole or cleared, so that poses
+    // estimated against the old map aren't used to update it or published.
+    // It is changed with poseMutex held, which poses are published under
+    std::atomic<int> mapEpoch;
+    std::mutex poseMutex;
+
+    // Health of the map and the time spent on it, kept up to date as frames
+    // arrive so that the statistics service doesn't have to work them out
+    LinkComponents linkComponents;
+    bool componentsDirty;
+    std::atomic<uint64_t> numFrames;
+    std::atomic<uint64_t> numPoseFrames;
+    std::atomic<uint64_t> numDroppedFrames;
+    TimingHistogram updateTiming;
+    TimingHistogram poseTiming;
+    TimingHistogram applyTiming;
+    TimingHistogram snapshotTiming;
+    mutable TimingHistogram tfWaitTiming;
+    // Stages of recent frames, keyed by image stamp, dumped to traceFile
+    mutable fiducial_msgs::TraceBuffer trace;
+    std::string traceFile;
 
     Map(ros::NodeHandle &nh);
+    explicit Map(const MapParams &params);
+    ~Map();
     void update();
     void update(std::vector<Observation> &obs, const ros::Time &time);
+    bool applyUpdate(const MapUpdate &u);
+    void updateThreadMain();
+    std::shared_ptr<const FiducialMap> getSnapshot() const;
+    std::shared_ptr<const MapSnapshot> getVersionedSnapshot() const;
+    void publishSnapshot();
+    std::future<bool> submitCommand(const std::function<bool()> &command);
+    bool runCommand(const std::function<bool()> &command);
+    bool applyCommands();
+    void clearMap();
+    void transformMap(const tf2::Transform &T);
+    void movedFiducials();
+    void newEpoch();
+    void chooseOrigin();
+    bool removeFiducial(int id);
+    void discardOptimization();
     void autoInit(const std::vector<Observation> &obs, const ros::Time &time);
+    void initFromGraph();
+    bool relocalizeFrame(std::vector<Observation> &obs,
+                         const std::shared_ptr<const FiducialMap> &snap, const ros::Time &time);
+    bool lookupExtrinsics(int frame, const ros::Time &time, tf2::Transform &T_baseCam);
+    void alignObservations(std::vector<Observation> &obs, const ros::Time &time);
+    bool predictPose(const ros::Time &time, TransformWithCovariance &predicted,
+                     tf2::Transform &T_odomBase);
+    TransformWithCovariance odomMotion(const tf2::Transform &delta, double seconds) const;
+    std::shared_ptr<PoseFix> freeFix();
+    void poseTimerCallback(const ros::TimerEvent &event);
+    void publishPrediction(const TransformWithCovariance &predicted,
+                           const tf2::Transform &T_odomBase, const ros::Time &time);
     int updatePose(std::vector<Observation> &obs, const ros::Time &time,
                    tf2::Stamped<TransformWithVariance> &cameraPose);
     void updateMap(const std::vector<Observation> &obs, const ros::Time &time,
                    const tf2::Stamped<TransformWithVariance> &cameraPose);
+    void noteObservations(const std::vector<Observation> &obs);
+    void smoothWindow();
     void handleAddFiducial(const std::vector<Observation> &obs);
+    void requestOptimization();
+    void updateTiles(const std::vector<Observation> &obs);
+    void indexFiducial(const Fiducial &f);
+    void predictVisible(const tf2::Transform &T_mapCam, std::vector<int> &ids) const;
+    bool applyOptimization();
+    bool buildOptimizationGraph(PoseGraph &graph) const;
+    void applyOptimizedGraph(const PoseGraph &result);
+    void optimize(int iterations);
 
     bool loadMap();
     bool loadMap(std::string filename);
     bool saveMap();
     bool saveMap(std::string filename);
+    bool saveTiles();
 
     void publishTf();
     void publishMap();
     void publishMarker(Fiducial &fid);
     void publishMarkers();
+    void deleteMarkers(int id);
     void drawLine(const tf2::Vector3 &p0, const tf2::Vector3 &p1);
 
     bool lookupTransform(const std::string &from, const std::string &to, const ros::Time &time,
@@ -0,0 +1,41 @@
+#ifndef MAP_EDIT_H
+#define MAP_EDIT_H
+
+#include <fiducial_slam/fiducial_map.h>
+
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/LinearMath/Vector3.h>
+
+// Edits of a whole map for the map services, in place of rewriting the map
+// file offline
+
+// Replace each fiducial pose with T * pose, which moves the origin of the
+// map to T^-1. The move is rigid, so variances are unchanged
+void transformFiducials(FiducialMap &fiducials, const tf2::Transform &T);
+
+// Plane through the fiducial positions with the least squared distance to
+// them, with its normal pointing towards +z
+class PlaneFit {
+public:
+    tf2::Vector3 centroid;
+    tf2::Vector3 normal;
+    double rmsError;
+    double maxError;
+    int numFiducials;
+};
+
+// Returns false if there are fewer than 3 fiducials, or they are in a line
+bool fitPlane(const FiducialMap &fiducials, PlaneFit &fit);
+
+// Move each fiducial onto the plane, and turn it so that its z axis is
+// along the normal, in whichever direction it was closest to
+void projectOntoPlane(FiducialMap &fiducials, const PlaneFit &fit);
+
+// Rotation about the centroid that makes the plane horizontal
+tf2::Transform levelingTransform(const PlaneFit &fit);
+
+// Shortest rotation that turns direction from onto direction to
+tf2::Quaternion rotationBetween(const tf2::Vector3 &from, const tf2::Vector3 &to);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef MAP_PARAMS_H
+#define MAP_PARAMS_H
+
+#include <ros/ros.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Where the map gets its settings from. Running as a node they come from
+// the parameter server. Offline there is no master, so they are given as
+// name and value strings, such as from the command line, and the map
+// doesn't advertise any topics or services
+class MapParams {
+public:
+    MapParams() : nh(nullptr) {}
+    explicit MapParams(ros::NodeHandle &nh) : nh(&nh) {}
+
+    // Node handle to advertise with, or null when offline
+    ros::NodeHandle *nodeHandle() const { return nh; }
+
+    // Set an offline value, replacing any earlier one
+    void set(const std::string &name, const std::string &value) { values[name] = value; }
+
+    // Parse "name=value" and set it. Returns false if there is no '='
+    bool set(const std::string &assignment);
+
+    template <class T>
+    bool getParam(const std::string &name, T &value) const {
+        if (nh != nullptr) {
+            return nh->getParam(name, value);
+        }
+        auto it = values.find(name);
+        if (it == values.end()) {
+            return false;
+        }
+        if (!parse(it->second, value)) {
+            ROS_WARN("Cannot parse value '%s' of parameter %s", it->second.c_str(), name.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    template <class T>
+    void param(const std::string &name, T &value, const T &defaultValue) const {
+        if (!getParam(name, value)) {
+            value = defaultValue;
+        }
+    }
+
+private:
+    ros::NodeHandle *nh;
+    std::map<std::string, std::string> values;
+
+    static bool parse(const std::string &s, std::string &value);
+    static bool parse(const std::string &s, bool &value);
+    static bool parse(const std::string &s, int &value);
+    static bool parse(const std::string &s, float &value);
+    static bool parse(const std::string &s, double &value);
+    // A list such as "[1, 2, 3]" or "1 2 3"
+    static bool parse(const std::string &s, std::vector<double> &value);
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef MAP_STATS_H
+#define MAP_STATS_H
+
+#include <fiducial_slam/fiducial_map.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Distribution of how long an operation takes, in buckets that double in
+// width from 10us. Recording doesn't lock or allocate, so it can be done
+// from any thread while the histogram is being read
+class TimingHistogram {
+public:
+    static const int numBuckets = 20;
+
+    explicit TimingHistogram(const std::string &name);
+
+    void record(double seconds);
+    void reset();
+
+    const std::string &getName() const { return name; }
+    uint64_t count() const { return numRecorded.load(); }
+    double totalSeconds() const;
+    double maxSeconds() const;
+    uint64_t bucketCount(int i) const { return buckets[i].load(); }
+
+    // Upper bound of bucket i in seconds. The last bucket has no bound
+    static double bucketBound(int i);
+
+private:
+    std::string name;
+    std::atomic<uint64_t> numRecorded;
+    std::atomic<uint64_t> totalNs;
+    std::atomic<uint64_t> maxNs;
+    std::atomic<uint64_t> buckets[numBuckets];
+};
+
+// Records the time from construction to destruction in a histogram
+class ScopedTiming {
+public:
+    explicit ScopedTiming(TimingHistogram &histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTiming() {
+        histogram.record(
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    TimingHistogram &histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Connected components of the graph of fiducials linked by being seen
+// together. Links are added as they are observed, so the counts are always
+// up to date without walking the map
+class LinkComponents {
+public:
+    LinkComponents();
+
+    void clear();
+    // Recount from scratch, after fiducials have been removed
+    void rebuild(const FiducialMap &fiducials);
+
+    void add(int id);
+    // Returns true if the link is new
+    bool link(int a, int b);
+
+    int numNodes() const { return (int)parent.size(); }
+    int numLinks() const { return (int)links.size(); }
+    int numComponents() const { return components; }
+    int largestComponent() const { return largest; }
+
+private:
+    int find(int id);
+
+    // Parent of each node, and the size of each component by its root
+    std::unordered_map<int, int> parent;
+    std::unordered_map<int, int> sizes;
+    std::unordered_set<uint64_t> links;
+    int components;
+    int largest;
+};
+
+#endif
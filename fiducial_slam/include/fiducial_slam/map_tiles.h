@@ -0,0 +1,92 @@
+#ifndef MAP_TILES_H
+#define MAP_TILES_H
+
+#include <fiducial_slam/fiducial_map.h>
+
+#include <tf2/LinearMath/Vector3.h>
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A map split into square tiles in the x-y plane, each saved in its own
+// file. Only the tiles in use are held in memory, with the least recently
+// used ones written out when there are more fiducials than the budget.
+// The index of which tile each fiducial is in is always held in memory
+class MapTiles {
+public:
+    typedef std::pair<int, int> TileKey;
+
+    MapTiles();
+
+    // A tile size of 0 disables tiling
+    void configure(const std::string &dir, double tileSize, int maxFiducials);
+    bool enabled() const { return tileSize > 0.0; }
+
+    // Forget all tiles, without changing the files
+    void clear();
+    // Whether there are any tiles, in memory or not
+    bool empty() const { return members.empty(); }
+
+    TileKey tileOf(const tf2::Vector3 &p) const;
+    // Append the known tiles that are within radius of p in the x-y plane
+    void tilesNear(const tf2::Vector3 &p, double radius, std::vector<TileKey> &keys) const;
+
+    // Tile that a fiducial is in, false if it isn't in one
+    bool lookup(int id, TileKey &key) const;
+    bool isResident(const TileKey &key) const { return resident.count(key) != 0; }
+
+    bool loadIndex();
+    bool saveIndex() const;
+
+    // Read a tile into fiducials and make it most recently used. The ids
+    // read are appended to loaded
+    bool load(const TileKey &key, FiducialMap &fiducials, std::vector<int> &loaded);
+    // Make a tile that is in memory most recently used
+    void touch(const TileKey &key);
+
+    // Put fiducials that aren't in a tile yet into the tile at their
+    // position, loading that tile first if it isn't in memory. The
+    // fiducials in tiles are counted, so this only looks through the map
+    // when some have been added
+    void assign(FiducialMap &fiducials, std::vector<int> &loaded);
+
+    // Write the tiles in memory, and the index
+    bool save(const FiducialMap &fiducials) const;
+
+    // Forget a fiducial that has been removed from the map, and write its
+    // tile and the index without it if write is set. Its tile must be in
+    // memory
+    bool remove(int id, bool write, const FiducialMap &fiducials);
+
+    // Remove least recently used tiles that aren't in keep until the
+    // fiducials in memory are within budget, writing them out first if
+    // write is set. The ids removed are appended to removed
+    void evict(const std::set<TileKey> &keep, bool write, FiducialMap &fiducials,
+               std::vector<int> &removed);
+
+private:
+    std::string dir;
+    double tileSize;
+    int maxFiducials;
+
+    std::map<int, TileKey> tileOfId;
+    std::map<TileKey, std::vector<int>> members;
+    // Fiducials in memory that are in a tile. Any others are new
+    int numAssigned;
+
+    // Tiles in memory, most recently used first
+    std::list<TileKey> lru;
+    std::map<TileKey, std::list<TileKey>::iterator> resident;
+
+    std::string indexFilename() const;
+    std::string tileFilename(const TileKey &key) const;
+    bool saveTile(const TileKey &key, const FiducialMap &fiducials) const;
+    void addMember(int id, const TileKey &key);
+    void makeResident(const TileKey &key);
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef OBSERVATION_H
+#define OBSERVATION_H
+
+#include <fiducial_slam/transform_with_variance.h>
+
+#include <ros/time.h>
+#include <tf2/LinearMath/Transform.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Frame ids are interned so that observations can refer to them by number
+// rather than each carrying a copy of the string. Ids are never released,
+// and the names they refer to stay valid for the life of the process
+class FrameIds {
+public:
+    static int intern(const std::string &name);
+    static const std::string &name(int id);
+
+private:
+    static std::mutex mutex;
+    static std::unordered_map<std::string, int> ids;
+    static std::deque<std::string> names;
+};
+
+// An observation of a single fiducial in a single image
+class Observation {
+public:
+    int fid;
+    TransformWithVariance T_camFid;
+    ros::Time stamp;
+    // Interned id of the camera frame
+    int frame;
+    // Square of the tangent of the angle between the optical axis and the
+    // fiducial, as seen by the camera that saw it. It is kept when the
+    // observation is reframed
+    double offAxis2;
+
+    Observation() : fid(-1), frame(-1), offAxis2(0.0), haveFidCam(false) {}
+
+    Observation(int fid, const TransformWithVariance &camFid, const ros::Time &stamp, int frame);
+
+    // Pose of the camera in the fiducial frame, computed when first needed
+    const tf2::Transform &T_fidCam() const;
+
+    const std::string &frameId() const { return FrameIds::name(frame); }
+
+    // Express the observation in another camera frame at another time,
+    // given the pose of the old camera frame in the new one
+    void reframe(const tf2::Transform &T_newOld, int frame, const ros::Time &stamp);
+
+private:
+    mutable tf2::Transform fidCam;
+    mutable bool haveFidCam;
+};
+
+// Observations from a single image, along with the camera pose estimated
+// from them, waiting to be applied to the map. The epoch is that of the map
+// the pose was estimated in
+class MapUpdate {
+public:
+    std::vector<Observation> obs;
+    ros::Time time;
+    tf2::Stamped<TransformWithVariance> T_mapCam;
+    int numEsts;
+    int epoch;
+
+    MapUpdate() : numEsts(0), epoch(0) {}
+};
+
+// Fixed size ring of pending map updates. The observation vectors are
+// exchanged rather than copied in and out, so once every slot has been
+// used the same buffers circulate between the caller, the queue and the
+// map thread without touching the heap
+class MapUpdateQueue {
+public:
+    explicit MapUpdateQueue(int capacity = 10);
+
+    void setCapacity(int capacity);
+    int capacity() const { return slots.size(); }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Queue a frame. obs is exchanged for an empty vector that keeps the
+    // capacity of an earlier frame, ready to be filled again. Returns false
+    // if the oldest frame had to be dropped to make room
+    bool push(std::vector<Observation> &obs, const ros::Time &time,
+              const tf2::Stamped<TransformWithVariance> &T_mapCam, int numEsts, int epoch);
+
+    // Move the queued frames into the front of batch and return how many
+    // there were. batch is only ever grown, and its entries are exchanged
+    // with the slots so their buffers are returned to the queue
+    int popAll(std::vector<MapUpdate> &batch);
+
+private:
+    std::vector<MapUpdate> slots;
+    int head;
+    int count;
+};
+
+#endif
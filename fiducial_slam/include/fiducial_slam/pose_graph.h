@@ -0,0 +1,92 @@
+#ifndef POSE_GRAPH_H
+#define POSE_GRAPH_H
+
+#include <fiducial_slam/transform_with_covariance.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// A graph of fiducial poses linked by relative observations, optimized as a
+// sparse nonlinear least squares problem
+class PoseGraph {
+public:
+    // A fiducial pose and the prior on it from the map
+    struct Node {
+        tf2::Transform pose;
+        TransformWithCovariance prior;
+        bool fixed;
+    };
+
+    // Observation of fiducial 'to' relative to fiducial 'from', from <= to
+    struct Edge {
+        int from;
+        int to;
+        TransformWithCovariance T_fromTo;
+        int numObs;
+    };
+
+    std::map<int, Node> nodes;
+    std::map<std::pair<int, int>, Edge> edges;
+
+    // Add or replace a node. A prior with zero covariance fixes the node
+    void addNode(int id, const TransformWithCovariance& prior);
+
+    // Add a relative observation. Repeated observations between the same pair
+    // of fiducials are averaged into a single edge, which is no more certain
+    // than the observations it is made of
+    void addEdge(int from, int to, const TransformWithCovariance& T_fromTo);
+
+    void clear();
+
+    // Remove a node and all the edges to it
+    void removeNode(int id);
+
+    // Total weighted squared error of the edges and priors
+    double error() const;
+
+    // Weighted squared error of one edge, 0 if either node is missing
+    double edgeError(const Edge& e) const;
+
+    // Initial poses of the fiducials connected to root, found by chaining
+    // edges outward from the root's pose. Covariance grows along each chain
+    void chainPoses(int root, const TransformWithCovariance& rootPose,
+                    std::map<int, TransformWithCovariance>& poses) const;
+
+    // Levenberg-Marquardt iterations with a sparse Cholesky solve.
+    // Returns the final error
+    double optimize(int maxIterations);
+};
+
+// Runs PoseGraph::optimize() on a copy of a graph in a background thread
+class PoseGraphOptimizer {
+public:
+    PoseGraphOptimizer();
+    ~PoseGraphOptimizer();
+
+    // Start optimizing a copy of graph. Returns false if already running
+    bool request(const PoseGraph& graph, int maxIterations);
+
+    bool busy();
+
+    // Retrieve a finished result. Returns true once per request
+    bool takeResult(PoseGraph& result);
+
+private:
+    void run();
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    PoseGraph graph;
+    int iterations;
+    bool pending;
+    bool running;
+    bool finished;
+    bool quit;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef RELOCALIZER_H
+#define RELOCALIZER_H
+
+#include <fiducial_slam/fiducial_map.h>
+
+#include <tf2/LinearMath/Transform.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Checks the fiducials seen in a single frame against the geometry of the
+// map, so that a pose can be trusted without any prior estimate, such as
+// after startup or when tracking has been lost. The distance and relative
+// orientation of every pair of nearby map fiducials is precomputed, and
+// observed pairs that don't match are treated as misidentified
+class Relocalizer {
+public:
+    // Allowed difference in distance between a pair, in meters and as a
+    // proportion of the distance
+    double distanceTolerance;
+    double relativeDistanceTolerance;
+    // Allowed difference in relative orientation of a pair, in radians
+    double angleTolerance;
+
+    Relocalizer();
+
+    // Precompute the geometry of pairs of fiducials within range of each other
+    void build(const FiducialMap &fiducials, double range);
+    size_t numPairs() const { return pairs.size(); }
+
+    // Find the largest set of observed fiducials, given as id and pose in
+    // the camera frame, whose relative poses agree with the map. Their ids
+    // are written to inliers. Observations of fiducials not in the map
+    // are ignored. Called for every frame while lost, so it works in buffers
+    // kept from call to call
+    int match(const FiducialMap &fiducials,
+              const std::vector<std::pair<int, tf2::Transform>> &observed,
+              std::vector<int> &inliers);
+
+private:
+    struct PairGeometry {
+        float distance;
+        float angle;
+    };
+
+    std::unordered_map<uint64_t, PairGeometry> pairs;
+
+    std::vector<int> known;
+    std::vector<char> agree;
+    std::vector<int> degree;
+    std::vector<int> order;
+    std::vector<int> best;
+    std::vector<int> set;
+
+    static uint64_t pairKey(int a, int b);
+    static PairGeometry geometry(const tf2::Transform &a, const tf2::Transform &b);
+    bool consistent(const PairGeometry &expected, const PairGeometry &observed) const;
+};
+
+#endif
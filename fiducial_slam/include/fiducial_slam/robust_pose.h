@@ -0,0 +1,43 @@
+#ifndef ROBUST_POSE_H
+#define ROBUST_POSE_H
+
+#include <fiducial_slam/transform_with_covariance.h>
+
+#include <array>
+
+// Combines several estimates of the same pose, such as the robot pose
+// implied by each fiducial seen in an image, into one. Estimates that don't
+// agree with the consensus are rejected and the rest are fused with Huber
+// weights. Storage is fixed size so that no allocation is needed per frame
+class RobustPoseSolver {
+public:
+    static const int maxEstimates = 64;
+
+    // Mahalanobis distance beyond which an estimate is an outlier, -ve for none
+    double outlierThreshold;
+    // Mahalanobis distance beyond which an estimate is down weighted
+    double huberThreshold;
+    int maxIterations;
+
+    RobustPoseSolver();
+
+    void clear() { count = 0; }
+    int size() const { return count; }
+
+    // Add an estimate. Returns false if there is no room for it
+    bool add(const TransformWithCovariance& estimate);
+
+    // Fuse the estimates into result. Returns the number of inliers used
+    int solve(TransformWithCovariance& result);
+
+    // Whether estimate i was used by the last solve()
+    bool isInlier(int i) const { return inlier[i]; }
+
+private:
+    int count;
+    std::array<TransformWithCovariance, maxEstimates> estimates;
+    std::array<Covariance6, maxEstimates> information;
+    std::array<bool, maxEstimates> inlier;
+};
+
+#endif
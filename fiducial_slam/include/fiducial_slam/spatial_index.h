@@ -0,0 +1,52 @@
+#ifndef SPATIAL_INDEX_H
+#define SPATIAL_INDEX_H
+
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/LinearMath/Vector3.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Uniform grid over fiducial positions, so that the fiducials near a point
+// or inside a camera's view can be found without visiting the whole map
+class SpatialIndex {
+public:
+    explicit SpatialIndex(double cellSize = 2.0);
+
+    // Changing the cell size discards the contents
+    void setCellSize(double size);
+    double getCellSize() const { return cellSize; }
+
+    void clear();
+    size_t size() const { return entries.size(); }
+
+    // Add a fiducial, or move it if it is already present
+    void update(int id, const tf2::Vector3& position);
+    void remove(int id);
+
+    // Append the ids of fiducials within range of center to ids
+    void queryRadius(const tf2::Vector3& center, double range, std::vector<int>& ids) const;
+
+    // Append the ids of fiducials inside the view of a camera with the
+    // given pose in the map and full field of view in radians. The camera
+    // looks along +z with x to the right and y down
+    void queryFrustum(const tf2::Transform& T_mapCam, double hfov, double vfov, double range,
+                      std::vector<int>& ids) const;
+
+private:
+    struct Entry {
+        tf2::Vector3 position;
+        int64_t cell;
+    };
+
+    double cellSize;
+    std::unordered_map<int64_t, std::vector<int>> cells;
+    std::unordered_map<int, Entry> entries;
+
+    int cellCoord(double v) const;
+    static int64_t cellKey(int ix, int iy, int iz);
+    int64_t cellKey(const tf2::Vector3& p) const;
+};
+
+#endif
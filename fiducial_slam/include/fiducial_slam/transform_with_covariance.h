@@ -0,0 +1,114 @@
+#ifndef TRANSFORM_COVARIANCE_H
+#define TRANSFORM_COVARIANCE_H
+
+#include <geometry_msgs/PoseWithCovarianceStamped.h>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/transform_datatypes.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+
+#include <Eigen/Core>
+
+#include <fiducial_slam/transform_with_variance.h>
+
+// 6 DOF covariance, ordered x, y, z, rx, ry, rz like geometry_msgs/PoseWithCovariance.
+// Rotations are small angles about the fixed axes of the parent frame.
+// Unaligned storage so these can be held by value in std containers with C++11.
+typedef Eigen::Matrix<double, 6, 6, Eigen::DontAlign> Covariance6;
+typedef Eigen::Matrix<double, 6, 1, Eigen::DontAlign> Vector6;
+
+// Perturbation that takes transform 'from' to transform 'to':
+// translation difference followed by the rotation vector of R_to * R_from^-1
+Vector6 transformDelta(const tf2::Transform& from, const tf2::Transform& to);
+
+// Apply a perturbation computed by transformDelta() to a transform
+tf2::Transform applyTransformDelta(const tf2::Transform& t, const Vector6& delta);
+
+// Jacobian of T1 * T2 with respect to a perturbation of T1
+Eigen::Matrix<double, 6, 6> compositionJacobian(const tf2::Transform& T1,
+                                                const tf2::Transform& T2);
+
+// Isotropic covariance with the given variance on every axis
+inline Covariance6 isotropicCovariance(double var) {
+    return Covariance6::Identity() * var;
+}
+
+class TransformWithCovariance {
+public:
+    tf2::Transform transform;
+    Covariance6 covariance;
+
+    TransformWithCovariance() : transform(tf2::Transform::getIdentity()) {
+        covariance.setZero();
+    }
+
+    TransformWithCovariance(const tf2::Transform& t, const Covariance6& cov)
+        : transform(t), covariance(cov){};
+    TransformWithCovariance(const tf2::Transform& t, double var)
+        : transform(t), covariance(isotropicCovariance(var)){};
+
+    // Promote a scalar variance transform to one with an isotropic covariance
+    explicit TransformWithCovariance(const TransformWithVariance& t)
+        : transform(t.transform), covariance(isotropicCovariance(t.variance)){};
+
+    // Compose with another transform, propagating both covariances to first order
+    TransformWithCovariance& operator*=(const TransformWithCovariance& rhs);
+    friend TransformWithCovariance operator*(TransformWithCovariance lhs,
+                                             const TransformWithCovariance& rhs) {
+        lhs *= rhs;
+        return lhs;
+    }
+    friend tf2::Stamped<TransformWithCovariance> operator*(
+        tf2::Stamped<TransformWithCovariance> lhs,
+        const tf2::Stamped<TransformWithCovariance>& rhs) {
+        lhs *= rhs;
+        return lhs;
+    }
+
+    // Compose with a transform that is assumed to be exact. The covariance
+    // still changes, since rotation error becomes translation error over the
+    // lever arm of rhs
+    TransformWithCovariance& operator*=(const tf2::Transform& rhs);
+    friend TransformWithCovariance operator*(TransformWithCovariance lhs,
+                                             const tf2::Transform& rhs) {
+        lhs *= rhs;
+        return lhs;
+    }
+    friend TransformWithCovariance operator*(const tf2::Transform& lhs,
+                                             const TransformWithCovariance& rhs);
+
+    // Inverse transform with covariance expressed in the new parent frame
+    TransformWithCovariance inverse() const;
+
+    // Fuse another estimate of the same transform into this one.
+    // This is the product of the two Gaussians, as done with information
+    // matrices, but written so that either covariance may be singular (eg the
+    // zero covariance of the map origin fiducial)
+    void update(const TransformWithCovariance& newT);
+
+    // Squared Mahalanobis distance of another estimate from this one, using
+    // the sum of both covariances
+    double mahalanobis2(const TransformWithCovariance& other) const;
+
+    // Scalar summary of the covariance, for code that uses TransformWithVariance
+    double variance() const { return covariance.trace() / 6.0; }
+};
+
+inline geometry_msgs::PoseWithCovarianceStamped toPose(
+    const tf2::Stamped<TransformWithCovariance>& in) {
+    geometry_msgs::PoseWithCovarianceStamped msg;
+    msg.header.stamp = in.stamp_;
+    msg.header.frame_id = in.frame_id_;
+
+    toMsg(in.transform, msg.pose.pose);
+
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 6; j++) {
+            msg.pose.covariance[i * 6 + j] = in.covariance(i, j);
+        }
+    }
+
+    return msg;
+}
+
+#endif
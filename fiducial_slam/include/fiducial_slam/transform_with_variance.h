@@ -7,6 +7,8 @@
 #include <tf2/transform_datatypes.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
+#include <vector>
+
 class TransformWithVariance {
 public:
     tf2::Transform transform;
@@ -67,6 +69,27 @@ public:
 TransformWithVariance averageTransforms(const TransformWithVariance& t1,
                                         const TransformWithVariance& t2);
 
+// Several estimates of the same transform, stored as an array for each
+// component so that they can be fused in a single pass
+class TransformBatch {
+public:
+    void clear();
+    void reserve(size_t n);
+    void add(const TransformWithVariance& t);
+    size_t size() const { return var.size(); }
+
+    // Fuse the estimates into one, weighted by inverse variance. Rotations
+    // are averaged by taking the principal eigenvector of the weighted sum of
+    // the quaternion outer products (Markley et al, 2007). Unlike repeated
+    // update() calls, the result doesn't depend on the order of the estimates
+    TransformWithVariance fuse() const;
+
+private:
+    std::vector<double> x, y, z;
+    std::vector<double> qx, qy, qz, qw;
+    std::vector<double> var;
+};
+
 inline geometry_msgs::PoseWithCovarianceStamped toPose(
     const tf2::Stamped<TransformWithVariance>& in) {
     geometry_msgs::PoseWithCovarianceStamped msg;
@@ -0,0 +1,233 @@
+#include <fiducial_slam/fiducial_map.h>
+#include <fiducial_slam/helpers.h>
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <string>
+
+bool FiducialLinks::insert(int id) {
+    auto it = std::lower_bound(ids.begin(), ids.end(), id);
+    if (it != ids.end() && *it == id) {
+        return false;
+    }
+    ids.insert(it, id);
+    return true;
+}
+
+bool FiducialLinks::erase(int id) {
+    auto it = std::lower_bound(ids.begin(), ids.end(), id);
+    if (it == ids.end() || *it != id) {
+        return false;
+    }
+    ids.erase(it);
+    return true;
+}
+
+size_t FiducialLinks::count(int id) const {
+    return std::binary_search(ids.begin(), ids.end(), id) ? 1 : 0;
+}
+
+// Update a fiducial position in map with a new estimate
+void Fiducial::update(const TransformWithVariance &newPose) {
+    pose.update(newPose);
+    numObs++;
+}
+
+// Create a fiducial from an estimate of its position in the map
+Fiducial::Fiducial(int id, const TransformWithVariance &pose) {
+    this->id = id;
+    this->pose = pose;
+    this->lastPublished = ros::Time(0);
+    this->numObs = 0;
+    this->visible = false;
+}
+
+bool parseFiducial(const char *line, Fiducial &f) {
+    const int BUFSIZE = 2048;
+    char linkbuf[BUFSIZE];
+
+    int id;
+    double tx, ty, tz, rx, ry, rz, var;
+    int numObs = 0;
+
+    linkbuf[0] = '\0';
+    int nElems = sscanf(line, "%d %lf %lf %lf %lf %lf %lf %lf %d%[^\t\n]*s", &id, &tx, &ty, &tz,
+                        &rx, &ry, &rz, &var, &numObs, linkbuf);
+    if (nElems != 9 && nElems != 10) {
+        return false;
+    }
+
+    tf2::Vector3 tvec(tx, ty, tz);
+    tf2::Quaternion q;
+    q.setRPY(deg2rad(rx), deg2rad(ry), deg2rad(rz));
+
+    f = Fiducial(id, TransformWithVariance(tvec, q, var));
+    f.numObs = numObs;
+
+    std::istringstream ss(linkbuf);
+    std::string s;
+    while (getline(ss, s, ' ')) {
+        if (!s.empty()) {
+            f.links.insert(stoi(s));
+        }
+    }
+    return true;
+}
+
+void writeFiducial(FILE *fp, const Fiducial &f) {
+    tf2::Vector3 trans = f.pose.transform.getOrigin();
+    double rx, ry, rz;
+    f.pose.transform.getBasis().getRPY(rx, ry, rz);
+
+    fprintf(fp, "%d %lf %lf %lf %lf %lf %lf %lf %d", f.id, trans.x(), trans.y(), trans.z(),
+            rad2deg(rx), rad2deg(ry), rad2deg(rz), f.pose.variance, f.numObs);
+
+    for (const auto linked_fid : f.links) {
+        fprintf(fp, " %d", linked_fid);
+    }
+    fprintf(fp, "\n");
+}
+
+static bool idLess(const FiducialMap::value_type &entry, int id) { return entry.first < id; }
+
+void FiducialMap::clear() {
+    chunks.clear();
+    numEntries = 0;
+}
+
+FiducialMap::Chunk &FiducialMap::mutableChunk(size_t chunk) {
+    std::shared_ptr<Chunk> &c = chunks[chunk];
+    if (c.use_count() != 1) {
+        c = std::make_shared<Chunk>(*c);
+    } else {
+        // Pairs with the copies that shared it letting go of it
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *c;
+}
+
+bool FiducialMap::locate(int id, size_t &chunk, size_t &pos) const {
+    // Last chunk starting at or before id, or the first if there is none
+    auto it = std::upper_bound(
+        chunks.begin(), chunks.end(), id,
+        [](int id, const std::shared_ptr<Chunk> &c) { return id < c->front().first; });
+    chunk = it == chunks.begin() ? 0 : it - chunks.begin() - 1;
+    if (chunks.empty()) {
+        pos = 0;
+        return false;
+    }
+
+    const Chunk &c = *chunks[chunk];
+    auto e = std::lower_bound(c.begin(), c.end(), id, idLess);
+    pos = e - c.begin();
+    return e != c.end() && e->first == id;
+}
+
+FiducialMap::iterator FiducialMap::find(int id) {
+    size_t chunk, pos;
+    return locate(id, chunk, pos) ? iterator(this, chunk, pos) : end();
+}
+
+FiducialMap::const_iterator FiducialMap::find(int id) const {
+    size_t chunk, pos;
+    return locate(id, chunk, pos) ? const_iterator(this, chunk, pos) : end();
+}
+
+FiducialMap::iterator FiducialMap::upper_bound(int id) {
+    const_iterator it = static_cast<const FiducialMap *>(this)->upper_bound(id);
+    return iterator(this, it.chunk, it.pos);
+}
+
+FiducialMap::const_iterator FiducialMap::upper_bound(int id) const {
+    size_t chunk, pos;
+    if (locate(id, chunk, pos)) {
+        pos++;
+    }
+    if (chunk < chunks.size() && pos == chunkSize(chunk)) {
+        chunk++;
+        pos = 0;
+    }
+    return chunk < chunks.size() ? const_iterator(this, chunk, pos) : end();
+}
+
+Fiducial &FiducialMap::operator[](int id) {
+    size_t chunk, pos;
+    if (locate(id, chunk, pos)) {
+        return entry(chunk, pos).second;
+    }
+
+    if (chunks.empty()) {
+        chunks.push_back(std::make_shared<Chunk>());
+    }
+    Chunk &c = mutableChunk(chunk);
+    c.insert(c.begin() + pos, value_type(id, Fiducial()));
+    numEntries++;
+
+    // Split a full chunk in two
+    if (c.size() >= 2 * targetChunkSize) {
+        auto upper = std::make_shared<Chunk>(std::make_move_iterator(c.begin() + targetChunkSize),
+                                             std::make_move_iterator(c.end()));
+        c.resize(targetChunkSize);
+        chunks.insert(chunks.begin() + chunk + 1, std::move(upper));
+        if (pos >= targetChunkSize) {
+            chunk++;
+            pos -= targetChunkSize;
+        }
+    }
+    return entry(chunk, pos).second;
+}
+
+size_t FiducialMap::erase(int id) {
+    size_t chunk, pos;
+    if (!locate(id, chunk, pos)) {
+        return 0;
+    }
+
+    Chunk &c = mutableChunk(chunk);
+    c.erase(c.begin() + pos);
+    numEntries--;
+    if (c.empty()) {
+        chunks.erase(chunks.begin() + chunk);
+    }
+    return 1;
+}
+
+size_t FiducialMap::erase(const std::vector<int> &ids) {
+    std::vector<int> sorted(ids);
+    std::sort(sorted.begin(), sorted.end());
+
+    size_t before = numEntries;
+    size_t kept = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        const Chunk &c = *chunks[i];
+        auto first = std::lower_bound(sorted.begin(), sorted.end(), c.front().first);
+        if (first != sorted.end() && *first <= c.back().first) {
+            auto last = std::upper_bound(first, sorted.end(), c.back().first);
+            Chunk &changed = mutableChunk(i);
+            auto end = std::remove_if(changed.begin(), changed.end(),
+                                      [first, last](const value_type &e) {
+                                          return std::binary_search(first, last, e.first);
+                                      });
+            numEntries -= changed.end() - end;
+            changed.erase(end, changed.end());
+        }
+        if (chunks[i]->empty()) {
+            continue;
+        }
+
+        // Merge what is left of neighbouring chunks while they fit
+        if (kept > 0 && chunks[kept - 1]->size() + chunks[i]->size() <= targetChunkSize) {
+            const Chunk &rest = *chunks[i];
+            Chunk &prev = mutableChunk(kept - 1);
+            prev.insert(prev.end(), rest.begin(), rest.end());
+        } else {
+            if (kept != i) {
+                chunks[kept] = std::move(chunks[i]);
+            }
+            kept++;
+        }
+    }
+    chunks.resize(kept);
+    return before - numEntries;
+}
@@ -45,11 +45,13 @@
 #include <tf2_ros/transform_listener.h>
 #include <visualization_msgs/Marker.h>
 
+#include "fiducial_msgs/CompactFiducialTransformArray.h"
 #include "fiducial_msgs/Fiducial.h"
 #include "fiducial_msgs/FiducialArray.h"
 #include "fiducial_msgs/FiducialTransform.h"
 #include "fiducial_msgs/FiducialTransformArray.h"
 
+#include "fiducial_slam/frame_collector.h"
 #include "fiducial_slam/map.h"
 
 #include <opencv2/calib3d.hpp>
@@ -63,44 +65,38 @@ using namespace cv;
 
 class FiducialSlam {
 private:
-    ros::Subscriber ft_sub;
+    vector<ros::Subscriber> ft_subs;
 
     bool use_fiducial_area_as_weight;
     double weighting_scale;
 
-    void transformCallback(const fiducial_msgs::FiducialTransformArray::ConstPtr &msg);
+    // Frames from different cameras this close together in time are
+    // combined into one update
+    double camera_sync_window;
+    FrameCollector collector;
+
+    void transformCallback(const fiducial_msgs::FiducialTransformArray::ConstPtr &msg,
+                           int stream);
+    void compactTransformCallback(
+        const fiducial_msgs::CompactFiducialTransformArray::ConstPtr &msg, int stream);
 
 public:
     Map fiducialMap;
     FiducialSlam(ros::NodeHandle &nh);
+    // Don't hold on to frames if a camera stops publishing
+    void flushStale() { collector.flushStale(ros::Time::now()); }
 };
 
-void FiducialSlam::transformCallback(const fiducial_msgs::FiducialTransformArray::ConstPtr &msg) {
-    vector<Observation> observations;
-
-    for (size_t i = 0; i < msg->transforms.size(); i++) {
-        const fiducial_msgs::FiducialTransform &ft = msg->transforms[i];
-
-        tf2::Vector3 tvec(ft.transform.translation.x, ft.transform.translation.y,
-                          ft.transform.translation.z);
-
-        tf2::Quaternion q(ft.transform.rotation.x, ft.transform.rotation.y, ft.transform.rotation.z,
-                          ft.transform.rotation.w);
-
-        double variance;
-        if (use_fiducial_area_as_weight) {
-            variance = weighting_scale / ft.fiducial_area;
-        } else {
-            variance = weighting_scale * ft.object_error;
-        }
-
-        Observation obs(ft.fiducial_id, tf2::Stamped<TransformWithVariance>(
-                                            TransformWithVariance(ft.transform, variance),
-                                            msg->header.stamp, msg->header.frame_id));
-        observations.push_back(obs);
-    }
+void FiducialSlam::transformCallback(const fiducial_msgs::FiducialTransformArray::ConstPtr &msg,
+                                     int stream) {
+    fiducialMap.trace.recordAge("receive", msg->image_seq, msg->header.stamp);
+    collector.add(*msg, stream);
+}
 
-    fiducialMap.update(observations, msg->header.stamp);
+void FiducialSlam::compactTransformCallback(
+    const fiducial_msgs::CompactFiducialTransformArray::ConstPtr &msg, int stream) {
+    fiducialMap.trace.recordAge("receive", msg->image_seq, msg->header.stamp);
+    collector.add(*msg, stream);
 }
 
 FiducialSlam::FiducialSlam(ros::NodeHandle &nh) : fiducialMap(nh) {
@@ -113,16 +109,41 @@ FiducialSlam::FiducialSlam(ros::NodeHandle &nh) : fiducialMap(nh) {
     // Scaling factor for weighing
     nh.param<double>("weighting_scale", weighting_scale, 1e9);
 
-    ft_sub = nh.subscribe("/fiducial_transforms", 1, &FiducialSlam::transformCallback, this);
+    // Fiducial transforms from each camera on the robot
+    vector<string> topics;
+    nh.param<vector<string>>("fiducial_transform_topics", topics,
+                             vector<string>{"/fiducial_transforms"});
+    // Seconds within which frames from different cameras are solved together
+    nh.param<double>("camera_sync_window", camera_sync_window, 0.05);
+    // The topics are fiducial_msgs/CompactFiducialTransformArray, such as
+    // the fiducial_transforms_compact published by aruco_detect
+    bool compact;
+    nh.param<bool>("compact_transforms", compact, false);
+
+    collector.configure(topics.size(), camera_sync_window, use_fiducial_area_as_weight,
+                        weighting_scale,
+                        [this](vector<Observation> &obs, const ros::Time &time) {
+                            fiducialMap.update(obs, time);
+                        });
+    for (size_t i = 0; i < topics.size(); i++) {
+        if (compact) {
+            ft_subs.push_back(nh.subscribe<fiducial_msgs::CompactFiducialTransformArray>(
+                topics[i], 1,
+                boost::bind(&FiducialSlam::compactTransformCallback, this, _1, (int)i)));
+        } else {
+            ft_subs.push_back(nh.subscribe<fiducial_msgs::FiducialTransformArray>(
+                topics[i], 1, boost::bind(&FiducialSlam::transformCallback, this, _1, (int)i)));
+        }
+    }
 
     ROS_INFO("Fiducial Slam ready");
 }
 
 auto node = unique_ptr<FiducialSlam>(nullptr);
 
+// The map is saved by main once spinning stops, since saving takes the
+// map's lock and allocates, neither of which is safe in a signal handler
 void mySigintHandler(int sig) {
-    if (node != nullptr) node->fiducialMap.saveMap();
-
     ros::shutdown();
 }
 
@@ -137,8 +158,10 @@ int main(int argc, char **argv) {
     while (ros::ok()) {
         ros::spinOnce();
         r.sleep();
+        node->flushStale();
         node->fiducialMap.update();
     }
 
+    node->fiducialMap.saveMap();
     return 0;
 }
@@ -0,0 +1,238 @@
+/*
+ * Build a fiducial map from recorded bags, without a ROS master.
+ *
+ * Messages are replayed in the order they were recorded as fast as they can
+ * be processed, with time taken from the bag, so the same bags and settings
+ * always give the same map.
+ */
+
+#include <fiducial_slam/frame_collector.h>
+#include <fiducial_slam/map.h>
+#include <fiducial_slam/map_params.h>
+
+#include <fiducial_msgs/FiducialTransformArray.h>
+#include <nav_msgs/Odometry.h>
+#include <ros/console.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <tf2_msgs/TFMessage.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] output_map bag [bag ...]\n"
+            "\n"
+            "Options:\n"
+            "  --transforms TOPIC   fiducial transforms, once for each camera\n"
+            "                       (default /fiducial_transforms)\n"
+            "  --odom TOPIC         nav_msgs/Odometry to use as the odom -> base transform\n"
+            "  --initial-map FILE   start from this map rather than an empty one\n"
+            "  --optimize N         finish with N iterations of optimizing the whole map\n"
+            "  --tf-lag SECONDS     how far behind the bag frames are processed, so that\n"
+            "                       transforms recorded after them are known (default 1.0)\n"
+            "  --param NAME=VALUE   fiducial_slam parameter, such as base_frame=base_link\n"
+            "  --verbose            log every frame\n",
+            prog);
+}
+
+// A frame waiting until the transforms around it have been read
+struct PendingFrame {
+    ros::Time received;
+    int stream;
+    fiducial_msgs::FiducialTransformArray::ConstPtr msg;
+};
+
+int main(int argc, char **argv) {
+    vector<string> transformTopics;
+    string odomTopic;
+    string initialMap;
+    int optimizeIterations = 0;
+    double tfLag = 1.0;
+    bool verbose = false;
+    vector<string> assignments;
+    vector<string> positional;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--transforms" && hasValue) {
+            transformTopics.push_back(argv[++i]);
+        } else if (arg == "--odom" && hasValue) {
+            odomTopic = argv[++i];
+        } else if (arg == "--initial-map" && hasValue) {
+            initialMap = argv[++i];
+        } else if (arg == "--optimize" && hasValue) {
+            optimizeIterations = atoi(argv[++i]);
+        } else if (arg == "--tf-lag" && hasValue) {
+            tfLag = atof(argv[++i]);
+        } else if (arg == "--param" && hasValue) {
+            assignments.push_back(argv[++i]);
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else if (arg == "-h" || arg == "--help") {
+            usage(argv[0]);
+            return 0;
+        } else if (arg.compare(0, 2, "--") == 0) {
+            fprintf(stderr, "Unknown or incomplete option %s\n", arg.c_str());
+            usage(argv[0]);
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (transformTopics.empty()) {
+        transformTopics.push_back("/fiducial_transforms");
+    }
+
+    if (!verbose &&
+        ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Warn)) {
+        ros::console::notifyLoggerLevelsChanged();
+    }
+
+    // Settings that keep the result independent of timing. They can still
+    // be overridden
+    MapParams params;
+    params.set("map_file", positional[0]);
+    params.set("initial_map_file", initialMap);
+    params.set("load_map", "false");
+    params.set("background_map_update", "false");
+    params.set("optimize_interval", "0");
+    params.set("pose_publish_rate", "0");
+    params.set("tf_timeout", "0");
+    for (const string &a : assignments) {
+        if (!params.set(a)) {
+            fprintf(stderr, "Expected NAME=VALUE, not %s\n", a.c_str());
+            return 1;
+        }
+    }
+
+    bool useArea;
+    double weightingScale;
+    double syncWindow;
+    params.param<bool>("use_fiducial_area_as_weight", useArea, false);
+    params.param<double>("weighting_scale", weightingScale, 1e9);
+    params.param<double>("camera_sync_window", syncWindow, 0.05);
+
+    // Simulated time, advanced from the bag
+    ros::Time::init();
+    ros::Time::setNow(ros::TIME_MIN);
+
+    Map map(params);
+
+    int numFrames = 0;
+    FrameCollector collector;
+    collector.configure(transformTopics.size(), syncWindow, useArea, weightingScale,
+                        [&](vector<Observation> &obs, const ros::Time &time) {
+                            ros::Time::setNow(time);
+                            map.update(obs, time);
+                            numFrames++;
+                        });
+
+    vector<string> topics = transformTopics;
+    topics.push_back("/tf");
+    topics.push_back("/tf_static");
+    if (!odomTopic.empty()) {
+        topics.push_back(odomTopic);
+    }
+
+    vector<unique_ptr<rosbag::Bag>> bags;
+    rosbag::View view;
+    try {
+        for (size_t i = 1; i < positional.size(); i++) {
+            bags.push_back(unique_ptr<rosbag::Bag>(new rosbag::Bag(positional[i])));
+            view.addQuery(*bags.back(), rosbag::TopicQuery(topics));
+        }
+    } catch (rosbag::BagException &ex) {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    deque<PendingFrame> pending;
+
+    auto process = [&](const ros::Time &upTo) {
+        while (!pending.empty() && pending.front().received <= upTo) {
+            const PendingFrame &p = pending.front();
+            collector.flushStale(p.msg->header.stamp);
+            collector.add(*p.msg, p.stream);
+            pending.pop_front();
+        }
+    };
+
+    for (const rosbag::MessageInstance &m : view) {
+        const string &topic = m.getTopic();
+
+        if (topic == "/tf" || topic == "/tf_static") {
+            auto tf = m.instantiate<tf2_msgs::TFMessage>();
+            if (tf) {
+                for (const geometry_msgs::TransformStamped &t : tf->transforms) {
+                    map.tfBuffer.setTransform(t, "bag", topic == "/tf_static");
+                }
+            }
+        } else if (topic == odomTopic) {
+            auto odom = m.instantiate<nav_msgs::Odometry>();
+            if (odom) {
+                geometry_msgs::TransformStamped t;
+                t.header = odom->header;
+                t.child_frame_id = odom->child_frame_id;
+                t.transform.translation.x = odom->pose.pose.position.x;
+                t.transform.translation.y = odom->pose.pose.position.y;
+                t.transform.translation.z = odom->pose.pose.position.z;
+                t.transform.rotation = odom->pose.pose.orientation;
+                map.tfBuffer.setTransform(t, "bag");
+            }
+        } else {
+            for (size_t i = 0; i < transformTopics.size(); i++) {
+                if (topic == transformTopics[i]) {
+                    auto msg = m.instantiate<fiducial_msgs::FiducialTransformArray>();
+                    if (msg) {
+                        PendingFrame p;
+                        p.received = m.getTime();
+                        p.stream = i;
+                        p.msg = msg;
+                        pending.push_back(p);
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (m.getTime().toSec() > tfLag) {
+            process(m.getTime() - ros::Duration(tfLag));
+        }
+    }
+
+    process(ros::TIME_MAX);
+    collector.flush();
+
+    if (optimizeIterations > 0) {
+        map.optimize(optimizeIterations);
+    }
+
+    bool saved = map.saveMap();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    printf("Processed %d frames in %.1lf seconds, map has %d fiducials\n", numFrames, elapsed,
+           (int)map.getSnapshot()->size());
+    if (!saved) {
+        fprintf(stderr, "Could not save map to %s\n", positional[0].c_str());
+        return 1;
+    }
+    return 0;
+}
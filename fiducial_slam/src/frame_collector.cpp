@@ -0,0 +1,107 @@
+#include <fiducial_slam/frame_collector.h>
+
+#include <fiducial_msgs/compact.h>
+
+#include <algorithm>
+#include <cmath>
+
+FrameCollector::FrameCollector()
+    : syncWindow(0.0), useArea(false), weightingScale(1.0), havePending(false) {}
+
+void FrameCollector::configure(int numStreams, double syncWindow, bool useArea,
+                               double weightingScale, const Sink &sink) {
+    this->syncWindow = syncWindow;
+    this->useArea = useArea;
+    this->weightingScale = weightingScale;
+    this->sink = sink;
+
+    observations.clear();
+    streamPending.assign(numStreams, false);
+    havePending = false;
+}
+
+void FrameCollector::add(const fiducial_msgs::FiducialTransformArray &msg, int stream) {
+    int frame = begin(msg.header, stream);
+
+    for (size_t i = 0; i < msg.transforms.size(); i++) {
+        const fiducial_msgs::FiducialTransform &ft = msg.transforms[i];
+        observations.emplace_back(
+            ft.fiducial_id,
+            TransformWithVariance(ft.transform, variance(ft.object_error, ft.fiducial_area)),
+            msg.header.stamp, frame);
+    }
+
+    end();
+}
+
+// Transforms in the compact format are read directly, rather than being
+// converted to the full message first
+
+void FrameCollector::add(const fiducial_msgs::CompactFiducialTransformArray &msg, int stream) {
+    int frame = begin(msg.header, stream);
+
+    geometry_msgs::Quaternion q;
+    for (size_t i = 0; i < msg.transforms.size(); i++) {
+        const fiducial_msgs::CompactFiducialTransform &ft = msg.transforms[i];
+        fiducial_msgs::unpackQuaternion(ft.rotation, q);
+        tf2::Transform T(tf2::Quaternion(q.x, q.y, q.z, q.w),
+                         tf2::Vector3(ft.translation[0], ft.translation[1], ft.translation[2]));
+        observations.emplace_back(
+            ft.fiducial_id, TransformWithVariance(T, variance(ft.object_error, ft.fiducial_area)),
+            msg.header.stamp, frame);
+    }
+
+    end();
+}
+
+int FrameCollector::begin(const std_msgs::Header &header, int stream) {
+    const ros::Time &stamp = header.stamp;
+    if (havePending && (streamPending[stream] ||
+                        std::fabs((stamp - pendingStart).toSec()) > syncWindow)) {
+        flush();
+    }
+    if (!havePending) {
+        havePending = true;
+        pendingStart = stamp;
+        pendingTime = stamp;
+    }
+    streamPending[stream] = true;
+    if (stamp > pendingTime) {
+        pendingTime = stamp;
+    }
+
+    return FrameIds::intern(header.frame_id);
+}
+
+void FrameCollector::end() {
+    if (syncWindow <= 0 ||
+        std::find(streamPending.begin(), streamPending.end(), false) == streamPending.end()) {
+        flush();
+    }
+}
+
+double FrameCollector::variance(double objectError, double fiducialArea) const {
+    if (useArea) {
+        return weightingScale / fiducialArea;
+    }
+    return weightingScale * objectError;
+}
+
+void FrameCollector::flush() {
+    if (!havePending) {
+        return;
+    }
+
+    // The sink hands back a buffer from an earlier frame, so this doesn't
+    // allocate once the first few frames have been seen
+    sink(observations, pendingTime);
+    observations.clear();
+    std::fill(streamPending.begin(), streamPending.end(), false);
+    havePending = false;
+}
+
+void FrameCollector::flushStale(const ros::Time &now) {
+    if (havePending && (now - pendingStart).toSec() > syncWindow) {
+        flush();
+    }
+}
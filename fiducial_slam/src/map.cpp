@@ -46,69 +46,109 @@
 
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
 
-static double systematic_error = 0.01;
-
-// Constructor for observation
-Observation::Observation(int fid, const tf2::Stamped<TransformWithVariance> &camFid) {
-    this->fid = fid;
-
-    T_camFid = camFid;
-    T_fidCam = T_camFid;
-    T_fidCam.transform = T_camFid.transform.inverse();
-}
-
-// Update a fiducial position in map with a new estimate
-void Fiducial::update(const tf2::Stamped<TransformWithVariance> &newPose) {
-    pose.update(newPose);
-    numObs++;
-}
 
-// Create a fiducial from an estimate of its position in the map
-Fiducial::Fiducial(int id, const tf2::Stamped<TransformWithVariance> &pose) {
-    this->id = id;
-    this->pose = pose;
-    this->lastPublished = ros::Time(0);
-    this->numObs = 0;
-    this->visible = false;
-}
+static double systematic_error = 0.01;
 
 // Constructor for map
 
-Map::Map(ros::NodeHandle &nh) : tfBuffer(ros::Duration(30.0)) {
+Map::Map(ros::NodeHandle &nh) : Map(MapParams(nh)) {}
+
+Map::Map(const MapParams &params)
+    : tfBuffer(ros::Duration(30.0)),
+      updateTiming("update"),
+      poseTiming("update_pose"),
+      applyTiming("apply_update"),
+      snapshotTiming("snapshot"),
+      tfWaitTiming("tf_wait") {
     frameNum = 0;
     initialFrameNum = 0;
     originFid = -1;
     isInitializingMap = false;
     havePose = false;
     fiducialToAdd = -1;
+    mapVersion = 0;
+    optimizeRequested = false;
+    staleOptimization = false;
+    mapEpoch = 0;
+    poseEpoch = 0;
+    quitUpdates = false;
+    haveMapCam = false;
+    markerCursor = -1;
+    markerRefreshTime = ros::Time(0);
+    haveOdomPose = false;
+    componentsDirty = false;
+    numFrames = 0;
+    numPoseFrames = 0;
+    numDroppedFrames = 0;
+
+    // Offline, transforms are added to tfBuffer directly and nothing is published
+    ros::NodeHandle *nh = params.nodeHandle();
+    if (nh != nullptr) {
+        listener = make_unique<tf2_ros::TransformListener>(tfBuffer);
+        broadcaster = make_unique<tf2_ros::TransformBroadcaster>();
+
+        robotPosePub = ros::Publisher(
+            nh->advertise<geometry_msgs::PoseWithCovarianceStamped>("/fiducial_pose", 1));
+        cameraPosePub = ros::Publisher(nh->advertise<geometry_msgs::PoseWithCovarianceStamped>(
+            "/fiducial_slam/camera_pose", 1));
+
+        markerPub = ros::Publisher(nh->advertise<visualization_msgs::Marker>("/fiducials", 100));
+        mapPub = ros::Publisher(
+            nh->advertise<fiducial_msgs::FiducialMapEntryArray>("/fiducial_map", 1));
+
+        clearSrv = nh->advertiseService("clear_map", &Map::clearCallback, this);
+        addSrv = nh->advertiseService("add_fiducial", &Map::addFiducialCallback, this);
+        optimizeSrv = nh->advertiseService("optimize_map", &Map::optimizeCallback, this);
+        statsSrv = nh->advertiseService("get_map_stats", &Map::statsCallback, this);
+        moveOriginSrv = nh->advertiseService("move_origin", &Map::moveOriginCallback, this);
+        fitPlaneSrv = nh->advertiseService("fit_plane", &Map::fitPlaneCallback, this);
+        removeSrv = nh->advertiseService("remove_fiducial", &Map::removeFiducialCallback, this);
+        importSrv = nh->advertiseService("import_map", &Map::importMapCallback, this);
+        dumpTraceSrv = nh->advertiseService("dump_trace", &Map::dumpTraceCallback, this);
+    }
 
-    listener = make_unique<tf2_ros::TransformListener>(tfBuffer);
-
-    robotPosePub =
-        ros::Publisher(nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("/fiducial_pose", 1));
-    cameraPosePub = ros::Publisher(
-        nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("/fiducial_slam/camera_pose", 1));
-
-    markerPub = ros::Publisher(nh.advertise<visualization_msgs::Marker>("/fiducials", 100));
-    mapPub = ros::Publisher(nh.advertise<fiducial_msgs::FiducialMapEntryArray>("/fiducial_map", 1));
-
-    clearSrv = nh.advertiseService("clear_map", &Map::clearCallback, this);
-    addSrv = nh.advertiseService("add_fiducial", &Map::addFiducialCallback, this);
-
-    nh.param<std::string>("map_frame", mapFrame, "map");
-    nh.param<std::string>("odom_frame", odomFrame, "odom");
-    nh.param<std::string>("base_frame", baseFrame, "base_footprint");
-
-    nh.param<float>("tf_publish_interval", tfPublishInterval, 1.0);
-    nh.param<bool>("publish_tf", publishPoseTf, true);
-    nh.param<double>("systematic_error", systematic_error, 0.01);
-    nh.param<double>("future_date_transforms", future_date_transforms, 0.1);
-    nh.param<bool>("publish_6dof_pose", publish_6dof_pose, false);
-    nh.param<bool>("read_only_map", readOnly, false);
+    params.param<std::string>("map_frame", mapFrame, "map");
+    params.param<std::string>("odom_frame", odomFrame, "odom");
+    params.param<std::string>("base_frame", baseFrame, "base_footprint");
+
+    params.param<float>("tf_publish_interval", tfPublishInterval, 1.0);
+    params.param<bool>("publish_tf", publishPoseTf, true);
+    params.param<double>("systematic_error", systematic_error, 0.01);
+    params.param<double>("future_date_transforms", future_date_transforms, 0.1);
+    params.param<bool>("publish_6dof_pose", publish_6dof_pose, false);
+    params.param<bool>("read_only_map", readOnly, false);
+    // Seconds to wait for a transform. Offline the buffer is filled ahead
+    // of time, so this should be 0
+    params.param<double>("tf_timeout", tfTimeout, 0.5);
+
+    // Seed the map with every fiducial seen along with the origin during
+    // initialization, rather than just the origin
+    params.param<bool>("multi_fiducial_init", multiFiducialInit, false);
+    // Frames a fiducial must be seen in during initialization to be added
+    params.param<int>("init_min_observations", initMinObservations, 3);
+    // Mean weighted squared error of a fiducial's relative poses above
+    // which it is left out of the initial map
+    params.param<double>("init_max_error", initMaxError, 16.8);
+
+    // Optimize the map every this many frames, 0 to only optimize on request
+    params.param<int>("optimize_interval", optimizeInterval, 0);
+    params.param<int>("optimize_iterations", optimizeIterations, 10);
+    // Minimum variance of the prior on each fiducial's position when
+    // optimizing, so that relative observations can correct drift
+    params.param<double>("optimize_prior_variance", optimizePriorVariance, 1.0);
+
+    // Apply observations to the map in a separate thread from pose estimation
+    params.param<bool>("background_map_update", backgroundUpdates, false);
+    // Frames that can be waiting for the map thread before the oldest is dropped
+    params.param<int>("map_update_queue_size", updateQueueSize, 10);
+    updateQueue.setCapacity(updateQueueSize);
 
     std::fill(covarianceDiagonal.begin(), covarianceDiagonal.end(), 0);
-    overridePublishedCovariance = nh.getParam("covariance_diagonal", covarianceDiagonal);
+    overridePublishedCovariance = params.getParam("covariance_diagonal", covarianceDiagonal);
     if (overridePublishedCovariance) {
         if (covarianceDiagonal.size() != 6) {
             ROS_WARN("ignoring covariance_diagonal because it has %ld elements, not 6", covarianceDiagonal.size());
@@ -124,55 +164,404 @@ Map::Map(ros::NodeHandle &nh) : tfBuffer(ros::Duration(30.0)) {
         }
     }
 
-    // threshold of object error for using multi-fidicial pose
-    // set -ve to never use
-    nh.param<double>("multi_error_theshold", multiErrorThreshold, -1);
-
-    nh.param<std::string>("map_file", mapFilename,
+    // Mahalanobis distance beyond which a fiducial's pose estimate is
+    // rejected as an outlier, set -ve to never reject
+    params.param<double>("multi_error_theshold", multiErrorThreshold, -1);
+    poseSolver.outlierThreshold = multiErrorThreshold;
+
+    // Check the layout of the fiducials seen against the map when there
+    // hasn't been a pose for this many seconds, such as after startup
+    params.param<bool>("relocalize", relocalize, false);
+    params.param<double>("relocalize_timeout", relocalizeTimeout, 5.0);
+
+    // Mahalanobis distance from the pose predicted by odometry beyond which
+    // an estimate is rejected, 0 to not use odometry
+    params.param<double>("odom_gate", odomGate, 0.0);
+    // Variance added to the prediction per meter or radian moved
+    params.param<double>("odom_variance", odomVariance, 0.01);
+    // Variance added to the prediction per second, for odometry drift and
+    // for the map being wrong, so that the prediction never outweighs new
+    // estimates when the robot stands still
+    params.param<double>("odom_time_variance", odomTimeVariance, 0.01);
+
+    // Rate to publish the last fix extrapolated with odometry, 0 to disable
+    params.param<double>("pose_publish_rate", posePublishRate, 0.0);
+
+    // Number of frames to solve together when updating the map, 1 to
+    // update the map with each frame as it arrives
+    params.param<int>("smoothing_window", smoothingWindow, 1);
+
+    // Number of recent frame stages to keep for tracing latency, 0 to not trace.
+    // The trace is written to trace_file by the dump_trace service and on exit
+    int traceSize;
+    params.param<int>("trace_buffer_size", traceSize, 0);
+    params.param<std::string>("trace_file", traceFile, "/tmp/fiducial_slam_trace.json");
+    trace.resize(std::max(traceSize, 0));
+
+    // Seconds before the pose of a camera on the robot is looked up again,
+    // 0 to look it up for every frame
+    params.param<double>("camera_extrinsics_refresh", extrinsicsRefresh, 10.0);
+
+    // Size of the cells of the spatial index over fiducial positions, in meters
+    double cellSize;
+    params.param<double>("spatial_index_cell_size", cellSize, 2.0);
+    fiducialIndex.setCellSize(cellSize);
+
+    // View of the camera used to predict which fiducials are visible
+    params.param<double>("visibility_range", visibilityRange, 10.0);
+    params.param<double>("camera_hfov", cameraHfov, 90.0);
+    params.param<double>("camera_vfov", cameraVfov, 70.0);
+    cameraHfov = deg2rad(cameraHfov);
+    cameraVfov = deg2rad(cameraVfov);
+
+    params.param<std::string>("map_file", mapFilename,
                           std::string(getenv("HOME")) + "/.ros/slam/map.txt");
 
     boost::filesystem::path mapPath(mapFilename);
     boost::filesystem::path dir = mapPath.parent_path();
     boost::filesystem::create_directories(dir);
 
+    // Split the map into tiles of this size in meters, only keeping those
+    // near the robot in memory. 0 to hold the whole map in memory
+    double tileSize;
+    int maxResident;
+    std::string tileDir;
+    params.param<double>("map_tile_size", tileSize, 0.0);
+    params.param<std::string>("map_tile_dir", tileDir, (dir / "tiles").string());
+    params.param<double>("map_tile_radius", tileRadius, tileSize);
+    params.param<int>("map_max_resident_fiducials", maxResident, 10000);
+    tiles.configure(tileDir, tileSize, maxResident);
+    if (tiles.enabled()) {
+        boost::filesystem::create_directories(tileDir);
+    }
+
     std::string initialMap;
-    nh.param<std::string>("initial_map_file", initialMap, "");
+    params.param<std::string>("initial_map_file", initialMap, "");
+    // Start with an empty map rather than the one saved in map_file
+    bool loadSaved;
+    params.param<bool>("load_map", loadSaved, true);
 
     if (!initialMap.empty()) {
         loadMap(initialMap);
+    } else if (!loadSaved) {
+        // Nothing to load
+    } else if (tiles.enabled() && tiles.loadIndex()) {
+        // Tiles are loaded as they are needed
     } else {
         loadMap();
     }
 
+    publishSnapshot();
     publishMarkers();
+
+    if (backgroundUpdates) {
+        updateThread = std::thread(&Map::updateThreadMain, this);
+    }
+
+    if (posePublishRate > 0.0 && nh != nullptr) {
+        extrapolatedPosePub = ros::Publisher(
+            nh->advertise<geometry_msgs::PoseWithCovarianceStamped>(
+                "/fiducial_slam/extrapolated_pose", 1));
+
+        ros::NodeHandle poseNh(*nh);
+        poseNh.setCallbackQueue(&poseQueue);
+        poseTimer = poseNh.createTimer(ros::Duration(1.0 / posePublishRate),
+                                       &Map::poseTimerCallback, this);
+        poseSpinner = make_unique<ros::AsyncSpinner>(1, &poseQueue);
+        poseSpinner->start();
+    }
 }
 
-// Update map with a set of observations
+Map::~Map() {
+    if (poseSpinner) {
+        poseTimer.stop();
+        poseSpinner->stop();
+    }
+
+    if (updateThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(updateMutex);
+            quitUpdates = true;
+        }
+        updateCv.notify_all();
+        updateThread.join();
+    }
+
+    if (trace.enabled()) {
+        trace.dump(traceFile, "fiducial_slam");
+    }
+}
+
+// Estimate the robot pose from a set of observations, and then use them
+// to update the map
 
 void Map::update(std::vector<Observation> &obs, const ros::Time &time) {
-    ROS_INFO("Updating map with %d observations. Map has %d fiducials", (int)obs.size(),
-             (int)fiducials.size());
+    ScopedTiming timing(updateTiming);
+    fiducial_msgs::TraceSpan span(trace, "update", 0, time);
+    numFrames++;
+
+    ROS_DEBUG("Updating map with %d observations. Map has %d fiducials", (int)obs.size(),
+              (int)getSnapshot()->size());
+
+    int numEsts = 0;
+    tf2::Stamped<TransformWithVariance> T_mapCam;
+    T_mapCam.frame_id_ = mapFrame;
+
+    alignObservations(obs, time);
+
+    if (!isInitializingMap) {
+        ScopedTiming poseTimingScope(poseTiming);
+        fiducial_msgs::TraceSpan poseSpan(trace, "update_pose", 0, time);
+        numEsts = updatePose(obs, time, T_mapCam);
+    }
+    if (numEsts > 0) {
+        numPoseFrames++;
+    }
+
+    // The observations are handed over rather than copied, and obs gets
+    // back an empty buffer from an earlier frame. The pose is tagged with
+    // the epoch of the map it was estimated in
+    if (backgroundUpdates) {
+        std::lock_guard<std::mutex> lock(updateMutex);
+        if (!updateQueue.push(obs, time, T_mapCam, numEsts, poseEpoch)) {
+            ROS_WARN("Map update queue full, dropping oldest frame");
+            numDroppedFrames++;
+        }
+        updateCv.notify_one();
+    } else {
+        std::lock_guard<std::mutex> lock(mapMutex);
+        MapUpdate &u = inlineUpdate;
+        u.obs.clear();
+        std::swap(u.obs, obs);
+        u.time = time;
+        u.T_mapCam = T_mapCam;
+        u.numEsts = numEsts;
+        u.epoch = poseEpoch;
+        if (applyUpdate(u)) {
+            publishSnapshot();
+            publishMap();
+        }
+    }
+}
 
+// Update map with a set of observations. Called with mapMutex held.
+// Returns false if the map is unchanged because the frame is waiting
+// for the rest of its smoothing window
+
+bool Map::applyUpdate(const MapUpdate &u) {
+    ScopedTiming timing(applyTiming);
+    fiducial_msgs::TraceSpan span(trace, "apply_update", 0, u.time);
+    bool changed = true;
     frameNum++;
 
-    if (obs.size() > 0 && fiducials.size() == 0) {
+    applyOptimization();
+
+    // A pose estimated before the map was moved or cleared is in the old map
+    int numEsts = u.epoch == mapEpoch ? u.numEsts : 0;
+    if (numEsts > 0) {
+        lastMapCam = u.T_mapCam.transform;
+        haveMapCam = true;
+    }
+
+    if (tiles.enabled()) {
+        updateTiles(u.obs);
+    }
+
+    if (u.obs.size() > 0 && fiducials.size() == 0 && tiles.empty()) {
         isInitializingMap = true;
     }
 
     if (isInitializingMap) {
-        autoInit(obs, time);
-    } else {
-        tf2::Stamped<TransformWithVariance> T_mapCam;
-        T_mapCam.frame_id_ = mapFrame;
+        autoInit(u.obs, u.time);
+    } else if (numEsts > 0 && u.obs.size() > 1 && !readOnly) {
+        if (smoothingWindow > 1) {
+            window.push_back(u);
+            changed = (int)window.size() >= smoothingWindow;
+            if (changed) {
+                smoothWindow();
+            }
+        } else {
+            updateMap(u.obs, u.time, u.T_mapCam);
+        }
+    }
+
+    handleAddFiducial(u.obs);
+
+    if (optimizeRequested || (optimizeInterval > 0 && frameNum % optimizeInterval == 0)) {
+        requestOptimization();
+    }
+    return changed;
+}
+
+// Map maintenance thread. Applies the queued commands and then all the
+// queued updates, and publishes a new snapshot of the map once per batch
+
+void Map::updateThreadMain() {
+    std::vector<MapUpdate> batch;
+    int n = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(updateMutex);
+            updateCv.wait_for(lock, std::chrono::milliseconds(50), [this] {
+                return quitUpdates || !updateQueue.empty() || !commands.empty();
+            });
+            if (quitUpdates) {
+                // Anyone waiting on a command is told it failed
+                commands.clear();
+                return;
+            }
+            n = updateQueue.popAll(batch);
+        }
+
+        bool changed;
+        {
+            std::lock_guard<std::mutex> lock(mapMutex);
+            changed = applyCommands();
+            changed = applyOptimization() || changed;
+            for (int i = 0; i < n; i++) {
+                changed = applyUpdate(batch[i]) || changed;
+            }
+
+            // Commands may arrive while no frames are coming in
+            if (optimizeRequested) {
+                requestOptimization();
+            }
+
+            if (changed) {
+                publishSnapshot();
+            }
+
+            // Markers only go stale after a second, so there is nothing to
+            // refresh on the idle wakeups in between
+            ros::Time now = ros::Time::now();
+            if (changed || (now - markerRefreshTime).toSec() > 1.0) {
+                publishMarkers();
+                markerRefreshTime = now;
+            }
+        }
+
+        // The map is published from the snapshot, without holding up the
+        // next batch
+        if (changed) {
+            publishMap();
+        }
+    }
+}
+
+// Current snapshot of the map. It is never modified, so can be read without locking
+
+std::shared_ptr<const FiducialMap> Map::getSnapshot() const {
+    std::shared_ptr<const MapSnapshot> snap = std::atomic_load(&snapshot);
+    return std::shared_ptr<const FiducialMap>(snap, &snap->fiducials);
+}
+
+std::shared_ptr<const MapSnapshot> Map::getVersionedSnapshot() const {
+    return std::atomic_load(&snapshot);
+}
+
+// Make the current state of the map visible to readers. Called with mapMutex held
+
+void Map::publishSnapshot() {
+    ScopedTiming timing(snapshotTiming);
+    auto snap = std::make_shared<MapSnapshot>();
+    snap->version = ++mapVersion;
+    snap->epoch = mapEpoch;
+    // Only the chunks changed since the last snapshot are copied, when they
+    // next change
+    snap->fiducials = fiducials;
+
+    // Links are counted as they are seen, but fiducials leaving the map
+    // mean starting again
+    if (componentsDirty || linkComponents.numNodes() != (int)fiducials.size()) {
+        linkComponents.rebuild(fiducials);
+        componentsDirty = false;
+    }
+
+    MapSummary &s = snap->summary;
+    s.numFiducials = fiducials.size();
+    s.numLinks = linkComponents.numLinks();
+    s.numComponents = linkComponents.numComponents();
+    s.largestComponent = linkComponents.largestComponent();
+
+    std::atomic_store(&snapshot, std::shared_ptr<const MapSnapshot>(snap));
+}
+
+// Queue a change to the map, to be made by the map writer between frames.
+// The command is called with mapMutex held and returns whether it succeeded
+
+std::future<bool> Map::submitCommand(const std::function<bool()> &command) {
+    std::packaged_task<bool()> task(command);
+    std::future<bool> result = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(updateMutex);
+        commands.push_back(std::move(task));
+    }
 
-        if (updatePose(obs, time, T_mapCam) > 0 && obs.size() > 1 && !readOnly) {
-            updateMap(obs, time, T_mapCam);
+    if (backgroundUpdates) {
+        updateCv.notify_one();
+    } else {
+        // Without a map thread the caller applies it. The frame callback
+        // holds mapMutex, so this is still between frames
+        std::lock_guard<std::mutex> lock(mapMutex);
+        if (applyCommands()) {
+            publishSnapshot();
+            publishMap();
         }
     }
+    return result;
+}
+
+// Queue a command and wait for it to be applied. Returns false if it failed,
+// or was dropped because the map is shutting down
+
+bool Map::runCommand(const std::function<bool()> &command) {
+    std::future<bool> result = submitCommand(command);
+    try {
+        return result.get();
+    } catch (const std::future_error &ex) {
+        ROS_WARN("Map command not applied: %s", ex.what());
+        return false;
+    }
+}
+
+// Apply the queued commands in order. Called with mapMutex held, returns
+// true if there were any
+
+bool Map::applyCommands() {
+    {
+        std::lock_guard<std::mutex> lock(updateMutex);
+        std::swap(runningCommands, commands);
+    }
+    if (runningCommands.empty()) {
+        return false;
+    }
+
+    for (std::packaged_task<bool()> &task : runningCommands) {
+        task();
+    }
+    runningCommands.clear();
+    return true;
+}
 
-    handleAddFiducial(obs);
+// Add the relative pose of each pair of fiducials seen in a frame to a pose graph
 
-    publishMap();
+static void addRelativePoses(const std::vector<Observation> &obs, PoseGraph &graph) {
+    for (size_t i = 0; i < obs.size(); i++) {
+        TransformWithCovariance T_fidCam =
+            TransformWithCovariance(obs[i].T_camFid.transform, obs[i].T_camFid.variance).inverse();
+        for (size_t j = i + 1; j < obs.size(); j++) {
+            TransformWithCovariance T_fidFid =
+                T_fidCam *
+                TransformWithCovariance(obs[j].T_camFid.transform, obs[j].T_camFid.variance);
+
+            tf2::Vector3 trans = T_fidFid.transform.getOrigin();
+            if (std::isnan(trans.x()) || std::isnan(trans.y()) || std::isnan(trans.z())) {
+                continue;
+            }
+            graph.addEdge(obs[i].fid, obs[j].fid, T_fidFid);
+        }
+    }
 }
 
 // update estimates of observed fiducials from previously estimated
@@ -180,58 +569,294 @@ void Map::update(std::vector<Observation> &obs, const ros::Time &time) {
 
 void Map::updateMap(const std::vector<Observation> &obs, const ros::Time &time,
                     const tf2::Stamped<TransformWithVariance> &T_mapCam) {
-    for (auto &map_pair : fiducials) {
-        Fiducial &f = map_pair.second;
-        f.visible = false;
-    }
-
+    mapEstimates.clear();
     for (const Observation &o : obs) {
         // This should take into account the variances from both
-        tf2::Stamped<TransformWithVariance> T_mapFid = T_mapCam * o.T_camFid;
-        T_mapFid.frame_id_ = mapFrame;
+        TransformWithVariance T_mapFid = T_mapCam * o.T_camFid;
 
         // New scope for logging vars
         {
             tf2::Vector3 trans = T_mapFid.transform.getOrigin();
 
-            ROS_INFO("Estimate of %d %lf %lf %lf var %lf %lf", o.fid, trans.x(), trans.y(),
-                     trans.z(), o.T_camFid.variance, T_mapFid.variance);
+            ROS_DEBUG("Estimate of %d %lf %lf %lf var %lf %lf", o.fid, trans.x(), trans.y(),
+                      trans.z(), o.T_camFid.variance, T_mapFid.variance);
 
             if (std::isnan(trans.x()) || std::isnan(trans.y()) || std::isnan(trans.z())) {
                 ROS_WARN("Skipping NAN estimate\n");
                 continue;
             };
         }
+        mapEstimates.push_back(std::make_pair(o.fid, T_mapFid));
+    }
 
-        if (fiducials.find(o.fid) == fiducials.end()) {
-            ROS_INFO("New fiducial %d", o.fid);
-            fiducials[o.fid] = Fiducial(o.fid, T_mapFid);
+    // A fiducial seen by more than one camera has all its estimates fused
+    // at once, so the result doesn't depend on the order of the cameras
+    std::stable_sort(mapEstimates.begin(), mapEstimates.end(),
+                     [](const std::pair<int, TransformWithVariance> &a,
+                        const std::pair<int, TransformWithVariance> &b) {
+                         return a.first < b.first;
+                     });
+
+    for (size_t i = 0; i < mapEstimates.size();) {
+        int fid = mapEstimates[i].first;
+        size_t end = i + 1;
+        while (end < mapEstimates.size() && mapEstimates[end].first == fid) {
+            end++;
         }
-        Fiducial &f = fiducials[o.fid];
-        f.visible = true;
+        const TransformWithVariance &T_mapFid = mapEstimates[i].second;
+
+        if (fiducials.find(fid) == fiducials.end()) {
+            ROS_INFO("New fiducial %d", fid);
+            fiducials[fid] = Fiducial(fid, T_mapFid);
+        }
+        Fiducial &f = fiducials[fid];
+        // Either way each estimate counts as one observation
         if (f.pose.variance != 0) {
-            f.update(T_mapFid);
-            f.numObs++;
+            if (end - i == 1) {
+                f.update(T_mapFid);
+            } else {
+                fuseBatch.clear();
+                fuseBatch.add(f.pose);
+                for (size_t j = i; j < end; j++) {
+                    fuseBatch.add(mapEstimates[j].second);
+                }
+                f.pose = fuseBatch.fuse();
+                f.numObs += end - i;
+            }
+        }
+        indexFiducial(f);
+        i = end;
+    }
+
+    noteObservations(obs);
+}
+
+// Record which fiducials were seen together in a frame, after their poses
+// have been updated
+
+void Map::noteObservations(const std::vector<Observation> &obs) {
+    // Only the fiducials seen in the previous frame need resetting
+    for (int id : visibleFids) {
+        auto it = fiducials.find(id);
+        if (it != fiducials.end()) {
+            it->second.visible = false;
+        }
+    }
+    visibleFids.clear();
+
+    for (const Observation &o : obs) {
+        auto it = fiducials.find(o.fid);
+        if (it == fiducials.end()) {
+            continue;
         }
 
+        Fiducial &f = it->second;
+        f.visible = true;
+        visibleFids.push_back(f.id);
+        linkComponents.add(f.id);
+
         for (const Observation &observation : obs) {
             int fid = observation.fid;
             if (f.id != fid) {
                 f.links.insert(fid);
+                if (fiducials.count(fid) > 0) {
+                    linkComponents.link(f.id, fid);
+                }
+            }
+        }
+        publishMarker(f);
+    }
+
+    addRelativePoses(obs, poseGraph);
+}
+
+// Solve for the camera poses of the frames in the smoothing window together
+// with the fiducials they saw, then update the map with the result
+
+void Map::smoothWindow() {
+    PoseGraph graph;
+    // Variance of each fiducial from this window's observations alone, and
+    // the number of them
+    std::map<int, double> information;
+    std::map<int, int> numEstimates;
+
+    for (size_t k = 0; k < window.size(); k++) {
+        const MapUpdate &u = window[k];
+        // Camera poses are numbered below any fiducial id
+        int camId = -1000000 - (int)k;
+        graph.addNode(camId, TransformWithCovariance(u.T_mapCam.transform, 1e6));
+
+        for (const Observation &o : u.obs) {
+            tf2::Vector3 trans = o.T_camFid.transform.getOrigin();
+            if (std::isnan(trans.x()) || std::isnan(trans.y()) || std::isnan(trans.z())) {
+                continue;
+            }
+
+            if (graph.nodes.count(o.fid) == 0) {
+                auto it = fiducials.find(o.fid);
+                if (it != fiducials.end()) {
+                    const Fiducial &f = it->second;
+                    graph.addNode(o.fid,
+                                  TransformWithCovariance(f.pose.transform, f.pose.variance));
+                } else {
+                    TransformWithVariance T_mapFid = u.T_mapCam * o.T_camFid;
+                    graph.addNode(o.fid, TransformWithCovariance(T_mapFid.transform, 1e6));
+                }
             }
+
+            graph.addEdge(camId, o.fid,
+                          TransformWithCovariance(o.T_camFid.transform, o.T_camFid.variance));
+            information[o.fid] += 1.0 / (u.T_mapCam.variance + o.T_camFid.variance);
+            numEstimates[o.fid]++;
+        }
+    }
+
+    graph.optimize(optimizeIterations);
+
+    for (const auto &info_pair : information) {
+        int id = info_pair.first;
+        const PoseGraph::Node &node = graph.nodes[id];
+        auto it = fiducials.find(id);
+
+        if (it == fiducials.end()) {
+            ROS_INFO("New fiducial %d", id);
+            fiducials[id] = Fiducial(id, TransformWithVariance(node.pose, 1.0 / info_pair.second));
+            it = fiducials.find(id);
+            it->second.numObs = numEstimates[id];
+        } else if (!node.fixed) {
+            // The smoothed pose already includes the map's estimate. Each
+            // estimate counts as one observation, as in updateMap
+            Fiducial &f = it->second;
+            f.pose.transform = node.pose;
+            f.pose.variance = 1.0 / (1.0 / f.pose.variance + info_pair.second);
+            f.numObs += numEstimates[id];
+        }
+        indexFiducial(it->second);
+    }
+
+    for (const MapUpdate &u : window) {
+        noteObservations(u.obs);
+    }
+
+    ROS_DEBUG("Smoothed %d frames with %d fiducials", (int)window.size(),
+              (int)information.size());
+    window.clear();
+}
+
+// Start optimizing a copy of the pose graph, using the current fiducial
+// poses as the initial estimate
+
+void Map::requestOptimization() {
+    PoseGraph graph;
+    if (!buildOptimizationGraph(graph)) {
+        optimizeRequested = false;
+        return;
+    }
+
+    if (optimizer.request(graph, optimizeIterations)) {
+        ROS_INFO("Optimizing map with %d fiducials and %d links", (int)graph.nodes.size(),
+                 (int)graph.edges.size());
+        optimizeRequested = false;
+    }
+}
+
+// Copy of the pose graph with the current fiducial poses as priors. Returns
+// false if there are no relative observations to optimize with
+
+bool Map::buildOptimizationGraph(PoseGraph &graph) const {
+    if (poseGraph.edges.empty()) {
+        return false;
+    }
+
+    graph.clear();
+    graph.edges = poseGraph.edges;
+
+    for (const auto &map_pair : fiducials) {
+        const Fiducial &f = map_pair.second;
+        // Fiducials with zero variance, such as the origin, stay fixed
+        double var = f.pose.variance;
+        if (var != 0.0) {
+            var = std::max(var, optimizePriorVariance);
+        }
+        graph.addNode(f.id, TransformWithCovariance(f.pose.transform, var));
+    }
+    return true;
+}
+
+// Replace the fiducial poses with the result of an optimization, if one has finished
+
+bool Map::applyOptimization() {
+    PoseGraph result;
+    if (!optimizer.takeResult(result)) {
+        return false;
+    }
+    if (staleOptimization) {
+        staleOptimization = false;
+        return false;
+    }
+
+    applyOptimizedGraph(result);
+    return true;
+}
+
+// Throw away the result of any optimization started before the map was
+// edited. Called with mapMutex held
+
+void Map::discardOptimization() {
+    // Checked first, so that one finishing in between is never applied
+    staleOptimization = optimizer.busy();
+    PoseGraph result;
+    optimizer.takeResult(result);
+}
+
+// Move each fiducial by the correction the optimizer made to the pose it
+// started from. Fiducials updated while the optimization was running keep
+// those updates, and their variance, rather than being set back to the
+// optimized copy of their old pose
+
+void Map::applyOptimizedGraph(const PoseGraph &result) {
+    for (const auto &node_pair : result.nodes) {
+        auto it = fiducials.find(node_pair.first);
+        if (it != fiducials.end()) {
+            const PoseGraph::Node &node = node_pair.second;
+            tf2::Transform correction = node.pose * node.prior.transform.inverse();
+            it->second.pose.transform = correction * it->second.pose.transform;
+            indexFiducial(it->second);
         }
-        publishMarker(fiducials[o.fid]);
     }
+
+    ROS_INFO("Applied optimized map with %d fiducials", (int)result.nodes.size());
+}
+
+// Optimize the whole map in the calling thread and wait for the result, so
+// that a map built offline doesn't depend on how long optimizing takes
+
+void Map::optimize(int iterations) {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    PoseGraph graph;
+    if (!buildOptimizationGraph(graph)) {
+        ROS_WARN("No links between fiducials to optimize the map with");
+        return;
+    }
+
+    double before = graph.error();
+    double after = graph.optimize(iterations);
+    ROS_INFO("Optimized map with %d fiducials and %d links, error %lf -> %lf",
+             (int)graph.nodes.size(), (int)graph.edges.size(), before, after);
+    applyOptimizedGraph(graph);
+    publishSnapshot();
 }
 
 // lookup specified transform
 
 bool Map::lookupTransform(const std::string &from, const std::string &to, const ros::Time &time,
                           tf2::Transform &T) const {
+    ScopedTiming timing(tfWaitTiming);
+    fiducial_msgs::TraceSpan span(trace, "tf_wait", 0, time);
     geometry_msgs::TransformStamped transform;
 
     try {
-        transform = tfBuffer.lookupTransform(from, to, time, ros::Duration(0.5));
+        transform = tfBuffer.lookupTransform(from, to, time, ros::Duration(tfTimeout));
 
         tf2::fromMsg(transform.transform, T);
         return true;
@@ -241,6 +866,135 @@ bool Map::lookupTransform(const std::string &from, const std::string &to, const
     }
 }
 
+// Pose of a camera on the robot. These rarely change, so are cached rather
+// than looked up for every frame
+
+bool Map::lookupExtrinsics(int frame, const ros::Time &time, tf2::Transform &T_baseCam) {
+    auto it = cameraExtrinsics.find(frame);
+    if (it != cameraExtrinsics.end() && extrinsicsRefresh > 0 &&
+        std::fabs((time - it->second.lookedUp).toSec()) < extrinsicsRefresh) {
+        T_baseCam = it->second.T_baseCam;
+        return true;
+    }
+
+    if (!lookupTransform(baseFrame, FrameIds::name(frame), time, T_baseCam)) {
+        return false;
+    }
+    CameraExtrinsics &e = cameraExtrinsics[frame];
+    e.T_baseCam = T_baseCam;
+    e.lookedUp = time;
+    return true;
+}
+
+// Bring observations from several cameras, or taken at slightly different
+// times, into the frame of the first camera at the given time so that they
+// can be solved together. Odometry accounts for the robot moving in between,
+// and observations from a camera whose pose on the robot isn't known are
+// dropped
+
+void Map::alignObservations(std::vector<Observation> &obs, const ros::Time &time) {
+    if (obs.empty()) {
+        return;
+    }
+
+    int refFrame = obs[0].frame;
+    bool aligned = true;
+    for (const Observation &o : obs) {
+        if (o.frame != refFrame || o.stamp != time) {
+            aligned = false;
+            break;
+        }
+    }
+    if (aligned) {
+        return;
+    }
+
+    tf2::Transform T_baseRef;
+    if (!lookupExtrinsics(refFrame, time, T_baseRef)) {
+        return;
+    }
+    tf2::Transform T_refBase = T_baseRef.inverse();
+
+    tf2::Transform T_odomBase;
+    bool haveOdom = !odomFrame.empty() && lookupTransform(odomFrame, baseFrame, time, T_odomBase);
+
+    size_t n = 0;
+    for (size_t i = 0; i < obs.size(); i++) {
+        Observation &o = obs[i];
+        if (o.frame != refFrame || o.stamp != time) {
+            tf2::Transform T_baseCam;
+            if (!lookupExtrinsics(o.frame, o.stamp, T_baseCam)) {
+                ROS_WARN("Dropping fiducial %d, no pose for camera %s", o.fid,
+                         o.frameId().c_str());
+                continue;
+            }
+
+            // Where the robot was when the image was taken, relative to now
+            tf2::Transform T_baseThen;
+            T_baseThen.setIdentity();
+            tf2::Transform T_odomThen;
+            if (haveOdom && o.stamp != time &&
+                lookupTransform(odomFrame, baseFrame, o.stamp, T_odomThen)) {
+                T_baseThen = T_odomBase.inverse() * T_odomThen;
+            }
+
+            o.reframe(T_refBase * T_baseThen * T_baseCam, refFrame, time);
+        }
+        if (n != i) {
+            std::swap(obs[n], obs[i]);
+        }
+        n++;
+    }
+    obs.resize(n);
+}
+
+// Check that the known fiducials in a frame are laid out as they are in the
+// map, dropping any that are misidentified. Returns false if there aren't
+// two that agree
+
+bool Map::relocalizeFrame(std::vector<Observation> &obs,
+                          const std::shared_ptr<const FiducialMap> &snap, const ros::Time &time) {
+    relocalizeObserved.clear();
+    int numKnown = 0;
+    for (const Observation &o : obs) {
+        relocalizeObserved.push_back(std::make_pair(o.fid, o.T_camFid.transform));
+        if (snap->count(o.fid)) {
+            numKnown++;
+        }
+    }
+
+    // A single fiducial can't be checked
+    if (numKnown < 2) {
+        return true;
+    }
+
+    // The map changes little while lost, so the index isn't rebuilt for every snapshot
+    if (relocalizerMap == nullptr ||
+        (relocalizerMap != snap && (time - relocalizerBuilt).toSec() > relocalizeTimeout)) {
+        relocalizer.build(*snap, visibilityRange);
+        relocalizerMap = snap;
+        relocalizerBuilt = time;
+        ROS_INFO("Built relocalization index with %d pairs", (int)relocalizer.numPairs());
+    }
+
+    std::vector<int> &inliers = relocalizeInliers;
+    if (relocalizer.match(*relocalizerMap, relocalizeObserved, inliers) == 0) {
+        ROS_WARN_THROTTLE(1.0, "Cannot relocalize, none of the %d known fiducials agree with the map", numKnown);
+        return false;
+    }
+
+    auto end = std::remove_if(obs.begin(), obs.end(), [&](const Observation &o) {
+        return snap->count(o.fid) && !std::binary_search(inliers.begin(), inliers.end(), o.fid);
+    });
+    if (end != obs.end()) {
+        ROS_WARN_THROTTLE(1.0, "Relocalization rejected %d fiducials", (int)(obs.end() - end));
+        obs.erase(end, obs.end());
+    }
+
+    ROS_DEBUG("Relocalized from %d of %d known fiducials", (int)inliers.size(), numKnown);
+    return true;
+}
+
 // update pose estimate of robot.  We combine the camera->base_link
 // tf to each estimate so we can evaluate how good they are.  A good
 // estimate would have z == roll == pitch == 0.
@@ -251,37 +1005,63 @@ int Map::updatePose(std::vector<Observation> &obs, const ros::Time &time,
     tf2::Stamped<TransformWithVariance> T_baseCam;
     tf2::Stamped<TransformWithVariance> T_mapBase;
 
+    // Poses are estimated against a snapshot of the map. Once it has been
+    // moved or cleared, the last pose is in the old map and can't be used
+    // to predict the next
+    std::shared_ptr<const MapSnapshot> mapSnap = getVersionedSnapshot();
+    if (mapSnap->epoch != poseEpoch) {
+        poseEpoch = mapSnap->epoch;
+        haveOdomPose = false;
+        havePose = false;
+    }
+
+    // Predict where the robot is from its motion since the last pose
+    TransformWithCovariance predicted;
+    tf2::Transform T_odomBase;
+    bool havePrediction = predictPose(time, predicted, T_odomBase);
+
     if (obs.size() == 0) {
+        if (havePrediction) {
+            publishPrediction(predicted, T_odomBase, time);
+        }
         return 0;
     }
 
-    if (lookupTransform(obs[0].T_camFid.frame_id_, baseFrame, time, T_camBase.transform)) {
-        tf2::Vector3 c = T_camBase.transform.getOrigin();
-        ROS_INFO("camera->base   %lf %lf %lf", c.x(), c.y(), c.z());
-        T_camBase.variance = 1.0;
-    } else {
-        ROS_ERROR("Cannot determine tf from camera to robot\n");
+    std::shared_ptr<const FiducialMap> snap(mapSnap, &mapSnap->fiducials);
+    poseSolver.clear();
+
+    // Without a recent pose there is nothing to check the fiducials against
+    // other than the layout of the map
+    bool lost = lastPoseTime.isZero() || (time - lastPoseTime).toSec() > relocalizeTimeout;
+    if (relocalize && lost) {
+        if (!relocalizeFrame(obs, snap, time)) {
+            return 0;
+        }
     }
 
-    if (lookupTransform(baseFrame, obs[0].T_camFid.frame_id_, time, T_baseCam.transform)) {
+    // The observations have all been brought into the frame of the first
+    if (lookupExtrinsics(obs[0].frame, time, T_baseCam.transform)) {
         tf2::Vector3 c = T_baseCam.transform.getOrigin();
-        ROS_INFO("base->camera   %lf %lf %lf", c.x(), c.y(), c.z());
+        ROS_DEBUG("base->camera   %lf %lf %lf", c.x(), c.y(), c.z());
         T_baseCam.variance = 1.0;
+        T_camBase.transform = T_baseCam.transform.inverse();
+        T_camBase.variance = 1.0;
     } else {
         ROS_ERROR("Cannot determine tf from robot to camera\n");
         return numEsts;
     }
 
-    for (Observation &o : obs) {
-        if (fiducials.find(o.fid) != fiducials.end()) {
-            const Fiducial &fid = fiducials[o.fid];
+    estimateFids.clear();
+    rejectedFids.clear();
 
-            tf2::Stamped<TransformWithVariance> p = fid.pose * o.T_fidCam;
+    for (Observation &o : obs) {
+        auto it = snap->find(o.fid);
+        if (it != snap->end()) {
+            const Fiducial &fid = it->second;
 
-            p.frame_id_ = mapFrame;
-            p.stamp_ = o.T_fidCam.stamp_;
+            TransformWithVariance p =
+                fid.pose * TransformWithVariance(o.T_fidCam(), o.T_camFid.variance) * T_camBase;
 
-            p.setData(p * T_camBase);
             auto position = p.transform.getOrigin();
             double roll, pitch, yaw;
             p.transform.getBasis().getRPY(roll, pitch, yaw);
@@ -289,16 +1069,16 @@ int Map::updatePose(std::vector<Observation> &obs, const ros::Time &time,
             // Create variance according to how well the robot is upright on the ground
             // TODO: Create variance for each DOF
             // TODO: Take into account position according to odom
-            auto cam_f = o.T_camFid.transform.getOrigin();
-            double s1 = std::pow(position.z() / cam_f.z(), 2) *
-                        (std::pow(cam_f.x(), 2) + std::pow(cam_f.y(), 2));
+            // The angle off the axis is from the camera that saw the
+            // fiducial, not the one the observations were brought into
+            double s1 = std::pow(position.z(), 2) * o.offAxis2;
             double s2 = position.length2() * std::pow(std::sin(roll), 2);
             double s3 = position.length2() * std::pow(std::sin(pitch), 2);
             p.variance = s1 + s2 + s3 + systematic_error;
             o.T_camFid.variance = p.variance;
 
-            ROS_INFO("Pose %d %lf %lf %lf %lf %lf %lf %lf", o.fid, position.x(), position.y(),
-                     position.z(), roll, pitch, yaw, p.variance);
+            ROS_DEBUG("Pose %d %lf %lf %lf %lf %lf %lf %lf", o.fid, position.x(), position.y(),
+                      position.z(), roll, pitch, yaw, p.variance);
 
             // drawLine(fid.pose.getOrigin(), o.position);
 
@@ -307,107 +1087,319 @@ int Map::updatePose(std::vector<Observation> &obs, const ros::Time &time,
                 continue;
             };
 
-            // compute base_link pose based on this estimate
+            // Propagate the fiducial's map uncertainty and the estimate's
+            // variance through to base_link so the solve has a covariance
+            // for each DOF
+            TransformWithCovariance pc = TransformWithCovariance(fid.pose) *
+                                         TransformWithCovariance(o.T_fidCam(), p.variance) *
+                                         T_camBase.transform;
+
+            // Reject estimates too far from where odometry says the robot is
+            if (havePrediction && predicted.mahalanobis2(pc) > odomGate * odomGate) {
+                ROS_DEBUG("Estimate from fiducial %d is outside odometry gate", o.fid);
+                rejectedFids.push_back(o.fid);
+                continue;
+            }
 
-            if (numEsts == 0) {
-                T_mapBase = p;
-            } else {
-                T_mapBase.setData(averageTransforms(T_mapBase, p));
-                T_mapBase.stamp_ = p.stamp_;
+            if (!poseSolver.add(pc)) {
+                ROS_WARN("Too many estimates, ignoring fiducial %d", o.fid);
+                break;
+            }
+            estimateFids.push_back(o.fid);
+        }
+    }
+
+    // Solve for base_link using all the estimates at once, rejecting
+    // those that disagree with the rest
+    TransformWithCovariance T_mapBaseCov;
+    numEsts = poseSolver.solve(T_mapBaseCov);
+    if (numEsts < poseSolver.size()) {
+        ROS_DEBUG("Rejected %d of %d estimates", poseSolver.size() - numEsts, poseSolver.size());
+        for (int i = 0; i < poseSolver.size(); i++) {
+            if (!poseSolver.isInlier(i)) {
+                rejectedFids.push_back(estimateFids[i]);
             }
-            numEsts++;
         }
     }
 
+    // Rejected observations don't update the map
+    if (!rejectedFids.empty()) {
+        obs.erase(std::remove_if(obs.begin(), obs.end(),
+                                 [&](const Observation &o) {
+                                     return std::find(rejectedFids.begin(), rejectedFids.end(),
+                                                      o.fid) != rejectedFids.end();
+                                 }),
+                  obs.end());
+    }
+
+    TransformWithCovariance T_mapBaseFids = T_mapBaseCov;
+    if (numEsts > 0 && havePrediction) {
+        T_mapBaseCov.update(predicted);
+    }
+
+    T_mapBase = tf2::Stamped<TransformWithVariance>(
+        TransformWithVariance(T_mapBaseCov.transform, T_mapBaseCov.variance()), time, mapFrame);
+
     if (numEsts == 0) {
-        ROS_INFO("Finished frame - no estimates\n");
+        if (havePrediction) {
+            publishPrediction(predicted, T_odomBase, time);
+        }
+        ROS_DEBUG("Finished frame - no estimates\n");
         return numEsts;
     }
 
+    // The fiducials agree on a pose, so tracking isn't lost even if it can't
+    // be published for want of odometry
+    lastPoseTime = time;
+
     // New scope for logging vars
     {
         tf2::Vector3 trans = T_mapBase.transform.getOrigin();
         double r, p, y;
         T_mapBase.transform.getBasis().getRPY(r, p, y);
 
-        ROS_INFO("Pose ALL %lf %lf %lf %lf %lf %lf %f", trans.x(), trans.y(), trans.z(), r, p, y,
-                 T_mapBase.variance);
+        ROS_DEBUG("Pose ALL %lf %lf %lf %lf %lf %lf %f", trans.x(), trans.y(), trans.z(), r, p, y,
+                  T_mapBase.variance);
     }
 
     tf2::Stamped<TransformWithVariance> basePose = T_mapBase;
     basePose.frame_id_ = mapFrame;
-    auto robotPose = toPose(basePose);
+
+    // Publish the averaged pose with the covariance of the fused estimates
+    auto robotPose = toPose(tf2::Stamped<TransformWithCovariance>(
+        TransformWithCovariance(T_mapBase.transform, T_mapBaseCov.covariance), T_mapBase.stamp_,
+        mapFrame));
 
     if (overridePublishedCovariance) {
+        std::fill(robotPose.pose.covariance.begin(), robotPose.pose.covariance.end(), 0);
         for (int i = 0; i <= 5; i++) {
             robotPose.pose.covariance[i * 6 + i] = covarianceDiagonal[i];  // Fill the diagonal
         }
     }
 
-    T_mapCam = T_mapBase * T_baseCam;
+    T_mapCam = T_mapBase * T_baseCam;
+
+    tf2::Stamped<TransformWithVariance> outPose = basePose;
+    outPose.frame_id_ = mapFrame;
+    std::string outFrame = baseFrame;
+    tf2::Transform odomTransform = tf2::Transform::getIdentity();
+    bool haveOdom = !odomFrame.empty() &&
+                    lookupTransform(odomFrame, baseFrame, outPose.stamp_, odomTransform);
+
+    // Once a move of the map has been applied, nothing estimated against
+    // the old map is published or kept
+    std::lock_guard<std::mutex> lock(poseMutex);
+    if (poseEpoch != mapEpoch) {
+        ROS_DEBUG("Map moved while estimating the pose, dropping it");
+        return 0;
+    }
+
+    if (robotPosePub) {
+        robotPosePub.publish(robotPose);
+    }
+
+    if (!odomFrame.empty()) {
+        if (haveOdom) {
+            outPose.setData(basePose * odomTransform.inverse());
+            outFrame = odomFrame;
+
+            // The next prediction starts from the fused pose, but is no more
+            // certain than the fiducials in this frame. The same fiducials are
+            // seen frame after frame, so fusing each estimate into the last
+            // would count them again and again
+            lastMapBase = TransformWithCovariance(T_mapBaseCov.transform,
+                                                  T_mapBaseFids.covariance);
+            lastOdomBase = odomTransform;
+            lastOdomTime = time;
+            haveOdomPose = true;
+
+            tf2::Vector3 c = odomTransform.getOrigin();
+            ROS_DEBUG("odom   %lf %lf %lf", c.x(), c.y(), c.z());
+        }
+        else {
+            // Don't publish anything if map->odom was requested and is unavailaable
+            return numEsts;
+        }
+    }
+
+    // Make outgoing transform make sense - ie only consist of x, y, yaw
+    // This can be disabled via the publish_6dof_pose param, mainly for debugging
+    if (!publish_6dof_pose) {
+        tf2::Vector3 translation = outPose.transform.getOrigin();
+        translation.setZ(0);
+        outPose.transform.setOrigin(translation);
+        double roll, pitch, yaw;
+        outPose.transform.getBasis().getRPY(roll, pitch, yaw);
+        outPose.transform.getBasis().setRPY(0, 0, yaw);
+    }
+
+    poseTf = toMsg(outPose);
+    poseTf.child_frame_id = outFrame;
+    havePose = true;
+
+    // Make this fix available to the extrapolated pose output
+    std::shared_ptr<PoseFix> fix = freeFix();
+    fix->T_mapBase = T_mapBaseCov;
+    fix->T_odomBase = odomTransform;
+    fix->stamp = time;
+    fix->poseTf = poseTf;
+    fix->mapEpoch = poseEpoch;
+    std::atomic_store(&lastFix, std::shared_ptr<const PoseFix>(fix));
+
+    // The pose timer publishes the tf itself when enabled
+    if (publishPoseTf && posePublishRate <= 0.0) {
+        publishTf();
+    }
+
+    ROS_DEBUG("Finished frame. Estimates %d\n", numEsts);
+    return numEsts;
+}
+
+// A fix that nothing but the pool refers to, so that it can be filled in
+// without allocating. One is the last fix and the pose timer may hold
+// another, so the pool stops growing after a few frames
+
+std::shared_ptr<PoseFix> Map::freeFix() {
+    for (const std::shared_ptr<PoseFix> &fix : fixPool) {
+        if (fix.use_count() == 1) {
+            // Pairs with the pose timer letting go of it
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return fix;
+        }
+    }
+    fixPool.push_back(std::make_shared<PoseFix>());
+    return fixPool.back();
+}
+
+// Predict the robot's pose at time from the last pose and the odometry since
+// then. Returns false if there isn't a recent pose or odometry
+
+bool Map::predictPose(const ros::Time &time, TransformWithCovariance &predicted,
+                      tf2::Transform &T_odomBase) {
+    if (odomGate <= 0 || odomFrame.empty() || !haveOdomPose ||
+        (time - lastOdomTime).toSec() > relocalizeTimeout) {
+        return false;
+    }
+
+    if (!lookupTransform(odomFrame, baseFrame, time, T_odomBase)) {
+        return false;
+    }
+
+    predicted = lastMapBase * odomMotion(lastOdomBase.inverse() * T_odomBase,
+                                         (time - lastOdomTime).toSec());
+    return true;
+}
+
+// Motion of the robot by delta according to odometry, over the given
+// number of seconds. Odometry error grows with the distance travelled and
+// the rotation, and the error of the pose it started from with time
+
+TransformWithCovariance Map::odomMotion(const tf2::Transform &delta, double seconds) const {
+    double moved = delta.getOrigin().length() +
+                   tf2::Quaternion::getIdentity().angleShortestPath(delta.getRotation());
+    return TransformWithCovariance(
+        delta, odomVariance * moved + odomTimeVariance * std::max(seconds, 0.0));
+}
+
+// Publish a predicted pose for a frame without usable estimates. The map->odom
+// transform is unchanged, so isn't published
+
+void Map::publishPrediction(const TransformWithCovariance &predicted,
+                            const tf2::Transform &T_odomBase, const ros::Time &time) {
+    lastMapBase = predicted;
+    lastOdomBase = T_odomBase;
+    lastOdomTime = time;
+
+    std::lock_guard<std::mutex> lock(poseMutex);
+    if (poseEpoch != mapEpoch) {
+        return;
+    }
+    if (robotPosePub) {
+        robotPosePub.publish(
+            toPose(tf2::Stamped<TransformWithCovariance>(predicted, time, mapFrame)));
+    }
+}
+
+// Publish the last fix moved on by the latest odometry. Runs on its own
+// thread so it isn't held up by frames being processed
 
-    robotPosePub.publish(robotPose);
+void Map::poseTimerCallback(const ros::TimerEvent &event) {
+    auto fix = std::atomic_load(&lastFix);
+    if (fix == nullptr) {
+        return;
+    }
 
-    tf2::Stamped<TransformWithVariance> outPose = basePose;
-    outPose.frame_id_ = mapFrame;
-    std::string outFrame = baseFrame;
+    ros::Time now = ros::Time::now();
+    if ((now - fix->stamp).toSec() > relocalizeTimeout) {
+        return;
+    }
 
-    if (!odomFrame.empty()) {
-        tf2::Transform odomTransform;
-        if (lookupTransform(odomFrame, baseFrame, outPose.stamp_, odomTransform)) {
-            outPose.setData(basePose * odomTransform.inverse());
-            outFrame = odomFrame;
+    TransformWithCovariance pose = fix->T_mapBase;
+    ros::Time stamp = fix->stamp;
 
-            tf2::Vector3 c = odomTransform.getOrigin();
-            ROS_INFO("odom   %lf %lf %lf", c.x(), c.y(), c.z());
-        }
-        else {
-            // Don't publish anything if map->odom was requested and is unavailaable
-            return numEsts;
+    if (!odomFrame.empty()) {
+        geometry_msgs::TransformStamped odom;
+        try {
+            odom = tfBuffer.lookupTransform(odomFrame, baseFrame, ros::Time(0));
+        } catch (tf2::TransformException &ex) {
+            ROS_WARN_THROTTLE(1.0, "%s", ex.what());
+            return;
         }
+
+        tf2::Transform T_odomBase;
+        tf2::fromMsg(odom.transform, T_odomBase);
+        pose = pose * odomMotion(fix->T_odomBase.inverse() * T_odomBase,
+                                 (odom.header.stamp - fix->stamp).toSec());
+        stamp = odom.header.stamp;
     }
 
-    // Make outgoing transform make sense - ie only consist of x, y, yaw
-    // This can be disabled via the publish_6dof_pose param, mainly for debugging
-    if (!publish_6dof_pose) {
-        tf2::Vector3 translation = outPose.transform.getOrigin();
-        translation.setZ(0);
-        outPose.transform.setOrigin(translation);
-        double roll, pitch, yaw;
-        outPose.transform.getBasis().getRPY(roll, pitch, yaw);
-        outPose.transform.getBasis().setRPY(0, 0, yaw);
+    // A fix from before the map was moved or cleared is in the old map
+    std::lock_guard<std::mutex> lock(poseMutex);
+    if (fix->mapEpoch != mapEpoch) {
+        return;
     }
 
-    poseTf = toMsg(outPose);
-    poseTf.child_frame_id = outFrame;
-    havePose = true;
+    extrapolatedPosePub.publish(
+        toPose(tf2::Stamped<TransformWithCovariance>(pose, stamp, mapFrame)));
 
+    // Replaces future dating of map->odom, as it is republished at this rate
     if (publishPoseTf) {
-        publishTf();
+        geometry_msgs::TransformStamped tf = fix->poseTf;
+        tf.header.stamp = now;
+        broadcaster->sendTransform(tf);
     }
-
-    ROS_INFO("Finished frame. Estimates %d\n", numEsts);
-    return numEsts;
 }
 
 // Publish map -> odom tf
 
 void Map::publishTf() {
+    if (!broadcaster) {
+        return;
+    }
     tfPublishTime = ros::Time::now();
     poseTf.header.stamp = tfPublishTime + ros::Duration(future_date_transforms);
-    broadcaster.sendTransform(poseTf);
+    broadcaster->sendTransform(poseTf);
 }
 
 // publish latest tf if enough time has elapsed
 
 void Map::update() {
     ros::Time now = ros::Time::now();
-    if (publishPoseTf && havePose && tfPublishInterval != 0.0 &&
+    // The pose timer republishes the tf itself when enabled
+    if (publishPoseTf && havePose && tfPublishInterval != 0.0 && posePublishRate <= 0.0 &&
         (now - tfPublishTime).toSec() > tfPublishInterval) {
-        publishTf();
-        tfPublishTime = now;
+        std::lock_guard<std::mutex> lock(poseMutex);
+        if (poseEpoch == mapEpoch) {
+            publishTf();
+            tfPublishTime = now;
+        }
+    }
+
+    // The map thread refreshes markers itself
+    if (!backgroundUpdates) {
+        std::lock_guard<std::mutex> lock(mapMutex);
+        publishMarkers();
     }
-    publishMarkers();
 }
 
 // Find closest fiducial to camera
@@ -434,7 +1426,7 @@ static int findClosestObs(const std::vector<Observation> &obs) {
 // map frame
 
 void Map::autoInit(const std::vector<Observation> &obs, const ros::Time &time) {
-    ROS_INFO("Auto init map %d", frameNum);
+    ROS_DEBUG("Auto init map %d", frameNum);
 
     tf2::Transform T_baseCam;
 
@@ -450,38 +1442,122 @@ void Map::autoInit(const std::vector<Observation> &obs, const ros::Time &time) {
 
         ROS_INFO("Initializing map from fiducial %d", o.fid);
 
-        tf2::Stamped<TransformWithVariance> T = o.T_camFid;
+        TransformWithVariance T = o.T_camFid;
 
-        if (lookupTransform(baseFrame, o.T_camFid.frame_id_, o.T_camFid.stamp_, T_baseCam)) {
-            T.setData(T_baseCam * T);
+        if (lookupTransform(baseFrame, o.frameId(), o.stamp, T_baseCam)) {
+            T = T_baseCam * T;
         }
 
         fiducials[o.fid] = Fiducial(o.fid, T);
+        indexFiducial(fiducials[o.fid]);
     } else {
         for (const Observation &o : obs) {
             if (o.fid == originFid) {
-                tf2::Stamped<TransformWithVariance> T = o.T_camFid;
+                TransformWithVariance T = o.T_camFid;
 
                 tf2::Vector3 trans = T.transform.getOrigin();
-                ROS_INFO("Estimate of %d from base %lf %lf %lf err %lf", o.fid, trans.x(),
-                         trans.y(), trans.z(), o.T_camFid.variance);
+                ROS_DEBUG("Estimate of %d from base %lf %lf %lf err %lf", o.fid, trans.x(),
+                          trans.y(), trans.z(), o.T_camFid.variance);
 
-                if (lookupTransform(baseFrame, o.T_camFid.frame_id_, o.T_camFid.stamp_,
-                                    T_baseCam)) {
-                    T.setData(T_baseCam * T);
+                if (lookupTransform(baseFrame, o.frameId(), o.stamp, T_baseCam)) {
+                    T = T_baseCam * T;
                 }
 
                 fiducials[originFid].update(T);
+                indexFiducial(fiducials[originFid]);
                 break;
             }
         }
     }
 
+    if (multiFiducialInit) {
+        addRelativePoses(obs, initGraph);
+        for (const Observation &o : obs) {
+            initObservations[o.fid]++;
+        }
+    }
+
     if (frameNum - initialFrameNum > 10 && originFid != -1) {
         isInitializingMap = false;
 
         fiducials[originFid].pose.variance = 0.0;
+
+        if (multiFiducialInit) {
+            initFromGraph();
+        }
+    }
+}
+
+// Seed the map with all the fiducials seen along with the origin during
+// initialization, solving for their poses jointly
+
+void Map::initFromGraph() {
+    const Fiducial &origin = fiducials[originFid];
+
+    // Initial estimates by chaining relative poses out from the origin
+    std::map<int, TransformWithCovariance> poses;
+    initGraph.chainPoses(originFid, TransformWithCovariance(origin.pose.transform, 0.0), poses);
+
+    for (const auto &pose_pair : poses) {
+        int id = pose_pair.first;
+        if (id == originFid) {
+            initGraph.addNode(id, pose_pair.second);
+        } else if (initObservations[id] >= initMinObservations) {
+            // A weak prior, so that the relative poses decide
+            initGraph.addNode(id, TransformWithCovariance(pose_pair.second.transform, 1e6));
+        }
+    }
+    initGraph.optimize(optimizeIterations);
+
+    // Reject fiducials whose relative poses don't agree with the solution
+    std::map<int, double> error;
+    std::map<int, int> numEdges;
+    for (const auto &edge_pair : initGraph.edges) {
+        const PoseGraph::Edge &e = edge_pair.second;
+        if (initGraph.nodes.count(e.from) && initGraph.nodes.count(e.to)) {
+            double err = initGraph.edgeError(e);
+            error[e.from] += err;
+            error[e.to] += err;
+            numEdges[e.from]++;
+            numEdges[e.to]++;
+        }
+    }
+
+    int numAdded = 0;
+    for (const auto &node_pair : initGraph.nodes) {
+        int id = node_pair.first;
+        if (id == originFid) {
+            continue;
+        }
+        if (numEdges[id] == 0 || error[id] / numEdges[id] > initMaxError) {
+            ROS_WARN("Not adding fiducial %d to initial map, error %lf", id,
+                     numEdges[id] ? error[id] / numEdges[id] : 0.0);
+            continue;
+        }
+
+        double var = std::max(poses[id].variance(), systematic_error);
+        fiducials[id] = Fiducial(id, TransformWithVariance(node_pair.second.pose, var));
+        fiducials[id].numObs = initObservations[id];
+        indexFiducial(fiducials[id]);
+        numAdded++;
     }
+
+    // Link the fiducials that were seen together, and keep the relative
+    // poses for later optimization
+    for (const auto &edge_pair : initGraph.edges) {
+        const PoseGraph::Edge &e = edge_pair.second;
+        auto from = fiducials.find(e.from);
+        auto to = fiducials.find(e.to);
+        if (from != fiducials.end() && to != fiducials.end()) {
+            from->second.links.insert(e.to);
+            to->second.links.insert(e.from);
+        }
+        poseGraph.edges[edge_pair.first] = e;
+    }
+
+    ROS_INFO("Initialized map with %d fiducials around origin %d", numAdded + 1, originFid);
+    initGraph.clear();
+    initObservations.clear();
 }
 
 // Attempt to add the specified fiducial to the map
@@ -504,26 +1580,29 @@ void Map::handleAddFiducial(const std::vector<Observation> &obs) {
             ROS_INFO("Adding fiducial_id %d to map", fiducialToAdd);
 
 
-            tf2::Stamped<TransformWithVariance> T = o.T_camFid;
+            TransformWithVariance T = o.T_camFid;
 
             // Take into account position of camera on base
             tf2::Transform T_baseCam;
-            if (lookupTransform(baseFrame, o.T_camFid.frame_id_,
-                                o.T_camFid.stamp_, T_baseCam)) {
-                T.setData(T_baseCam * T);
+            if (lookupTransform(baseFrame, o.frameId(), o.stamp, T_baseCam)) {
+                T = T_baseCam * T;
             }
 
             // Take into account position of robot in the world if known
             tf2::Transform T_mapBase;
             if (lookupTransform(mapFrame, baseFrame, ros::Time(0), T_mapBase)) {
-                T.setData(T_mapBase * T);
+                T = T_mapBase * T;
             }
             else {
                 ROS_INFO("Placing robot at the origin");
             }
 
             fiducials[o.fid] = Fiducial(o.fid, T);
-            fiducials[originFid].pose.variance = 0.0;
+            indexFiducial(fiducials[o.fid]);
+            auto origin = fiducials.find(originFid);
+            if (origin != fiducials.end()) {
+                origin->second.pose.variance = 0.0;
+            }
             isInitializingMap = false;
 
             fiducialToAdd = -1;
@@ -536,10 +1615,33 @@ void Map::handleAddFiducial(const std::vector<Observation> &obs) {
 
 // save map to file
 
-bool Map::saveMap() { return saveMap(mapFilename); }
+bool Map::saveMap() {
+    if (tiles.enabled()) {
+        return saveTiles();
+    }
+    return saveMap(mapFilename);
+}
+
+// Write the tiles in memory along with the index of all tiles
+
+bool Map::saveTiles() {
+    std::lock_guard<std::mutex> lock(mapMutex);
+
+    std::vector<int> loaded;
+    tiles.assign(fiducials, loaded);
+    for (int id : loaded) {
+        indexFiducial(fiducials[id]);
+    }
+
+    ROS_INFO("Saving map tiles with %d fiducials in memory\n", (int)fiducials.size());
+    return tiles.save(fiducials);
+}
 
 bool Map::saveMap(std::string filename) {
-    ROS_INFO("Saving map with %d fiducials to file %s\n", (int)fiducials.size(), filename.c_str());
+    // Save from a snapshot so that the map can keep being updated
+    auto snap = getSnapshot();
+
+    ROS_INFO("Saving map with %d fiducials to file %s\n", (int)snap->size(), filename.c_str());
 
     FILE *fp = fopen(filename.c_str(), "w");
     if (fp == NULL) {
@@ -547,19 +1649,8 @@ bool Map::saveMap(std::string filename) {
         return false;
     }
 
-    for (auto &map_pair : fiducials) {
-        Fiducial &f = map_pair.second;
-        tf2::Vector3 trans = f.pose.transform.getOrigin();
-        double rx, ry, rz;
-        f.pose.transform.getBasis().getRPY(rx, ry, rz);
-
-        fprintf(fp, "%d %lf %lf %lf %lf %lf %lf %lf %d", f.id, trans.x(), trans.y(), trans.z(),
-                rad2deg(rx), rad2deg(ry), rad2deg(rz), f.pose.variance, f.numObs);
-
-        for (const auto linked_fid : f.links) {
-            fprintf(fp, " %d", linked_fid);
-        }
-        fprintf(fp, "\n");
+    for (const auto &map_pair : *snap) {
+        writeFiducial(fp, map_pair.second);
     }
     fclose(fp);
     return true;
@@ -582,37 +1673,14 @@ bool Map::loadMap(std::string filename) {
 
     const int BUFSIZE = 2048;
     char linebuf[BUFSIZE];
-    char linkbuf[BUFSIZE];
 
     while (!feof(fp)) {
         if (fgets(linebuf, BUFSIZE - 1, fp) == NULL) break;
 
-        int id;
-        double tx, ty, tz, rx, ry, rz, var;
-        int numObs = 0;
-
-        linkbuf[0] = '\0';
-        int nElems = sscanf(linebuf, "%d %lf %lf %lf %lf %lf %lf %lf %d%[^\t\n]*s", &id, &tx, &ty,
-                            &tz, &rx, &ry, &rz, &var, &numObs, linkbuf);
-        if (nElems == 9 || nElems == 10) {
-            tf2::Vector3 tvec(tx, ty, tz);
-            tf2::Quaternion q;
-            q.setRPY(deg2rad(rx), deg2rad(ry), deg2rad(rz));
-
-            auto twv = TransformWithVariance(tvec, q, var);
-            // TODO: figure out what the timestamp in Fiducial should be
-            Fiducial f =
-                Fiducial(id, tf2::Stamped<TransformWithVariance>(twv, ros::Time::now(), mapFrame));
-            f.numObs = numObs;
-
-            std::istringstream ss(linkbuf);
-            std::string s;
-            while (getline(ss, s, ' ')) {
-                if (!s.empty()) {
-                    f.links.insert(stoi(s));
-                }
-            }
-            fiducials[id] = f;
+        Fiducial f;
+        if (parseFiducial(linebuf, f)) {
+            fiducials[f.id] = f;
+            indexFiducial(f);
             numRead++;
         } else {
             ROS_WARN("Invalid line: %s", linebuf);
@@ -621,16 +1689,22 @@ bool Map::loadMap(std::string filename) {
 
     fclose(fp);
     ROS_INFO("Load map %s read %d entries", filename.c_str(), numRead);
+    chooseOrigin();
     return true;
 }
 
 // Publish the map
 
 void Map::publishMap() {
+    if (!mapPub) {
+        return;
+    }
+
+    // Published from a snapshot, so mapMutex isn't needed
+    std::shared_ptr<const FiducialMap> snap = getSnapshot();
     fiducial_msgs::FiducialMapEntryArray fmea;
-    std::map<int, Fiducial>::iterator it;
 
-    for (const auto &map_pair : fiducials) {
+    for (const auto &map_pair : *snap) {
         const Fiducial &f = map_pair.second;
 
         fiducial_msgs::FiducialMapEntry fme;
@@ -653,18 +1727,98 @@ void Map::publishMap() {
     mapPub.publish(fmea);
 }
 
+// Load the tiles near the camera and those of observed fiducials, and write
+// out the least recently used ones when over budget. Called with mapMutex held
+
+void Map::updateTiles(const std::vector<Observation> &obs) {
+    std::set<MapTiles::TileKey> keep;
+    MapTiles::TileKey key;
+
+    for (const Observation &o : obs) {
+        if (tiles.lookup(o.fid, key)) {
+            keep.insert(key);
+        }
+    }
+
+    if (haveMapCam) {
+        std::vector<MapTiles::TileKey> near;
+        tiles.tilesNear(lastMapCam.getOrigin(), tileRadius, near);
+        keep.insert(near.begin(), near.end());
+    }
+
+    std::vector<int> loaded;
+    for (const MapTiles::TileKey &k : keep) {
+        tiles.load(k, fiducials, loaded);
+    }
+    tiles.assign(fiducials, loaded);
+
+    for (int id : loaded) {
+        indexFiducial(fiducials[id]);
+    }
+
+    std::vector<int> removed;
+    tiles.evict(keep, !readOnly, fiducials, removed);
+    for (int id : removed) {
+        fiducialIndex.remove(id);
+    }
+    if (!loaded.empty() || !removed.empty()) {
+        componentsDirty = true;
+    }
+    if (!removed.empty() && !readOnly) {
+        tiles.saveIndex();
+    }
+}
+
+// Keep the spatial index in step with a fiducial's pose. Called with mapMutex held
+
+void Map::indexFiducial(const Fiducial &f) {
+    fiducialIndex.update(f.id, f.pose.transform.getOrigin());
+}
+
+// Find the fiducials that could be seen from a camera pose. Called with mapMutex held
+
+void Map::predictVisible(const tf2::Transform &T_mapCam, std::vector<int> &ids) const {
+    fiducialIndex.queryFrustum(T_mapCam, cameraHfov, cameraVfov, visibilityRange, ids);
+}
+
 // Publish the next marker visualization messages that hasn't been
-// published recently
+// published recently. Fiducials in view of the camera are refreshed first,
+// the rest a few at a time so large maps don't flood the topic
 
 void Map::publishMarkers() {
+    static const int markersPerCycle = 50;
+    if (!markerPub) {
+        return;
+    }
     ros::Time now = ros::Time::now();
-    std::map<int, Fiducial>::iterator it;
 
-    for (auto &map_pair : fiducials) {
-        Fiducial &f = map_pair.second;
-        if ((now - f.lastPublished).toSec() > 1.0) {
-            publishMarker(f);
+    // Fiducials are looked at through a const reference so that only the
+    // chunks of those published are unshared from the snapshot
+    const FiducialMap &current = fiducials;
+
+    if (haveMapCam) {
+        nearbyFids.clear();
+        predictVisible(lastMapCam, nearbyFids);
+        for (int id : nearbyFids) {
+            auto it = current.find(id);
+            if (it != current.end() && (now - it->second.lastPublished).toSec() > 1.0) {
+                publishMarker(fiducials[id]);
+            }
+        }
+    }
+
+    auto cit = current.upper_bound(markerCursor);
+    int n = std::min(markersPerCycle, (int)fiducials.size());
+    for (int i = 0; i < n; i++) {
+        if (cit == current.end()) {
+            cit = current.begin();
+        }
+        int id = cit->first;
+        if ((now - cit->second.lastPublished).toSec() > 1.0) {
+            publishMarker(fiducials[id]);
         }
+        markerCursor = id;
+        cit = current.upper_bound(id);
     }
 }
 
@@ -760,8 +1914,10 @@ void Map::publishMarker(Fiducial &fid) {
     for (const auto linked_fid : fid.links) {
         // only draw links in one direction
         if (fid.id < linked_fid) {
-            if (fiducials.find(linked_fid) != fiducials.end()) {
-                tf2::Vector3 p1 = fiducials[linked_fid].pose.transform.getOrigin();
+            const FiducialMap &current = fiducials;
+            auto it = current.find(linked_fid);
+            if (it != current.end()) {
+                tf2::Vector3 p1 = it->second.pose.transform.getOrigin();
                 gp1.x = p1.x();
                 gp1.y = p1.y();
                 gp1.z = p1.z();
@@ -809,11 +1965,28 @@ void Map::drawLine(const tf2::Vector3 &p0, const tf2::Vector3 &p1) {
 bool Map::clearCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res) {
     ROS_INFO("Clearing fiducial map from service call");
 
+    return runCommand([this] {
+        clearMap();
+        return true;
+    });
+}
+
+// Empty the map, so that it is initialized again from the next frames.
+// Called with mapMutex held
+
+void Map::clearMap() {
     fiducials.clear();
+    fiducialIndex.clear();
+    tiles.clear();
+    initGraph.clear();
+    initObservations.clear();
+    visibleFids.clear();
+    poseGraph.clear();
     initialFrameNum = frameNum;
     originFid = -1;
-
-    return true;
+    componentsDirty = true;
+    discardOptimization();
+    newEpoch();
 }
 
 // Service to add a fiducial to the map
@@ -822,7 +1995,347 @@ bool Map::addFiducialCallback(fiducial_slam::AddFiducial::Request &req,
                               fiducial_slam::AddFiducial::Response &res)
 {
    ROS_INFO("Request to add fiducial %d to map", req.fiducial_id);
-   fiducialToAdd = req.fiducial_id;
+   int id = req.fiducial_id;
+
+   return runCommand([this, id] {
+       fiducialToAdd = id;
+       return true;
+   });
+}
+
+// Service to optimize the map with all the relative observations made so far
+
+bool Map::optimizeCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res) {
+    ROS_INFO("Optimizing fiducial map from service call");
+
+    return runCommand([this] {
+        optimizeRequested = true;
+        return true;
+    });
+}
+
+// Copy a timing histogram into its message
+
+static void fillTiming(const TimingHistogram &h, fiducial_slam::TimingHistogram &msg) {
+    msg.name = h.getName();
+    msg.count = h.count();
+    msg.total_seconds = h.totalSeconds();
+    msg.max_seconds = h.maxSeconds();
+    msg.bucket_bounds.resize(TimingHistogram::numBuckets);
+    msg.bucket_counts.resize(TimingHistogram::numBuckets);
+    for (int i = 0; i < TimingHistogram::numBuckets; i++) {
+        msg.bucket_bounds[i] = TimingHistogram::bucketBound(i);
+        msg.bucket_counts[i] = h.bucketCount(i);
+    }
+}
+
+// Service to report the health of the map and the time spent on it. Everything
+// is kept up to date as the map changes, so this doesn't wait for the map thread
+
+bool Map::statsCallback(fiducial_slam::GetMapStats::Request &req,
+                        fiducial_slam::GetMapStats::Response &res) {
+    std::shared_ptr<const MapSnapshot> snap = getVersionedSnapshot();
+    const MapSummary &s = snap->summary;
+    res.map_version = snap->version;
+    res.num_fiducials = s.numFiducials;
+    res.num_graph_links = s.numLinks;
+    res.num_components = s.numComponents;
+    res.largest_component = s.largestComponent;
+
+    // Variances change with every frame, so are summed here rather than for
+    // each snapshot
+    res.mean_variance = 0.0;
+    res.max_variance = 0.0;
+    for (const auto &map_pair : snap->fiducials) {
+        const Fiducial &f = map_pair.second;
+        res.mean_variance += f.pose.variance;
+        res.max_variance = std::max(res.max_variance, f.pose.variance);
+        if (req.include_fiducials) {
+            res.fiducial_ids.push_back(f.id);
+            res.num_observations.push_back(f.numObs);
+            res.variances.push_back(f.pose.variance);
+            res.num_links.push_back(f.links.size());
+        }
+    }
+    if (!snap->fiducials.empty()) {
+        res.mean_variance /= snap->fiducials.size();
+    }
+
+    res.frames = numFrames;
+    res.frames_with_pose = numPoseFrames;
+    res.dropped_frames = numDroppedFrames;
+    {
+        std::lock_guard<std::mutex> lock(updateMutex);
+        res.queued_frames = updateQueue.size();
+    }
+
+    const TimingHistogram *timings[] = {&updateTiming, &poseTiming, &applyTiming,
+                                        &snapshotTiming, &tfWaitTiming};
+    for (const TimingHistogram *h : timings) {
+        res.timings.emplace_back();
+        fillTiming(*h, res.timings.back());
+    }
+
+    return true;
+}
+
+// Move every fiducial in the map rigidly, so that the origin moves to T^-1.
+// Called with mapMutex held
+
+void Map::transformMap(const tf2::Transform &T) {
+    transformFiducials(fiducials, T);
+    movedFiducials();
+}
+
+// Bring everything that depends on the fiducial poses up to date after they
+// have been edited. Called with mapMutex held
+
+void Map::movedFiducials() {
+    // Every marker is out of date, so leave publishMarkers to refresh them a
+    // few at a time rather than flooding the topic with the whole map
+    for (auto &map_pair : fiducials) {
+        indexFiducial(map_pair.second);
+        map_pair.second.lastPublished = ros::Time(0);
+    }
+
+    discardOptimization();
+    newEpoch();
+}
+
+// Start a new epoch of the map. The frame thread owns the robot's pose and
+// drops it when it sees the new epoch, and nothing from the old epoch is
+// published once this returns. Called with mapMutex held
+
+void Map::newEpoch() {
+    // Frames waiting to be smoothed are in the old map too
+    window.clear();
+    haveMapCam = false;
+
+    std::lock_guard<std::mutex> lock(poseMutex);
+    mapEpoch++;
+}
+
+// Make sure the origin is a fiducial in the map, picking the most certain
+// one when the map was loaded or imported rather than initialized, or the
+// origin was removed. Called with mapMutex held
+
+void Map::chooseOrigin() {
+    const FiducialMap &current = fiducials;
+    if (originFid >= 0 && current.count(originFid)) {
+        return;
+    }
+
+    originFid = -1;
+    double best = std::numeric_limits<double>::infinity();
+    for (const auto &map_pair : current) {
+        if (map_pair.second.pose.variance < best) {
+            best = map_pair.second.pose.variance;
+            originFid = map_pair.first;
+        }
+    }
+    if (originFid >= 0) {
+        ROS_INFO("Using fiducial %d as the origin", originFid);
+    }
+}
+
+// Take a fiducial out of the map, along with every link to it. Called with
+// mapMutex held. Returns false if it isn't in the map
+
+bool Map::removeFiducial(int id) {
+    MapTiles::TileKey key;
+    if (tiles.enabled() && tiles.lookup(id, key)) {
+        std::vector<int> loaded;
+        tiles.load(key, fiducials, loaded);
+        for (int l : loaded) {
+            indexFiducial(fiducials[l]);
+        }
+    }
+
+    if (fiducials.erase(id) == 0) {
+        return false;
+    }
+    fiducialIndex.remove(id);
+    deleteMarkers(id);
+
+    for (auto &map_pair : fiducials) {
+        Fiducial &f = map_pair.second;
+        if (f.links.erase(id) && markerPub) {
+            publishMarker(f);
+        }
+    }
+
+    poseGraph.removeNode(id);
+    initGraph.removeNode(id);
+    initObservations.erase(id);
+    if (tiles.enabled()) {
+        tiles.remove(id, !readOnly, fiducials);
+    }
+    if (originFid == id) {
+        chooseOrigin();
+    }
+    componentsDirty = true;
+    discardOptimization();
+    return true;
+}
+
+// Remove the markers of a fiducial that is no longer in the map
+
+void Map::deleteMarkers(int id) {
+    if (!markerPub) {
+        return;
+    }
+
+    visualization_msgs::Marker marker;
+    marker.header.frame_id = mapFrame;
+    marker.action = visualization_msgs::Marker::DELETE;
+
+    const std::pair<const char *, int> markers[] = {
+        {"fiducial", id}, {"sigma", id + 10000}, {"text", id + 30000}, {"links", id + 40000}};
+    for (const auto &m : markers) {
+        marker.ns = m.first;
+        marker.id = m.second;
+        markerPub.publish(marker);
+    }
+}
+
+// Service to move the origin of the map
+
+bool Map::moveOriginCallback(fiducial_slam::MoveOrigin::Request &req,
+                             fiducial_slam::MoveOrigin::Response &res) {
+    if (tiles.enabled()) {
+        ROS_WARN("Moving the origin of a tiled map is not supported");
+        return false;
+    }
+
+    tf2::Quaternion q;
+    q.setRPY(req.roll, req.pitch, req.yaw);
+    tf2::Transform T(q, tf2::Vector3(req.x, req.y, req.z));
+    ROS_INFO("Moving map origin by %lf %lf %lf", req.x, req.y, req.z);
+
+    return runCommand([this, T] {
+        transformMap(T);
+        return true;
+    });
+}
+
+// Service to fit a plane to the map, and optionally flatten and level it
+
+bool Map::fitPlaneCallback(fiducial_slam::FitPlane::Request &req,
+                           fiducial_slam::FitPlane::Response &res) {
+    if ((req.project || req.level) && tiles.enabled()) {
+        ROS_WARN("Adjusting a tiled map to a plane is not supported");
+        return false;
+    }
+
+    return runCommand([this, &req, &res] {
+        PlaneFit fit;
+        if (!fitPlane(fiducials, fit)) {
+            ROS_WARN("Need at least 3 fiducials, not in a line, to fit a plane");
+            return false;
+        }
+
+        res.num_fiducials = fit.numFiducials;
+        res.rms_error = fit.rmsError;
+        res.max_error = fit.maxError;
+        res.slope_x = std::atan2(fit.normal.x(), fit.normal.z());
+        res.slope_y = std::atan2(fit.normal.y(), fit.normal.z());
+        ROS_INFO("Plane fit to %d fiducials, error %lf, slope %lf %lf", fit.numFiducials,
+                 fit.rmsError, res.slope_x, res.slope_y);
+
+        if (req.project) {
+            projectOntoPlane(fiducials, fit);
+        }
+        if (req.level) {
+            transformFiducials(fiducials, levelingTransform(fit));
+        }
+        if (req.project || req.level) {
+            movedFiducials();
+        }
+        return true;
+    });
+}
+
+// Service to remove a fiducial from the map
+
+bool Map::removeFiducialCallback(fiducial_slam::RemoveFiducial::Request &req,
+                                 fiducial_slam::RemoveFiducial::Response &res) {
+    ROS_INFO("Request to remove fiducial %d from map", req.fiducial_id);
+    int id = req.fiducial_id;
+
+    return runCommand([this, id] {
+        if (!removeFiducial(id)) {
+            ROS_WARN("Fiducial %d is not in the map", id);
+            return false;
+        }
+        return true;
+    });
+}
+
+// Service to add many fiducials to the map at once, such as from a survey
+
+bool Map::importMapCallback(fiducial_slam::ImportMap::Request &req,
+                            fiducial_slam::ImportMap::Response &res) {
+    ROS_INFO("Importing %d fiducials", (int)req.fiducials.fiducials.size());
+
+    return runCommand([this, &req, &res] {
+        if (req.clear) {
+            clearMap();
+        }
+
+        res.num_added = 0;
+        res.num_replaced = 0;
+        for (const fiducial_msgs::FiducialMapEntry &e : req.fiducials.fiducials) {
+            tf2::Quaternion q;
+            q.setRPY(e.rx, e.ry, e.rz);
+            TransformWithVariance pose(tf2::Transform(q, tf2::Vector3(e.x, e.y, e.z)),
+                                       req.variance);
+
+            auto it = fiducials.find(e.fiducial_id);
+            if (it != fiducials.end()) {
+                it->second.pose = pose;
+                res.num_replaced++;
+            } else {
+                fiducials[e.fiducial_id] = Fiducial(e.fiducial_id, pose);
+                res.num_added++;
+            }
 
-   return true;
+            Fiducial &f = fiducials[e.fiducial_id];
+            indexFiducial(f);
+            if (markerPub) {
+                publishMarker(f);
+            }
+        }
+
+        // The imported fiducials are the map now, rather than whatever was
+        // being gathered to initialize it
+        if (!fiducials.empty() && isInitializingMap) {
+            isInitializingMap = false;
+            initGraph.clear();
+            initObservations.clear();
+        }
+        chooseOrigin();
+        discardOptimization();
+
+        // Only the imported markers were republished, but replacing a pose
+        // moves the map under the robot
+        if (res.num_replaced > 0) {
+            newEpoch();
+        }
+        return true;
+    });
+}
+
+// Service to write the trace of recent frames to trace_file
+
+bool Map::dumpTraceCallback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res) {
+    if (!trace.enabled()) {
+        ROS_WARN("Tracing is off, set trace_buffer_size to trace frames");
+        return false;
+    }
+    if (!trace.dump(traceFile, "fiducial_slam")) {
+        ROS_ERROR("Cannot write trace to %s", traceFile.c_str());
+        return false;
+    }
+    ROS_INFO("Wrote trace of %d frame stages to %s", (int)trace.size(), traceFile.c_str());
+    return true;
 }
@@ -0,0 +1,98 @@
+#include <fiducial_slam/map_edit.h>
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+
+void transformFiducials(FiducialMap &fiducials, const tf2::Transform &T) {
+    for (auto &map_pair : fiducials) {
+        Fiducial &f = map_pair.second;
+        f.pose.transform = T * f.pose.transform;
+    }
+}
+
+bool fitPlane(const FiducialMap &fiducials, PlaneFit &fit) {
+    fit.numFiducials = fiducials.size();
+    if (fit.numFiducials < 3) {
+        return false;
+    }
+
+    Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+    for (const auto &map_pair : fiducials) {
+        const tf2::Vector3 &p = map_pair.second.pose.transform.getOrigin();
+        mean += Eigen::Vector3d(p.x(), p.y(), p.z());
+    }
+    mean /= fit.numFiducials;
+
+    Eigen::Matrix3d scatter = Eigen::Matrix3d::Zero();
+    for (const auto &map_pair : fiducials) {
+        const tf2::Vector3 &p = map_pair.second.pose.transform.getOrigin();
+        Eigen::Vector3d d = Eigen::Vector3d(p.x(), p.y(), p.z()) - mean;
+        scatter += d * d.transpose();
+    }
+
+    // The normal is the direction of least spread. With two directions of
+    // little spread the points are in a line, and any plane through it fits
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(scatter);
+    Eigen::Vector3d spread = solver.eigenvalues();
+    if (spread(1) < 1e-9 * std::max(spread(2), 1e-12)) {
+        return false;
+    }
+
+    Eigen::Vector3d n = solver.eigenvectors().col(0);
+    if (n.z() < 0) {
+        n = -n;
+    }
+    fit.centroid = tf2::Vector3(mean.x(), mean.y(), mean.z());
+    fit.normal = tf2::Vector3(n.x(), n.y(), n.z());
+
+    double sum = 0.0;
+    fit.maxError = 0.0;
+    for (const auto &map_pair : fiducials) {
+        double d = std::fabs(
+            (map_pair.second.pose.transform.getOrigin() - fit.centroid).dot(fit.normal));
+        sum += d * d;
+        fit.maxError = std::max(fit.maxError, d);
+    }
+    fit.rmsError = std::sqrt(sum / fit.numFiducials);
+    return true;
+}
+
+void projectOntoPlane(FiducialMap &fiducials, const PlaneFit &fit) {
+    for (auto &map_pair : fiducials) {
+        tf2::Transform &T = map_pair.second.pose.transform;
+
+        tf2::Vector3 p = T.getOrigin();
+        T.setOrigin(p - fit.normal * (p - fit.centroid).dot(fit.normal));
+
+        tf2::Vector3 z = T.getBasis().getColumn(2);
+        tf2::Vector3 target = z.dot(fit.normal) >= 0 ? fit.normal : -fit.normal;
+        T.setRotation(rotationBetween(z, target) * T.getRotation());
+    }
+}
+
+tf2::Transform levelingTransform(const PlaneFit &fit) {
+    tf2::Transform rotate(rotationBetween(fit.normal, tf2::Vector3(0, 0, 1)));
+    tf2::Transform toCentroid(tf2::Quaternion::getIdentity(), fit.centroid);
+    return toCentroid * rotate * toCentroid.inverse();
+}
+
+tf2::Quaternion rotationBetween(const tf2::Vector3 &from, const tf2::Vector3 &to) {
+    tf2::Vector3 a = from.normalized();
+    tf2::Vector3 b = to.normalized();
+    double d = a.dot(b);
+
+    if (d < -1.0 + 1e-12) {
+        // Opposite, so turn half way around any axis at right angles
+        tf2::Vector3 axis = tf2::Vector3(1, 0, 0).cross(a);
+        if (axis.length2() < 1e-12) {
+            axis = tf2::Vector3(0, 1, 0).cross(a);
+        }
+        return tf2::Quaternion(axis.normalized(), M_PI);
+    }
+
+    tf2::Vector3 c = a.cross(b);
+    tf2::Quaternion q(c.x(), c.y(), c.z(), 1.0 + d);
+    return q.normalized();
+}
@@ -0,0 +1,67 @@
+#include <fiducial_slam/map_params.h>
+
+#include <algorithm>
+#include <sstream>
+
+bool MapParams::set(const std::string &assignment) {
+    size_t eq = assignment.find('=');
+    if (eq == std::string::npos) {
+        return false;
+    }
+    set(assignment.substr(0, eq), assignment.substr(eq + 1));
+    return true;
+}
+
+bool MapParams::parse(const std::string &s, std::string &value) {
+    value = s;
+    return true;
+}
+
+bool MapParams::parse(const std::string &s, bool &value) {
+    if (s == "true" || s == "True" || s == "1") {
+        value = true;
+    } else if (s == "false" || s == "False" || s == "0") {
+        value = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Numbers must take up the whole string
+
+template <class T>
+static bool parseNumber(const std::string &s, T &value) {
+    std::istringstream in(s);
+    T v;
+    if (!(in >> v) || !(in >> std::ws).eof()) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+bool MapParams::parse(const std::string &s, int &value) { return parseNumber(s, value); }
+
+bool MapParams::parse(const std::string &s, float &value) { return parseNumber(s, value); }
+
+bool MapParams::parse(const std::string &s, double &value) { return parseNumber(s, value); }
+
+bool MapParams::parse(const std::string &s, std::vector<double> &value) {
+    std::string list = s;
+    std::replace(list.begin(), list.end(), ',', ' ');
+    std::replace(list.begin(), list.end(), '[', ' ');
+    std::replace(list.begin(), list.end(), ']', ' ');
+
+    std::istringstream in(list);
+    std::vector<double> v;
+    double d;
+    while (in >> d) {
+        v.push_back(d);
+    }
+    if (!(in >> std::ws).eof()) {
+        return false;
+    }
+    value = v;
+    return true;
+}
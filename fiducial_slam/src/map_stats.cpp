@@ -0,0 +1,121 @@
+#include <fiducial_slam/map_stats.h>
+
+#include <algorithm>
+#include <cmath>
+
+static const double firstBucketBound = 10e-6;
+
+const int TimingHistogram::numBuckets;
+
+TimingHistogram::TimingHistogram(const std::string &name) : name(name) { reset(); }
+
+void TimingHistogram::reset() {
+    numRecorded = 0;
+    totalNs = 0;
+    maxNs = 0;
+    for (int i = 0; i < numBuckets; i++) {
+        buckets[i] = 0;
+    }
+}
+
+double TimingHistogram::bucketBound(int i) {
+    if (i >= numBuckets - 1) {
+        return INFINITY;
+    }
+    return std::ldexp(firstBucketBound, i);
+}
+
+void TimingHistogram::record(double seconds) {
+    if (!(seconds >= 0.0)) {
+        seconds = 0.0;
+    }
+
+    int bucket = 0;
+    if (seconds > firstBucketBound) {
+        bucket = std::min(numBuckets - 1, (int)std::ceil(std::log2(seconds / firstBucketBound)));
+    }
+    buckets[bucket]++;
+
+    uint64_t ns = (uint64_t)(seconds * 1e9);
+    totalNs += ns;
+    uint64_t prevMax = maxNs.load();
+    while (ns > prevMax && !maxNs.compare_exchange_weak(prevMax, ns)) {
+    }
+    numRecorded++;
+}
+
+double TimingHistogram::totalSeconds() const { return totalNs.load() * 1e-9; }
+
+double TimingHistogram::maxSeconds() const { return maxNs.load() * 1e-9; }
+
+LinkComponents::LinkComponents() : components(0), largest(0) {}
+
+void LinkComponents::clear() {
+    parent.clear();
+    sizes.clear();
+    links.clear();
+    components = 0;
+    largest = 0;
+}
+
+void LinkComponents::rebuild(const FiducialMap &fiducials) {
+    clear();
+    for (const auto &map_pair : fiducials) {
+        add(map_pair.first);
+    }
+    // Only links between fiducials that are both in the map count
+    for (const auto &map_pair : fiducials) {
+        for (int other : map_pair.second.links) {
+            if (fiducials.count(other) > 0) {
+                link(map_pair.first, other);
+            }
+        }
+    }
+}
+
+void LinkComponents::add(int id) {
+    if (parent.emplace(id, id).second) {
+        sizes[id] = 1;
+        components++;
+        largest = std::max(largest, 1);
+    }
+}
+
+// Root of the component containing id, halving the path on the way
+int LinkComponents::find(int id) {
+    int p = parent[id];
+    while (p != id) {
+        int grandparent = parent[p];
+        parent[id] = grandparent;
+        id = p;
+        p = grandparent;
+    }
+    return id;
+}
+
+bool LinkComponents::link(int a, int b) {
+    if (a == b) {
+        return false;
+    }
+    uint64_t key = ((uint64_t)(uint32_t)std::min(a, b) << 32) | (uint32_t)std::max(a, b);
+    if (!links.insert(key).second) {
+        return false;
+    }
+
+    add(a);
+    add(b);
+    int rootA = find(a);
+    int rootB = find(b);
+    if (rootA != rootB) {
+        // Attach the smaller component under the larger
+        if (sizes[rootA] < sizes[rootB]) {
+            std::swap(rootA, rootB);
+        }
+        parent[rootB] = rootA;
+        sizes[rootA] += sizes[rootB];
+        sizes.erase(rootB);
+        components--;
+        largest = std::max(largest, sizes[rootA]);
+    }
+    return true;
+}
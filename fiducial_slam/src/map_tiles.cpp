@@ -0,0 +1,243 @@
+#include <fiducial_slam/map_tiles.h>
+
+#include <ros/ros.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+MapTiles::MapTiles() : tileSize(0.0), maxFiducials(0), numAssigned(0) {}
+
+void MapTiles::configure(const std::string &dir, double tileSize, int maxFiducials) {
+    this->dir = dir;
+    this->tileSize = tileSize;
+    this->maxFiducials = maxFiducials;
+    clear();
+}
+
+void MapTiles::clear() {
+    tileOfId.clear();
+    members.clear();
+    lru.clear();
+    resident.clear();
+    numAssigned = 0;
+}
+
+MapTiles::TileKey MapTiles::tileOf(const tf2::Vector3 &p) const {
+    return TileKey((int)std::floor(p.x() / tileSize), (int)std::floor(p.y() / tileSize));
+}
+
+void MapTiles::tilesNear(const tf2::Vector3 &p, double radius, std::vector<TileKey> &keys) const {
+    TileKey lo = tileOf(p - tf2::Vector3(radius, radius, 0));
+    TileKey hi = tileOf(p + tf2::Vector3(radius, radius, 0));
+
+    for (int x = lo.first; x <= hi.first; x++) {
+        for (int y = lo.second; y <= hi.second; y++) {
+            TileKey key(x, y);
+            if (members.count(key)) {
+                keys.push_back(key);
+            }
+        }
+    }
+}
+
+bool MapTiles::lookup(int id, TileKey &key) const {
+    auto it = tileOfId.find(id);
+    if (it == tileOfId.end()) {
+        return false;
+    }
+    key = it->second;
+    return true;
+}
+
+std::string MapTiles::indexFilename() const { return dir + "/tiles.txt"; }
+
+std::string MapTiles::tileFilename(const TileKey &key) const {
+    return dir + "/tile_" + std::to_string(key.first) + "_" + std::to_string(key.second) + ".txt";
+}
+
+void MapTiles::addMember(int id, const TileKey &key) {
+    tileOfId[id] = key;
+    members[key].push_back(id);
+}
+
+void MapTiles::makeResident(const TileKey &key) {
+    lru.push_front(key);
+    resident[key] = lru.begin();
+}
+
+void MapTiles::touch(const TileKey &key) {
+    auto it = resident.find(key);
+    if (it != resident.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+    }
+}
+
+// The index has a line for each fiducial giving the tile it is in
+
+bool MapTiles::loadIndex() {
+    FILE *fp = fopen(indexFilename().c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+
+    clear();
+
+    int id, x, y;
+    while (fscanf(fp, "%d %d %d", &id, &x, &y) == 3) {
+        addMember(id, TileKey(x, y));
+    }
+    fclose(fp);
+
+    ROS_INFO("Map index has %d fiducials in %d tiles", (int)tileOfId.size(), (int)members.size());
+    return true;
+}
+
+bool MapTiles::saveIndex() const {
+    FILE *fp = fopen(indexFilename().c_str(), "w");
+    if (fp == NULL) {
+        ROS_WARN("Could not open %s for write\n", indexFilename().c_str());
+        return false;
+    }
+
+    for (const auto &id_pair : tileOfId) {
+        fprintf(fp, "%d %d %d\n", id_pair.first, id_pair.second.first, id_pair.second.second);
+    }
+    fclose(fp);
+    return true;
+}
+
+bool MapTiles::load(const TileKey &key, FiducialMap &fiducials, std::vector<int> &loaded) {
+    if (isResident(key)) {
+        touch(key);
+        return true;
+    }
+
+    std::string filename = tileFilename(key);
+    FILE *fp = fopen(filename.c_str(), "r");
+    if (fp == NULL) {
+        ROS_WARN("Could not open %s for read\n", filename.c_str());
+        return false;
+    }
+
+    const int BUFSIZE = 2048;
+    char linebuf[BUFSIZE];
+    int numRead = 0;
+
+    while (fgets(linebuf, BUFSIZE - 1, fp) != NULL) {
+        Fiducial f;
+        if (parseFiducial(linebuf, f)) {
+            if (fiducials.count(f.id) == 0 && tileOfId.count(f.id) != 0) {
+                numAssigned++;
+            }
+            fiducials[f.id] = f;
+            loaded.push_back(f.id);
+            numRead++;
+        }
+    }
+    fclose(fp);
+
+    makeResident(key);
+    ROS_INFO("Loaded map tile %d %d with %d fiducials", key.first, key.second, numRead);
+    return true;
+}
+
+void MapTiles::assign(FiducialMap &fiducials, std::vector<int> &loaded) {
+    if ((int)fiducials.size() <= numAssigned) {
+        return;
+    }
+
+    std::vector<int> unassigned;
+    const FiducialMap &resident = fiducials;
+    for (const auto &map_pair : resident) {
+        if (tileOfId.count(map_pair.first) == 0) {
+            unassigned.push_back(map_pair.first);
+        }
+    }
+
+    for (int id : unassigned) {
+        TileKey key = tileOf(fiducials[id].pose.transform.getOrigin());
+        // Don't lose what is already saved for the tile
+        if (!isResident(key)) {
+            if (members.count(key) == 0 || !load(key, fiducials, loaded)) {
+                makeResident(key);
+            }
+        }
+        addMember(id, key);
+        numAssigned++;
+    }
+}
+
+bool MapTiles::remove(int id, bool write, const FiducialMap &fiducials) {
+    auto it = tileOfId.find(id);
+    if (it == tileOfId.end()) {
+        return false;
+    }
+    TileKey key = it->second;
+    tileOfId.erase(it);
+    numAssigned--;
+
+    std::vector<int> &ids = members[key];
+    ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+    if (!write) {
+        return true;
+    }
+    return saveTile(key, fiducials) && saveIndex();
+}
+
+bool MapTiles::saveTile(const TileKey &key, const FiducialMap &fiducials) const {
+    std::string filename = tileFilename(key);
+    FILE *fp = fopen(filename.c_str(), "w");
+    if (fp == NULL) {
+        ROS_WARN("Could not open %s for write\n", filename.c_str());
+        return false;
+    }
+
+    auto mit = members.find(key);
+    if (mit != members.end()) {
+        for (int id : mit->second) {
+            auto it = fiducials.find(id);
+            if (it != fiducials.end()) {
+                writeFiducial(fp, it->second);
+            }
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+bool MapTiles::save(const FiducialMap &fiducials) const {
+    bool ok = true;
+    for (const TileKey &key : lru) {
+        ok = saveTile(key, fiducials) && ok;
+    }
+    return saveIndex() && ok;
+}
+
+void MapTiles::evict(const std::set<TileKey> &keep, bool write, FiducialMap &fiducials,
+                     std::vector<int> &removed) {
+    auto it = lru.end();
+    while ((int)fiducials.size() > maxFiducials && it != lru.begin()) {
+        --it;
+        TileKey key = *it;
+        if (keep.count(key)) {
+            continue;
+        }
+
+        if (write) {
+            saveTile(key, fiducials);
+        }
+        std::vector<int> evicted;
+        for (int id : members[key]) {
+            if (fiducials.count(id)) {
+                evicted.push_back(id);
+            }
+        }
+        numAssigned -= fiducials.erase(evicted);
+        removed.insert(removed.end(), evicted.begin(), evicted.end());
+
+        ROS_INFO("Evicted map tile %d %d", key.first, key.second);
+        resident.erase(key);
+        it = lru.erase(it);
+    }
+}
@@ -0,0 +1,97 @@
+#include <fiducial_slam/observation.h>
+
+#include <algorithm>
+#include <utility>
+
+std::mutex FrameIds::mutex;
+std::unordered_map<std::string, int> FrameIds::ids;
+std::deque<std::string> FrameIds::names;
+
+int FrameIds::intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    int id = names.size();
+    names.push_back(name);
+    ids[name] = id;
+    return id;
+}
+
+const std::string &FrameIds::name(int id) {
+    static const std::string empty;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (id < 0 || id >= (int)names.size()) {
+        return empty;
+    }
+    return names[id];
+}
+
+Observation::Observation(int fid, const TransformWithVariance &camFid, const ros::Time &stamp,
+                         int frame)
+    : fid(fid), T_camFid(camFid), stamp(stamp), frame(frame), haveFidCam(false) {
+    tf2::Vector3 p = camFid.transform.getOrigin();
+    offAxis2 = (p.x() * p.x() + p.y() * p.y()) / (p.z() * p.z());
+}
+
+const tf2::Transform &Observation::T_fidCam() const {
+    if (!haveFidCam) {
+        fidCam = T_camFid.transform.inverse();
+        haveFidCam = true;
+    }
+    return fidCam;
+}
+
+void Observation::reframe(const tf2::Transform &T_newOld, int frame, const ros::Time &stamp) {
+    T_camFid.transform = T_newOld * T_camFid.transform;
+    this->frame = frame;
+    this->stamp = stamp;
+    haveFidCam = false;
+}
+
+MapUpdateQueue::MapUpdateQueue(int capacity) : head(0), count(0) { setCapacity(capacity); }
+
+void MapUpdateQueue::setCapacity(int capacity) {
+    slots.clear();
+    slots.resize(std::max(capacity, 1));
+    head = 0;
+    count = 0;
+}
+
+bool MapUpdateQueue::push(std::vector<Observation> &obs, const ros::Time &time,
+                          const tf2::Stamped<TransformWithVariance> &T_mapCam, int numEsts,
+                          int epoch) {
+    bool dropped = false;
+    if (count == (int)slots.size()) {
+        head = (head + 1) % slots.size();
+        count--;
+        dropped = true;
+    }
+
+    MapUpdate &u = slots[(head + count) % slots.size()];
+    u.obs.clear();
+    std::swap(u.obs, obs);
+    u.time = time;
+    u.T_mapCam.transform = T_mapCam.transform;
+    u.T_mapCam.variance = T_mapCam.variance;
+    u.T_mapCam.stamp_ = T_mapCam.stamp_;
+    u.T_mapCam.frame_id_.assign(T_mapCam.frame_id_);
+    u.numEsts = numEsts;
+    u.epoch = epoch;
+    count++;
+    return !dropped;
+}
+
+int MapUpdateQueue::popAll(std::vector<MapUpdate> &batch) {
+    int n = count;
+    if ((int)batch.size() < n) {
+        batch.resize(n);
+    }
+    for (int i = 0; i < n; i++) {
+        std::swap(batch[i], slots[(head + i) % slots.size()]);
+    }
+    head = 0;
+    count = 0;
+    return n;
+}
@@ -0,0 +1,351 @@
+#include <fiducial_slam/pose_graph.h>
+
+#include <Eigen/Cholesky>
+#include <Eigen/Sparse>
+#include <Eigen/SparseCholesky>
+
+#include <deque>
+#include <vector>
+
+typedef Eigen::Matrix<double, 6, 6> Matrix6;
+typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
+// Regularization so that zero covariances give a finite information matrix
+static const double informationEpsilon = 1e-9;
+
+static Matrix6 information(const Covariance6& cov) {
+    Matrix6 S = cov;
+    S.diagonal().array() += informationEpsilon;
+    return S.ldlt().solve(Matrix6::Identity());
+}
+
+void PoseGraph::addNode(int id, const TransformWithCovariance& prior) {
+    Node n;
+    n.pose = prior.transform;
+    n.prior = prior;
+    n.fixed = prior.covariance.isZero();
+    nodes[id] = n;
+}
+
+void PoseGraph::addEdge(int from, int to, const TransformWithCovariance& T_fromTo) {
+    if (from == to) {
+        return;
+    }
+
+    // Store edges in one direction only, so a pair has a single edge
+    TransformWithCovariance T = T_fromTo;
+    if (from > to) {
+        std::swap(from, to);
+        T = T_fromTo.inverse();
+    }
+
+    auto key = std::make_pair(from, to);
+    auto it = edges.find(key);
+    if (it == edges.end()) {
+        Edge e;
+        e.from = from;
+        e.to = to;
+        e.T_fromTo = T;
+        e.numObs = 1;
+        edges[key] = e;
+    } else {
+        // Observations of a pair come frame after frame with much the same
+        // error, so they aren't independent. The pose is their weighted mean,
+        // but the covariance is their average rather than the fused one, which
+        // would shrink with every frame until the edge was rigid
+        Edge& e = it->second;
+        Covariance6 cov = e.T_fromTo.covariance;
+        e.numObs++;
+        e.T_fromTo.update(T);
+        e.T_fromTo.covariance = cov + (T.covariance - cov) / e.numObs;
+    }
+}
+
+void PoseGraph::clear() {
+    nodes.clear();
+    edges.clear();
+}
+
+void PoseGraph::removeNode(int id) {
+    nodes.erase(id);
+    for (auto it = edges.begin(); it != edges.end();) {
+        if (it->first.first == id || it->first.second == id) {
+            it = edges.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Residual of an edge, being the difference between the observed and current
+// pose of the 'to' node, along with its information matrix
+static Vector6d edgeResidual(const PoseGraph::Edge& e, const tf2::Transform& from,
+                             const tf2::Transform& to, Matrix6& info) {
+    // Rotate the edge covariance into the map frame
+    TransformWithCovariance predicted = from * e.T_fromTo;
+    info = information(predicted.covariance);
+    return transformDelta(predicted.transform, to);
+}
+
+double PoseGraph::error() const {
+    double err = 0.0;
+    Matrix6 info;
+
+    for (const auto& edge_pair : edges) {
+        const Edge& e = edge_pair.second;
+        auto from = nodes.find(e.from);
+        auto to = nodes.find(e.to);
+        if (from == nodes.end() || to == nodes.end()) {
+            continue;
+        }
+        Vector6d r = edgeResidual(e, from->second.pose, to->second.pose, info);
+        err += r.dot(info * r);
+    }
+
+    for (const auto& node_pair : nodes) {
+        const Node& n = node_pair.second;
+        if (n.fixed) {
+            continue;
+        }
+        Vector6d r = transformDelta(n.prior.transform, n.pose);
+        err += r.dot(information(n.prior.covariance) * r);
+    }
+
+    return err;
+}
+
+double PoseGraph::edgeError(const Edge& e) const {
+    auto from = nodes.find(e.from);
+    auto to = nodes.find(e.to);
+    if (from == nodes.end() || to == nodes.end()) {
+        return 0.0;
+    }
+
+    Matrix6 info;
+    Vector6d r = edgeResidual(e, from->second.pose, to->second.pose, info);
+    return r.dot(info * r);
+}
+
+void PoseGraph::chainPoses(int root, const TransformWithCovariance& rootPose,
+                           std::map<int, TransformWithCovariance>& poses) const {
+    std::map<int, std::vector<const Edge*>> adjacent;
+    for (const auto& edge_pair : edges) {
+        adjacent[edge_pair.second.from].push_back(&edge_pair.second);
+        adjacent[edge_pair.second.to].push_back(&edge_pair.second);
+    }
+
+    // Breadth first, so each pose comes from the shortest chain
+    poses.clear();
+    poses[root] = rootPose;
+    std::deque<int> queue(1, root);
+
+    while (!queue.empty()) {
+        int id = queue.front();
+        queue.pop_front();
+
+        for (const Edge* e : adjacent[id]) {
+            int other = (e->from == id) ? e->to : e->from;
+            if (poses.count(other)) {
+                continue;
+            }
+            const TransformWithCovariance& T = poses[id];
+            poses[other] = (e->from == id) ? T * e->T_fromTo : T * e->T_fromTo.inverse();
+            queue.push_back(other);
+        }
+    }
+}
+
+// Add a 6x6 block to the list of sparse matrix entries
+static void addBlock(std::vector<Eigen::Triplet<double>>& triplets, int row, int col,
+                     const Matrix6& block) {
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 6; j++) {
+            triplets.push_back(Eigen::Triplet<double>(row * 6 + i, col * 6 + j, block(i, j)));
+        }
+    }
+}
+
+double PoseGraph::optimize(int maxIterations) {
+    // Assign a block of variables to each node that is free to move
+    std::map<int, int> index;
+    for (const auto& node_pair : nodes) {
+        if (!node_pair.second.fixed) {
+            int idx = index.size();
+            index[node_pair.first] = idx;
+        }
+    }
+
+    double err = error();
+    if (index.empty()) {
+        return err;
+    }
+
+    const int n = index.size() * 6;
+    std::vector<Eigen::Triplet<double>> triplets;
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
+    bool analyzed = false;
+    double lambda = 1e-4;
+
+    for (int iter = 0; iter < maxIterations; iter++) {
+        triplets.clear();
+        Eigen::VectorXd b = Eigen::VectorXd::Zero(n);
+        Matrix6 info;
+
+        // Linearize each edge r = delta(T_from * Z, T_to) where
+        // dr/dto = I and dr/dfrom = -J(T_from, Z)
+        for (const auto& edge_pair : edges) {
+            const Edge& e = edge_pair.second;
+            auto from = nodes.find(e.from);
+            auto to = nodes.find(e.to);
+            if (from == nodes.end() || to == nodes.end()) {
+                continue;
+            }
+
+            Vector6d r = edgeResidual(e, from->second.pose, to->second.pose, info);
+            Matrix6 Jf = -compositionJacobian(from->second.pose, e.T_fromTo.transform);
+
+            auto fi = index.find(e.from);
+            auto ti = index.find(e.to);
+            if (fi != index.end()) {
+                addBlock(triplets, fi->second, fi->second, Jf.transpose() * info * Jf);
+                b.segment<6>(fi->second * 6) += Jf.transpose() * info * r;
+            }
+            if (ti != index.end()) {
+                addBlock(triplets, ti->second, ti->second, info);
+                b.segment<6>(ti->second * 6) += info * r;
+            }
+            if (fi != index.end() && ti != index.end()) {
+                Matrix6 Hft = Jf.transpose() * info;
+                addBlock(triplets, fi->second, ti->second, Hft);
+                addBlock(triplets, ti->second, fi->second, Hft.transpose());
+            }
+        }
+
+        // Priors keep every free node constrained
+        for (const auto& idx_pair : index) {
+            const Node& node = nodes[idx_pair.first];
+            Matrix6 pinfo = information(node.prior.covariance);
+            Vector6d r = transformDelta(node.prior.transform, node.pose);
+            addBlock(triplets, idx_pair.second, idx_pair.second, pinfo);
+            b.segment<6>(idx_pair.second * 6) += pinfo * r;
+        }
+
+        Eigen::SparseMatrix<double> H(n, n);
+        H.setFromTriplets(triplets.begin(), triplets.end());
+        Eigen::VectorXd diagonal = H.diagonal();
+
+        if (!analyzed) {
+            solver.analyzePattern(H);
+            analyzed = true;
+        }
+
+        // Increase damping until a step reduces the error
+        bool improved = false;
+        std::map<int, Node> saved = nodes;
+        for (int attempt = 0; attempt < 10 && !improved; attempt++) {
+            Eigen::SparseMatrix<double> Hd = H;
+            for (int i = 0; i < n; i++) {
+                Hd.coeffRef(i, i) += lambda * diagonal(i);
+            }
+
+            solver.factorize(Hd);
+            if (solver.info() != Eigen::Success) {
+                lambda *= 10.0;
+                continue;
+            }
+            Eigen::VectorXd dx = -solver.solve(b);
+
+            for (const auto& idx_pair : index) {
+                Node& node = nodes[idx_pair.first];
+                Vector6 step = dx.segment<6>(idx_pair.second * 6);
+                node.pose = applyTransformDelta(saved[idx_pair.first].pose, step);
+            }
+
+            double newErr = error();
+            if (newErr < err) {
+                improved = true;
+                lambda = std::max(lambda / 10.0, 1e-9);
+                bool converged = (err - newErr) < 1e-6 * err;
+                err = newErr;
+                if (converged) {
+                    return err;
+                }
+            } else {
+                nodes = saved;
+                lambda *= 10.0;
+            }
+        }
+
+        if (!improved) {
+            break;
+        }
+    }
+
+    return err;
+}
+
+PoseGraphOptimizer::PoseGraphOptimizer()
+    : iterations(0), pending(false), running(false), finished(false), quit(false) {
+    thread = std::thread(&PoseGraphOptimizer::run, this);
+}
+
+PoseGraphOptimizer::~PoseGraphOptimizer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+bool PoseGraphOptimizer::request(const PoseGraph& g, int maxIterations) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending || running) {
+        return false;
+    }
+
+    graph = g;
+    iterations = maxIterations;
+    pending = true;
+    finished = false;
+    cv.notify_all();
+    return true;
+}
+
+bool PoseGraphOptimizer::busy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending || running;
+}
+
+bool PoseGraphOptimizer::takeResult(PoseGraph& result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!finished) {
+        return false;
+    }
+
+    std::swap(result, graph);
+    finished = false;
+    return true;
+}
+
+void PoseGraphOptimizer::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        cv.wait(lock, [this] { return pending || quit; });
+        if (quit) {
+            return;
+        }
+
+        pending = false;
+        running = true;
+
+        // The graph is only touched by this thread until finished is set
+        lock.unlock();
+        graph.optimize(iterations);
+        lock.lock();
+
+        running = false;
+        finished = true;
+    }
+}
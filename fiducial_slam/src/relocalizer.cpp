@@ -0,0 +1,146 @@
+#include <fiducial_slam/relocalizer.h>
+#include <fiducial_slam/spatial_index.h>
+
+#include <algorithm>
+#include <cmath>
+
+Relocalizer::Relocalizer()
+    : distanceTolerance(0.1), relativeDistanceTolerance(0.1), angleTolerance(0.35) {}
+
+uint64_t Relocalizer::pairKey(int a, int b) {
+    if (a > b) {
+        std::swap(a, b);
+    }
+    return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+}
+
+// Distance between two fiducials and the angle of rotation from one to the
+// other, which are the same in any frame
+Relocalizer::PairGeometry Relocalizer::geometry(const tf2::Transform &a,
+                                                const tf2::Transform &b) {
+    PairGeometry g;
+    g.distance = a.getOrigin().distance(b.getOrigin());
+    g.angle = a.getRotation().angleShortestPath(b.getRotation());
+    return g;
+}
+
+bool Relocalizer::consistent(const PairGeometry &expected, const PairGeometry &observed) const {
+    double dd = std::fabs(expected.distance - observed.distance);
+    double da = std::fabs(expected.angle - observed.angle);
+    return dd <= distanceTolerance + relativeDistanceTolerance * expected.distance &&
+           da <= angleTolerance;
+}
+
+void Relocalizer::build(const FiducialMap &fiducials, double range) {
+    pairs.clear();
+
+    SpatialIndex index(std::max(range, 0.1));
+    for (const auto &map_pair : fiducials) {
+        index.update(map_pair.first, map_pair.second.pose.transform.getOrigin());
+    }
+
+    std::vector<int> near;
+    for (const auto &map_pair : fiducials) {
+        const tf2::Transform &T = map_pair.second.pose.transform;
+        near.clear();
+        index.queryRadius(T.getOrigin(), range, near);
+        for (int other : near) {
+            if (other > map_pair.first) {
+                pairs[pairKey(map_pair.first, other)] =
+                    geometry(T, fiducials.find(other)->second.pose.transform);
+            }
+        }
+    }
+}
+
+int Relocalizer::match(const FiducialMap &fiducials,
+                       const std::vector<std::pair<int, tf2::Transform>> &observed,
+                       std::vector<int> &inliers) {
+    inliers.clear();
+
+    known.clear();
+    for (size_t i = 0; i < observed.size(); i++) {
+        if (fiducials.find(observed[i].first) != fiducials.end()) {
+            known.push_back(i);
+        }
+    }
+
+    const int n = known.size();
+    if (n < 2) {
+        return 0;
+    }
+
+    // Which pairs of observations agree with the map
+    agree.assign(n * n, false);
+    degree.assign(n, 0);
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            int a = observed[known[i]].first;
+            int b = observed[known[j]].first;
+            if (a == b) {
+                continue;
+            }
+
+            PairGeometry expected;
+            auto it = pairs.find(pairKey(a, b));
+            if (it != pairs.end()) {
+                expected = it->second;
+            } else {
+                // Further apart than was precomputed
+                expected = geometry(fiducials.find(a)->second.pose.transform,
+                                    fiducials.find(b)->second.pose.transform);
+            }
+
+            PairGeometry seen = geometry(observed[known[i]].second, observed[known[j]].second);
+            if (consistent(expected, seen)) {
+                agree[i * n + j] = agree[j * n + i] = true;
+                degree[i]++;
+                degree[j]++;
+            }
+        }
+    }
+
+    // Greedily grow a mutually consistent set from each observation, trying
+    // the best connected ones first, and keep the largest
+    order.resize(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return degree[a] > degree[b]; });
+
+    best.clear();
+    for (int seed : order) {
+        if (degree[seed] + 1 <= (int)best.size()) {
+            break;
+        }
+        set.assign(1, seed);
+        for (int c : order) {
+            if (c == seed) {
+                continue;
+            }
+            bool ok = true;
+            for (int m : set) {
+                if (!agree[c * n + m]) {
+                    ok = false;
+                    break;
+                }
+            }
+            if (ok) {
+                set.push_back(c);
+            }
+        }
+        if (set.size() > best.size()) {
+            best = set;
+        }
+    }
+
+    if (best.size() < 2) {
+        return 0;
+    }
+
+    for (int i : best) {
+        inliers.push_back(observed[known[i]].first);
+    }
+    std::sort(inliers.begin(), inliers.end());
+    return inliers.size();
+}
@@ -0,0 +1,108 @@
+#include <fiducial_slam/robust_pose.h>
+
+#include <Eigen/Cholesky>
+#include <cmath>
+
+typedef Eigen::Matrix<double, 6, 6> Matrix6;
+typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
+// Regularization so that a zero covariance gives a finite information matrix
+static const double informationEpsilon = 1e-9;
+
+RobustPoseSolver::RobustPoseSolver()
+    : outlierThreshold(-1.0), huberThreshold(3.5), maxIterations(10), count(0) {}
+
+bool RobustPoseSolver::add(const TransformWithCovariance& estimate) {
+    if (count >= maxEstimates) {
+        return false;
+    }
+
+    Matrix6 S = estimate.covariance;
+    S.diagonal().array() += informationEpsilon;
+
+    estimates[count] = estimate;
+    information[count] = S.ldlt().solve(Matrix6::Identity());
+    inlier[count] = true;
+    count++;
+    return true;
+}
+
+int RobustPoseSolver::solve(TransformWithCovariance& result) {
+    if (count == 0) {
+        return 0;
+    }
+
+    // Pick the estimate that the most others agree with as the starting point.
+    // Every estimate is tried as a hypothesis, which is cheap for the number
+    // of fiducials visible in one image
+    int best = 0;
+    if (outlierThreshold > 0 && count > 2) {
+        const double threshold2 = outlierThreshold * outlierThreshold;
+        int bestInliers = -1;
+        double bestError = 0.0;
+
+        for (int h = 0; h < count; h++) {
+            int numInliers = 0;
+            double error = 0.0;
+            for (int i = 0; i < count; i++) {
+                double d2 = estimates[h].mahalanobis2(estimates[i]);
+                if (d2 < threshold2) {
+                    numInliers++;
+                    error += d2;
+                }
+            }
+            if (numInliers > bestInliers || (numInliers == bestInliers && error < bestError)) {
+                best = h;
+                bestInliers = numInliers;
+                bestError = error;
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            inlier[i] = estimates[best].mahalanobis2(estimates[i]) < threshold2;
+        }
+    } else {
+        // Without a threshold start from the most certain estimate
+        for (int i = 1; i < count; i++) {
+            if (estimates[i].covariance.trace() < estimates[best].covariance.trace()) {
+                best = i;
+            }
+        }
+    }
+
+    // Iteratively reweighted least squares with Huber weights. The sums don't
+    // depend on the order of the estimates, so neither does the result
+    tf2::Transform mean = estimates[best].transform;
+    Matrix6 Lambda = Matrix6::Zero();
+    int numInliers = 0;
+
+    for (int iter = 0; iter < maxIterations; iter++) {
+        Lambda.setZero();
+        Vector6d eta = Vector6d::Zero();
+        numInliers = 0;
+
+        for (int i = 0; i < count; i++) {
+            if (!inlier[i]) {
+                continue;
+            }
+            Vector6d d = transformDelta(mean, estimates[i].transform);
+            Matrix6 info = information[i];
+            double m = std::sqrt(d.dot(info * d));
+            double w = (m <= huberThreshold) ? 1.0 : huberThreshold / m;
+
+            Lambda += w * info;
+            eta += w * info * d;
+            numInliers++;
+        }
+
+        Vector6d step = Lambda.ldlt().solve(eta);
+        mean = applyTransformDelta(mean, step);
+        if (step.squaredNorm() < 1e-18) {
+            break;
+        }
+    }
+
+    result.transform = mean;
+    result.covariance = Lambda.ldlt().solve(Matrix6::Identity());
+    return numInliers;
+}
@@ -0,0 +1,124 @@
+#include <fiducial_slam/spatial_index.h>
+
+#include <algorithm>
+#include <cmath>
+
+SpatialIndex::SpatialIndex(double cellSize) : cellSize(cellSize) {}
+
+void SpatialIndex::setCellSize(double size) {
+    cellSize = size;
+    clear();
+}
+
+void SpatialIndex::clear() {
+    cells.clear();
+    entries.clear();
+}
+
+int SpatialIndex::cellCoord(double v) const { return (int)std::floor(v / cellSize); }
+
+// Pack cell coordinates into a single key, 21 bits each
+int64_t SpatialIndex::cellKey(int ix, int iy, int iz) {
+    const int64_t offset = 1 << 20;
+    const int64_t mask = (1 << 21) - 1;
+    return (((ix + offset) & mask) << 42) | (((iy + offset) & mask) << 21) | ((iz + offset) & mask);
+}
+
+int64_t SpatialIndex::cellKey(const tf2::Vector3& p) const {
+    return cellKey(cellCoord(p.x()), cellCoord(p.y()), cellCoord(p.z()));
+}
+
+void SpatialIndex::update(int id, const tf2::Vector3& position) {
+    int64_t key = cellKey(position);
+
+    auto it = entries.find(id);
+    if (it != entries.end()) {
+        it->second.position = position;
+        if (it->second.cell == key) {
+            return;
+        }
+        std::vector<int>& old = cells[it->second.cell];
+        old.erase(std::find(old.begin(), old.end(), id));
+        if (old.empty()) {
+            cells.erase(it->second.cell);
+        }
+        it->second.cell = key;
+    } else {
+        entries[id] = Entry{position, key};
+    }
+
+    cells[key].push_back(id);
+}
+
+void SpatialIndex::remove(int id) {
+    auto it = entries.find(id);
+    if (it == entries.end()) {
+        return;
+    }
+
+    std::vector<int>& cell = cells[it->second.cell];
+    cell.erase(std::find(cell.begin(), cell.end(), id));
+    if (cell.empty()) {
+        cells.erase(it->second.cell);
+    }
+    entries.erase(it);
+}
+
+void SpatialIndex::queryRadius(const tf2::Vector3& center, double range,
+                               std::vector<int>& ids) const {
+    const double range2 = range * range;
+
+    auto test = [&](const std::vector<int>& cell) {
+        for (int id : cell) {
+            if (entries.at(id).position.distance2(center) <= range2) {
+                ids.push_back(id);
+            }
+        }
+    };
+
+    int x0 = cellCoord(center.x() - range), x1 = cellCoord(center.x() + range);
+    int y0 = cellCoord(center.y() - range), y1 = cellCoord(center.y() + range);
+    int z0 = cellCoord(center.z() - range), z1 = cellCoord(center.z() + range);
+    double numCells = double(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+
+    // A range covering more cells than are occupied is cheaper to answer
+    // by visiting the occupied ones
+    if (numCells > cells.size()) {
+        for (const auto& cell_pair : cells) {
+            test(cell_pair.second);
+        }
+        return;
+    }
+
+    for (int x = x0; x <= x1; x++) {
+        for (int y = y0; y <= y1; y++) {
+            for (int z = z0; z <= z1; z++) {
+                auto it = cells.find(cellKey(x, y, z));
+                if (it != cells.end()) {
+                    test(it->second);
+                }
+            }
+        }
+    }
+}
+
+void SpatialIndex::queryFrustum(const tf2::Transform& T_mapCam, double hfov, double vfov,
+                                double range, std::vector<int>& ids) const {
+    size_t first = ids.size();
+    queryRadius(T_mapCam.getOrigin(), range, ids);
+
+    const double tanH = std::tan(hfov / 2.0);
+    const double tanV = std::tan(vfov / 2.0);
+    tf2::Transform T_camMap = T_mapCam.inverse();
+
+    // Keep the candidates that are in front of the camera and inside the
+    // field of view
+    size_t out = first;
+    for (size_t i = first; i < ids.size(); i++) {
+        tf2::Vector3 p = T_camMap * entries.at(ids[i]).position;
+        if (p.z() > 0 && std::fabs(p.x()) <= p.z() * tanH && std::fabs(p.y()) <= p.z() * tanV) {
+            ids[out++] = ids[i];
+        }
+    }
+    ids.resize(out);
+}
@@ -0,0 +1,141 @@
+#include <fiducial_slam/transform_with_covariance.h>
+
+#include <Eigen/Cholesky>
+#include <cmath>
+
+typedef Eigen::Matrix<double, 6, 6> Matrix6;
+
+// Added to the diagonal before factorizing a sum of covariances, so that two
+// exact (zero covariance) estimates don't produce a singular system
+static const double covarianceEpsilon = 1e-12;
+
+// Rotation part of a transform as an Eigen matrix
+static Eigen::Matrix3d rotationMatrix(const tf2::Transform& t) {
+    const tf2::Matrix3x3& b = t.getBasis();
+    Eigen::Matrix3d R;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            R(i, j) = b[i][j];
+        }
+    }
+    return R;
+}
+
+// Matrix such that skew(a) * b == a x b
+static Eigen::Matrix3d skew(const tf2::Vector3& v) {
+    Eigen::Matrix3d S;
+    S << 0, -v.z(), v.y(), v.z(), 0, -v.x(), -v.y(), v.x(), 0;
+    return S;
+}
+
+// Jacobian of T1 * T2 with respect to a perturbation of T1
+Matrix6 compositionJacobian(const tf2::Transform& T1, const tf2::Transform& T2) {
+    Matrix6 J = Matrix6::Identity();
+    J.block<3, 3>(0, 3) = -skew(T1.getBasis() * T2.getOrigin());
+    return J;
+}
+
+// Jacobian of T1 * T2 with respect to a perturbation of T2
+static Matrix6 rightJacobian(const tf2::Transform& T1) {
+    Eigen::Matrix3d R = rotationMatrix(T1);
+    Matrix6 J = Matrix6::Zero();
+    J.block<3, 3>(0, 0) = R;
+    J.block<3, 3>(3, 3) = R;
+    return J;
+}
+
+// Rotation vector (axis * angle) of a quaternion
+static Eigen::Vector3d quaternionLog(tf2::Quaternion q) {
+    if (q.w() < 0) {
+        q = -q;
+    }
+    Eigen::Vector3d v(q.x(), q.y(), q.z());
+    double s = v.norm();
+    if (s < 1e-12) {
+        return 2.0 * v;
+    }
+    return v * (2.0 * std::atan2(s, q.w()) / s);
+}
+
+// Quaternion for a rotation vector
+static tf2::Quaternion quaternionExp(const Eigen::Vector3d& phi) {
+    double angle = phi.norm();
+    if (angle < 1e-12) {
+        return tf2::Quaternion(phi.x() / 2.0, phi.y() / 2.0, phi.z() / 2.0, 1.0).normalized();
+    }
+    return tf2::Quaternion(tf2::Vector3(phi.x(), phi.y(), phi.z()), angle);
+}
+
+Vector6 transformDelta(const tf2::Transform& from, const tf2::Transform& to) {
+    Vector6 delta;
+    tf2::Vector3 dt = to.getOrigin() - from.getOrigin();
+    delta.head<3>() << dt.x(), dt.y(), dt.z();
+    delta.tail<3>() = quaternionLog(to.getRotation() * from.getRotation().inverse());
+    return delta;
+}
+
+tf2::Transform applyTransformDelta(const tf2::Transform& t, const Vector6& delta) {
+    tf2::Transform out;
+    out.setOrigin(t.getOrigin() + tf2::Vector3(delta(0), delta(1), delta(2)));
+    out.setRotation((quaternionExp(delta.tail<3>()) * t.getRotation()).normalized());
+    return out;
+}
+
+TransformWithCovariance& TransformWithCovariance::operator*=(const TransformWithCovariance& rhs) {
+    Matrix6 J1 = compositionJacobian(transform, rhs.transform);
+    Matrix6 J2 = rightJacobian(transform);
+
+    covariance = J1 * covariance * J1.transpose() + J2 * rhs.covariance * J2.transpose();
+    transform *= rhs.transform;
+    return *this;
+}
+
+TransformWithCovariance& TransformWithCovariance::operator*=(const tf2::Transform& rhs) {
+    Matrix6 J1 = compositionJacobian(transform, rhs);
+
+    covariance = J1 * covariance * J1.transpose();
+    transform *= rhs;
+    return *this;
+}
+
+TransformWithCovariance operator*(const tf2::Transform& lhs, const TransformWithCovariance& rhs) {
+    Matrix6 J2 = rightJacobian(lhs);
+
+    return TransformWithCovariance(lhs * rhs.transform, J2 * rhs.covariance * J2.transpose());
+}
+
+TransformWithCovariance TransformWithCovariance::inverse() const {
+    Eigen::Matrix3d Rt = rotationMatrix(transform).transpose();
+
+    Matrix6 J = Matrix6::Zero();
+    J.block<3, 3>(0, 0) = -Rt;
+    J.block<3, 3>(0, 3) = -Rt * skew(transform.getOrigin());
+    J.block<3, 3>(3, 3) = -Rt;
+
+    return TransformWithCovariance(transform.inverse(), J * covariance * J.transpose());
+}
+
+// Update this transform with a new one, weighting each by its covariance.
+// With K = S1 (S1 + S2)^-1 the fused mean is x1 + K (x2 - x1) and the fused
+// covariance is (I - K) S1, which equals (S1^-1 + S2^-1)^-1
+void TransformWithCovariance::update(const TransformWithCovariance& newT) {
+    Matrix6 S = covariance + newT.covariance;
+    S.diagonal().array() += covarianceEpsilon;
+
+    // K^T = S^-1 * S1 as both matrices are symmetric
+    Matrix6 K = S.ldlt().solve(Matrix6(covariance)).transpose();
+
+    Vector6 delta = K * transformDelta(transform, newT.transform);
+    transform = applyTransformDelta(transform, delta);
+
+    Matrix6 fused = covariance - K * covariance;
+    covariance = 0.5 * (fused + fused.transpose());
+}
+
+double TransformWithCovariance::mahalanobis2(const TransformWithCovariance& other) const {
+    Matrix6 S = covariance + other.covariance;
+    S.diagonal().array() += covarianceEpsilon;
+
+    Eigen::Matrix<double, 6, 1> d = transformDelta(transform, other.transform);
+    return d.dot(S.ldlt().solve(d));
+}
@@ -1,4 +1,8 @@
 #include <fiducial_slam/transform_with_variance.h>
+
+#include <Eigen/Eigenvalues>
+
+#include <algorithm>
 #include <cmath>
 
 /*
@@ -102,3 +106,104 @@ TransformWithVariance averageTransforms(const TransformWithVariance& t1,
         return out;
     */
 }
+
+void TransformBatch::clear() {
+    x.clear();
+    y.clear();
+    z.clear();
+    qx.clear();
+    qy.clear();
+    qz.clear();
+    qw.clear();
+    var.clear();
+}
+
+void TransformBatch::reserve(size_t n) {
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+    qx.reserve(n);
+    qy.reserve(n);
+    qz.reserve(n);
+    qw.reserve(n);
+    var.reserve(n);
+}
+
+void TransformBatch::add(const TransformWithVariance& t) {
+    const tf2::Vector3& p = t.transform.getOrigin();
+    tf2::Quaternion q = t.transform.getRotation();
+    x.push_back(p.x());
+    y.push_back(p.y());
+    z.push_back(p.z());
+    qx.push_back(q.x());
+    qy.push_back(q.y());
+    qz.push_back(q.z());
+    qw.push_back(q.w());
+    // A zero variance would take all the weight
+    var.push_back(std::max(t.variance, 1e-8));
+}
+
+TransformWithVariance TransformBatch::fuse() const {
+    const size_t n = size();
+    if (n == 0) {
+        return TransformWithVariance(tf2::Transform::getIdentity(), 0.0);
+    }
+
+    // Position, weighted by inverse variance. The loops have no branches
+    // so that they can be vectorized
+    double wsum = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double w = 1.0 / var[i];
+        wsum += w;
+        px += w * x[i];
+        py += w * y[i];
+        pz += w * z[i];
+    }
+    px /= wsum;
+    py /= wsum;
+    pz /= wsum;
+
+    // Weighted sum of the outer products of the quaternions. q and -q
+    // contribute the same, so no care is needed over their signs
+    double mxx = 0, mxy = 0, mxz = 0, mxw = 0, myy = 0, myz = 0, myw = 0, mzz = 0, mzw = 0,
+           mww = 0;
+    for (size_t i = 0; i < n; i++) {
+        double w = 1.0 / var[i];
+        mxx += w * qx[i] * qx[i];
+        mxy += w * qx[i] * qy[i];
+        mxz += w * qx[i] * qz[i];
+        mxw += w * qx[i] * qw[i];
+        myy += w * qy[i] * qy[i];
+        myz += w * qy[i] * qz[i];
+        myw += w * qy[i] * qw[i];
+        mzz += w * qz[i] * qz[i];
+        mzw += w * qz[i] * qw[i];
+        mww += w * qw[i] * qw[i];
+    }
+
+    Eigen::Matrix4d M;
+    M << mxx, mxy, mxz, mxw,
+         mxy, myy, myz, myw,
+         mxz, myz, mzz, mzw,
+         mxw, myw, mzw, mww;
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix4d> solver(M);
+    // Eigenvalues are in increasing order
+    Eigen::Vector4d v = solver.eigenvectors().col(3);
+    tf2::Quaternion q(v(0), v(1), v(2), v(3));
+
+    // The David method of combining variances from update(), extended to
+    // any number of estimates: the density of each estimate at the fused
+    // position is summed in quadrature
+    double density2 = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double dx = x[i] - px, dy = y[i] - py, dz = z[i] - pz;
+        double d2 = dx * dx + dy * dy + dz * dz;
+        density2 += std::exp(-d2 / var[i]) / var[i];
+    }
+    double newVar = 1.0 / density2;
+    newVar = std::min(newVar, 1e3);
+    newVar = std::max(newVar, 1e-8);
+
+    return TransformWithVariance(tf2::Transform(q.normalized(), tf2::Vector3(px, py, pz)),
+                                 newVar);
+}
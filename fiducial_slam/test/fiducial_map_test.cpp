@@ -0,0 +1,187 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/fiducial_map.h>
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <random>
+
+static Fiducial makeFiducial(int id) {
+    tf2::Transform t(tf2::Quaternion::getIdentity(), tf2::Vector3(id, 0, 0));
+    return Fiducial(id, TransformWithVariance(t, 0.1 * id));
+}
+
+TEST (FiducialMap, matches_std_map) {
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> ids(0, 500);
+
+    FiducialMap fiducials;
+    std::map<int, Fiducial> expected;
+
+    for (int i = 0; i < 1000; i++) {
+        int id = ids(rng);
+        if (i % 4 == 3) {
+            ASSERT_EQ(expected.erase(id), fiducials.erase(id));
+        } else {
+            fiducials[id] = makeFiducial(id);
+            expected[id] = makeFiducial(id);
+        }
+    }
+
+    ASSERT_EQ(expected.size(), fiducials.size());
+
+    // Iteration is in order of id, as with std::map
+    auto it = fiducials.begin();
+    for (const auto &map_pair : expected) {
+        ASSERT_EQ(map_pair.first, it->first);
+        ASSERT_EQ(map_pair.first, it->second.id);
+        ++it;
+    }
+
+    for (int id = -1; id <= 501; id++) {
+        ASSERT_EQ(expected.count(id), fiducials.count(id));
+        if (expected.count(id)) {
+            ASSERT_EQ(id, fiducials.find(id)->second.id);
+        } else {
+            ASSERT_TRUE(fiducials.find(id) == fiducials.end());
+        }
+
+        auto ub = fiducials.upper_bound(id);
+        auto eub = expected.upper_bound(id);
+        if (eub == expected.end()) {
+            ASSERT_TRUE(ub == fiducials.end());
+        } else {
+            ASSERT_EQ(eub->first, ub->first);
+        }
+    }
+}
+
+TEST (FiducialMap, negative_and_copy) {
+    FiducialMap fiducials;
+    fiducials[5] = makeFiducial(5);
+    fiducials[-1].numObs = 3;
+
+    ASSERT_EQ(2, fiducials.size());
+    ASSERT_EQ(-1, fiducials.begin()->first);
+    ASSERT_EQ(3, fiducials.find(-1)->second.numObs);
+
+    FiducialMap copy = fiducials;
+    fiducials.clear();
+    ASSERT_TRUE(fiducials.empty());
+    ASSERT_EQ(2, copy.size());
+    ASSERT_NEAR(copy.find(5)->second.pose.variance, 0.5, 1e-12);
+}
+
+TEST (FiducialMap, copies_share_until_changed) {
+    FiducialMap fiducials;
+    for (int id = 0; id < 500; id++) {
+        fiducials[id] = makeFiducial(id);
+    }
+
+    // Changes after a copy, as the map thread makes after a snapshot,
+    // don't show in the copy
+    FiducialMap copy = fiducials;
+    const FiducialMap &shared = copy;
+    const Fiducial *unchanged = &shared.find(200)->second;
+    fiducials[3].numObs = 42;
+    fiducials.erase(7);
+    fiducials[1000] = makeFiducial(1000);
+    for (int id = 100; id < 110; id++) {
+        fiducials.find(id)->second.pose.variance = 9.0;
+    }
+
+    ASSERT_EQ(500, shared.size());
+    ASSERT_EQ(0, shared.find(3)->second.numObs);
+    ASSERT_EQ(1, shared.count(7));
+    ASSERT_EQ(0, shared.count(1000));
+    ASSERT_NEAR(10.5, shared.find(105)->second.pose.variance, 1e-12);
+    ASSERT_EQ(42, fiducials.find(3)->second.numObs);
+    ASSERT_EQ(0, fiducials.count(7));
+    ASSERT_EQ(9.0, fiducials.find(105)->second.pose.variance);
+
+    // The fiducials that were only read are still shared
+    const FiducialMap &original = fiducials;
+    ASSERT_EQ(unchanged, &original.find(200)->second);
+}
+
+TEST (FiducialMap, sparse_ids) {
+    // Ids from offset dictionaries, or bogus ones from a message, are far
+    // apart and must not cost memory in proportion to their size
+    FiducialMap fiducials;
+    std::vector<int> ids = {INT_MAX, 2000000000, 1000000, 3, 0, -5, INT_MIN};
+    for (int id : ids) {
+        fiducials[id].numObs = 1;
+    }
+    for (int i = 0; i < 300; i++) {
+        fiducials[1000000 + i] = makeFiducial(i);
+    }
+    ASSERT_EQ(306, fiducials.size());
+
+    std::vector<int> order;
+    for (const auto &map_pair : fiducials) {
+        order.push_back(map_pair.first);
+    }
+    ASSERT_TRUE(std::is_sorted(order.begin(), order.end()));
+    ASSERT_EQ(INT_MIN, order.front());
+    ASSERT_EQ(INT_MAX, order.back());
+
+    ASSERT_EQ(1, fiducials.erase(INT_MAX));
+    ASSERT_TRUE(fiducials.upper_bound(2000000000) == fiducials.end());
+    ASSERT_EQ(1000000, fiducials.upper_bound(3)->first);
+    ASSERT_EQ(0, fiducials.count(4));
+}
+
+TEST (FiducialMap, erase_many) {
+    FiducialMap fiducials;
+    std::map<int, Fiducial> expected;
+    for (int id = 0; id < 1000; id++) {
+        fiducials[id] = makeFiducial(id);
+        expected[id] = makeFiducial(id);
+    }
+
+    // Most of the map, as when evicting tiles, and ids that aren't present
+    std::vector<int> ids;
+    for (int id = 1100; id >= 0; id--) {
+        if (id % 10 != 3) {
+            ids.push_back(id);
+            expected.erase(id);
+        }
+    }
+    ASSERT_EQ(900, fiducials.erase(ids));
+    ASSERT_EQ(0, fiducials.erase(ids));
+    ASSERT_EQ(expected.size(), fiducials.size());
+
+    auto it = fiducials.begin();
+    for (const auto &map_pair : expected) {
+        ASSERT_EQ(map_pair.first, it->first);
+        ASSERT_EQ(map_pair.first, fiducials.find(map_pair.first)->first);
+        ++it;
+    }
+    ASSERT_TRUE(it == fiducials.end());
+
+    fiducials[5] = makeFiducial(5);
+    ASSERT_EQ(13, fiducials.upper_bound(5)->first);
+}
+
+TEST (FiducialLinks, sorted_unique) {
+    FiducialLinks links;
+    ASSERT_TRUE(links.insert(7));
+    ASSERT_TRUE(links.insert(3));
+    ASSERT_FALSE(links.insert(7));
+    ASSERT_TRUE(links.insert(5));
+
+    std::vector<int> ids(links.begin(), links.end());
+    ASSERT_EQ(std::vector<int>({3, 5, 7}), ids);
+    ASSERT_EQ(1, links.count(5));
+
+    ASSERT_TRUE(links.erase(5));
+    ASSERT_FALSE(links.erase(5));
+    ASSERT_EQ(0, links.count(5));
+    ASSERT_EQ(2, links.size());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/frame_collector.h>
+
+#include <fiducial_msgs/compact.h>
+
+#include <cmath>
+
+static fiducial_msgs::FiducialTransformArray makeMsg(const std::string &frame, double stamp,
+                                                     int fid) {
+    fiducial_msgs::FiducialTransformArray msg;
+    msg.header.frame_id = frame;
+    msg.header.stamp = ros::Time(stamp);
+    fiducial_msgs::FiducialTransform ft;
+    ft.fiducial_id = fid;
+    ft.transform.translation.z = 1.0;
+    ft.transform.rotation.w = 1.0;
+    ft.object_error = 0.5;
+    msg.transforms.push_back(ft);
+    return msg;
+}
+
+// Records each frame passed on
+class Frames {
+public:
+    std::vector<std::vector<int>> fids;
+    std::vector<double> times;
+    std::vector<Observation> last;
+
+    FrameCollector::Sink sink() {
+        return [this](std::vector<Observation> &obs, const ros::Time &time) {
+            std::vector<int> ids;
+            for (const Observation &o : obs) {
+                ids.push_back(o.fid);
+            }
+            fids.push_back(ids);
+            times.push_back(time.toSec());
+            last = obs;
+        };
+    }
+};
+
+TEST (FrameCollector, single_camera) {
+    Frames frames;
+    FrameCollector collector;
+    collector.configure(1, 0.05, false, 2.0, frames.sink());
+
+    collector.add(makeMsg("cam", 10.0, 1), 0);
+    collector.add(makeMsg("cam", 10.1, 2), 0);
+    ASSERT_EQ(2, frames.fids.size());
+    ASSERT_EQ(std::vector<int>({1}), frames.fids[0]);
+    ASSERT_NEAR(10.1, frames.times[1], 1e-6);
+}
+
+TEST (FrameCollector, combines_cameras) {
+    Frames frames;
+    FrameCollector collector;
+    collector.configure(3, 0.05, false, 2.0, frames.sink());
+
+    // All three cameras within the window
+    collector.add(makeMsg("front", 10.00, 1), 0);
+    collector.add(makeMsg("rear", 10.02, 2), 1);
+    ASSERT_TRUE(frames.fids.empty());
+    collector.add(makeMsg("up", 10.01, 3), 2);
+    ASSERT_EQ(1, frames.fids.size());
+    ASSERT_EQ(std::vector<int>({1, 2, 3}), frames.fids[0]);
+    ASSERT_NEAR(10.02, frames.times[0], 1e-6);
+
+    // The front camera again before the others, and then one too late
+    collector.add(makeMsg("front", 10.10, 4), 0);
+    collector.add(makeMsg("front", 10.12, 5), 0);
+    collector.add(makeMsg("rear", 10.30, 6), 1);
+    ASSERT_EQ(3, frames.fids.size());
+    ASSERT_EQ(std::vector<int>({4}), frames.fids[1]);
+    ASSERT_EQ(std::vector<int>({5}), frames.fids[2]);
+
+    collector.flushStale(ros::Time(10.31));
+    ASSERT_EQ(3, frames.fids.size());
+    collector.flushStale(ros::Time(10.40));
+    ASSERT_EQ(4, frames.fids.size());
+    ASSERT_EQ(std::vector<int>({6}), frames.fids[3]);
+}
+
+TEST (FrameCollector, quaternion_packing) {
+    const double angles[][3] = {{0, 0, 0}, {0.1, -0.2, 0.3}, {M_PI, 0, 0}, {1.5, 1.5, -3.0}};
+    for (const auto &a : angles) {
+        tf2::Quaternion q;
+        q.setRPY(a[0], a[1], a[2]);
+        geometry_msgs::Quaternion msg, unpacked;
+        msg.x = q.x();
+        msg.y = q.y();
+        msg.z = q.z();
+        msg.w = q.w();
+        fiducial_msgs::unpackQuaternion(fiducial_msgs::packQuaternion(msg), unpacked);
+
+        // The same rotation, possibly with the opposite sign
+        double dot = msg.x * unpacked.x + msg.y * unpacked.y + msg.z * unpacked.z +
+                     msg.w * unpacked.w;
+        ASSERT_NEAR(1.0, std::fabs(dot), 1e-9);
+    }
+}
+
+TEST (FrameCollector, compact_matches_full) {
+    fiducial_msgs::FiducialTransformArray msg = makeMsg("cam", 10.0, 7);
+    tf2::Quaternion q;
+    q.setRPY(0.3, -0.1, 2.0);
+    msg.transforms[0].transform.rotation.x = q.x();
+    msg.transforms[0].transform.rotation.y = q.y();
+    msg.transforms[0].transform.rotation.z = q.z();
+    msg.transforms[0].transform.rotation.w = q.w();
+    msg.transforms[0].transform.translation.x = 0.25;
+    msg.transforms[0].fiducial_area = 1200.0;
+
+    fiducial_msgs::CompactFiducialTransformArray compact;
+    fiducial_msgs::toCompact(msg, compact);
+
+    Frames full, packed;
+    FrameCollector fullCollector, packedCollector;
+    fullCollector.configure(1, 0.05, false, 2.0, full.sink());
+    packedCollector.configure(1, 0.05, false, 2.0, packed.sink());
+    fullCollector.add(msg, 0);
+    packedCollector.add(compact, 0);
+
+    ASSERT_EQ(1, full.last.size());
+    ASSERT_EQ(1, packed.last.size());
+    ASSERT_EQ(full.last[0].fid, packed.last[0].fid);
+    ASSERT_EQ(full.last[0].frame, packed.last[0].frame);
+    ASSERT_NEAR(full.times[0], packed.times[0], 1e-9);
+    ASSERT_NEAR(full.last[0].T_camFid.variance, packed.last[0].T_camFid.variance, 1e-6);
+
+    const tf2::Transform &a = full.last[0].T_camFid.transform;
+    const tf2::Transform &b = packed.last[0].T_camFid.transform;
+    ASSERT_LT(a.getOrigin().distance(b.getOrigin()), 1e-6);
+    ASSERT_LT(a.getRotation().angleShortestPath(b.getRotation()), 1e-5);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
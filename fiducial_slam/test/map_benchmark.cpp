@@ -0,0 +1,329 @@
+/*
+ * Benchmark of the map with synthetic data, without ROS networking.
+ *
+ * For each map size, fiducials are laid out on a ceiling and a robot with
+ * an upward facing camera drives a loop under them. Observations and
+ * odometry have noise added, and the map starts with its fiducials
+ * displaced. Reports the time taken by Map::update for each frame, heap
+ * allocations per frame, and the errors of the pose and the map against
+ * the ground truth.
+ *
+ * Built when configured with -DFIDUCIAL_SLAM_BENCHMARK=ON.
+ */
+
+#include <fiducial_slam/map.h>
+#include <fiducial_slam/map_params.h>
+
+#include <ros/console.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static atomic<long> allocations(0);
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+struct Options {
+    vector<int> sizes = {10, 100, 1000, 10000};
+    int frames = 500;
+    double spacing = 1.0;
+    double ceiling = 3.0;
+    double obsNoise = 0.01;
+    double odomNoise = 0.002;
+    double mapNoise = 0.05;
+    bool background = false;
+    unsigned seed = 1;
+};
+
+struct Result {
+    int fiducials;
+    int frames;
+    int poses;
+    double meanObs;
+    vector<double> latency;
+    double allocsPerFrame;
+    double poseRms;
+    double yawRms;
+    double mapRmsBefore;
+    double mapRmsAfter;
+};
+
+static tf2::Transform makeTransform(double x, double y, double z, double roll, double pitch,
+                                    double yaw) {
+    tf2::Quaternion q;
+    q.setRPY(roll, pitch, yaw);
+    return tf2::Transform(q, tf2::Vector3(x, y, z));
+}
+
+static tf2::Transform perturb(const tf2::Transform &T, double sigma, mt19937 &rng) {
+    normal_distribution<double> n(0.0, sigma);
+    return T * makeTransform(n(rng), n(rng), n(rng), n(rng), n(rng), n(rng));
+}
+
+static geometry_msgs::TransformStamped toStamped(const tf2::Transform &T, const string &parent,
+                                                 const string &child, const ros::Time &stamp) {
+    geometry_msgs::TransformStamped msg;
+    msg.header.frame_id = parent;
+    msg.header.stamp = stamp;
+    msg.child_frame_id = child;
+    msg.transform = tf2::toMsg(T);
+    return msg;
+}
+
+static double mapRms(const FiducialMap &fiducials, const vector<tf2::Transform> &truth) {
+    double sum = 0;
+    int n = 0;
+    for (const auto &map_pair : fiducials) {
+        if (map_pair.first >= 0 && map_pair.first < (int)truth.size()) {
+            sum += map_pair.second.pose.transform.getOrigin().distance2(
+                truth[map_pair.first].getOrigin());
+            n++;
+        }
+    }
+    return n > 0 ? sqrt(sum / n) : 0.0;
+}
+
+static double percentile(vector<double> v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static Result run(int numFiducials, const Options &opt) {
+    mt19937 rng(opt.seed);
+    Result r;
+
+    // Fiducials on a square grid on the ceiling, facing down
+    int side = (int)ceil(sqrt((double)numFiducials));
+    vector<tf2::Transform> truth;
+    for (int i = 0; i < numFiducials; i++) {
+        truth.push_back(makeTransform((i % side) * opt.spacing, (i / side) * opt.spacing,
+                                      opt.ceiling, M_PI, 0, 0));
+    }
+
+    char mapFile[] = "/tmp/map_benchmarkXXXXXX";
+    int fd = mkstemp(mapFile);
+    FILE *fp = fdopen(fd, "w");
+    FiducialMap initial;
+    for (int i = 0; i < numFiducials; i++) {
+        Fiducial f(i, TransformWithVariance(perturb(truth[i], opt.mapNoise, rng),
+                                            opt.mapNoise * opt.mapNoise));
+        f.numObs = 1;
+        writeFiducial(fp, f);
+        initial[i] = f;
+    }
+    fclose(fp);
+    r.mapRmsBefore = mapRms(initial, truth);
+
+    MapParams params;
+    params.set("initial_map_file", mapFile);
+    params.set("map_file", string(mapFile) + ".out");
+    params.set("load_map", "false");
+    params.set("background_map_update", opt.background ? "true" : "false");
+    params.set("optimize_interval", "0");
+    params.set("tf_timeout", "0");
+    params.set("publish_tf", "false");
+    params.set("base_frame", "base_link");
+
+    ros::Time stamp(1000.0);
+    ros::Time::setNow(stamp);
+    Map map(params);
+    remove(mapFile);
+
+    // Camera looking straight up from the top of the robot
+    tf2::Transform T_baseCam = makeTransform(0, 0, 0.5, 0, 0, 0);
+    map.tfBuffer.setTransform(toStamped(T_baseCam, "base_link", "camera", stamp), "benchmark",
+                              true);
+    int frame = FrameIds::intern("camera");
+
+    // Drive a loop covering most of the map
+    double extent = (side - 1) * opt.spacing;
+    double radius = max(0.35 * extent, 0.5);
+    tf2::Vector3 centre(extent / 2, extent / 2, 0);
+    double tanH = tan(45.0 * M_PI / 180.0);
+    double tanV = tan(35.0 * M_PI / 180.0);
+
+    tf2::Transform T_odomBase = tf2::Transform::getIdentity();
+    tf2::Transform lastTruth;
+    vector<Observation> obs;
+    double poseErr2 = 0, yawErr2 = 0;
+    long totalObs = 0;
+    long allocs = 0;
+    r.poses = 0;
+
+    for (int f = 0; f < opt.frames; f++) {
+        double a = 2 * M_PI * f / opt.frames;
+        tf2::Transform T_mapBase =
+            makeTransform(centre.x() + radius * cos(a), centre.y() + radius * sin(a), 0, 0, 0,
+                          a + M_PI / 2);
+
+        // Odometry drifts from the truth
+        if (f == 0) {
+            T_odomBase = T_mapBase;
+        } else {
+            T_odomBase = T_odomBase * perturb(lastTruth.inverse() * T_mapBase, opt.odomNoise, rng);
+        }
+        lastTruth = T_mapBase;
+
+        stamp += ros::Duration(0.1);
+        ros::Time::setNow(stamp);
+        map.tfBuffer.setTransform(toStamped(T_odomBase, "odom", "base_link", stamp), "benchmark");
+
+        // Fiducials in the camera's view
+        tf2::Transform T_camMap = (T_mapBase * T_baseCam).inverse();
+        obs.clear();
+        for (int i = 0; i < numFiducials; i++) {
+            tf2::Transform T_camFid = T_camMap * truth[i];
+            tf2::Vector3 p = T_camFid.getOrigin();
+            if (p.z() > 0.1 && fabs(p.x()) < p.z() * tanH && fabs(p.y()) < p.z() * tanV) {
+                obs.emplace_back(i,
+                                 TransformWithVariance(perturb(T_camFid, opt.obsNoise, rng),
+                                                       opt.obsNoise * opt.obsNoise),
+                                 stamp, frame);
+            }
+        }
+        totalObs += obs.size();
+
+        long before = allocations;
+        auto start = chrono::steady_clock::now();
+        map.update(obs, stamp);
+        auto end = chrono::steady_clock::now();
+        allocs += allocations - before;
+        r.latency.push_back(chrono::duration<double, milli>(end - start).count());
+
+        auto fix = atomic_load(&map.lastFix);
+        if (fix && fix->stamp == stamp) {
+            tf2::Vector3 d = fix->T_mapBase.transform.getOrigin() - T_mapBase.getOrigin();
+            d.setZ(0);
+            poseErr2 += d.length2();
+            double roll, pitch, yaw, trueYaw;
+            fix->T_mapBase.transform.getBasis().getRPY(roll, pitch, yaw);
+            T_mapBase.getBasis().getRPY(roll, pitch, trueYaw);
+            double yawErr = yaw - trueYaw;
+            yawErr = atan2(sin(yawErr), cos(yawErr));
+            yawErr2 += yawErr * yawErr;
+            r.poses++;
+        }
+    }
+
+    r.fiducials = numFiducials;
+    r.frames = opt.frames;
+    r.meanObs = (double)totalObs / opt.frames;
+    r.allocsPerFrame = (double)allocs / opt.frames;
+    r.poseRms = r.poses > 0 ? sqrt(poseErr2 / r.poses) : 0.0;
+    r.yawRms = r.poses > 0 ? sqrt(yawErr2 / r.poses) : 0.0;
+    r.mapRmsAfter = mapRms(*map.getSnapshot(), truth);
+    return r;
+}
+
+// Time taken to fuse one estimate of a fiducial's pose into the map
+
+static double benchmarkFusion(int iterations) {
+    TransformWithVariance pose(makeTransform(1, 2, 3, 0.1, 0.2, 0.3), 0.01);
+    TransformWithVariance estimate(makeTransform(1.01, 2.01, 3.01, 0.11, 0.21, 0.31), 0.02);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        pose.update(estimate);
+        pose.variance = 0.01;
+    }
+    auto end = chrono::steady_clock::now();
+
+    // Keep the result so the loop isn't optimized away
+    if (std::isnan(pose.transform.getOrigin().x())) {
+        printf("nan\n");
+    }
+    return chrono::duration<double, nano>(end - start).count() / iterations;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --sizes N,N,...     numbers of fiducials (default 10,100,1000,10000)\n"
+            "  --frames N          frames for each size (default 500)\n"
+            "  --obs-noise M       observation noise, meters and radians (default 0.01)\n"
+            "  --odom-noise M      odometry noise per frame (default 0.002)\n"
+            "  --map-noise M       displacement of the initial map (default 0.05)\n"
+            "  --background        update the map in its own thread\n"
+            "  --seed N            random seed (default 1)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--sizes" && hasValue) {
+            opt.sizes.clear();
+            stringstream ss(argv[++i]);
+            string item;
+            while (getline(ss, item, ',')) {
+                opt.sizes.push_back(atoi(item.c_str()));
+            }
+        } else if (arg == "--frames" && hasValue) {
+            opt.frames = atoi(argv[++i]);
+        } else if (arg == "--obs-noise" && hasValue) {
+            opt.obsNoise = atof(argv[++i]);
+        } else if (arg == "--odom-noise" && hasValue) {
+            opt.odomNoise = atof(argv[++i]);
+        } else if (arg == "--map-noise" && hasValue) {
+            opt.mapNoise = atof(argv[++i]);
+        } else if (arg == "--background") {
+            opt.background = true;
+        } else if (arg == "--seed" && hasValue) {
+            opt.seed = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    if (ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Error)) {
+        ros::console::notifyLoggerLevelsChanged();
+    }
+    ros::Time::init();
+
+    printf("TransformWithVariance::update %.1lf ns\n\n", benchmarkFusion(1000000));
+
+    printf("%9s %6s %6s %6s %8s %8s %8s %9s %9s %9s %9s %9s\n", "fiducials", "frames", "poses",
+           "obs", "mean ms", "p99 ms", "max ms", "allocs", "pose m", "yaw rad", "map0 m",
+           "map m");
+    for (int n : opt.sizes) {
+        Result r = run(n, opt);
+        double mean = 0;
+        for (double l : r.latency) {
+            mean += l;
+        }
+        mean /= max((size_t)1, r.latency.size());
+        printf("%9d %6d %6d %6.1lf %8.3lf %8.3lf %8.3lf %9.1lf %9.4lf %9.4lf %9.4lf %9.4lf\n",
+               r.fiducials, r.frames, r.poses, r.meanObs, mean, percentile(r.latency, 0.99),
+               percentile(r.latency, 1.0), r.allocsPerFrame, r.poseRms, r.yawRms,
+               r.mapRmsBefore, r.mapRmsAfter);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/map_edit.h>
+
+// Fiducials facing down from a ceiling tilted by slope radians about the y axis
+static FiducialMap tiltedCeiling(double slope) {
+    tf2::Quaternion tilt;
+    tilt.setRPY(0, slope, 0);
+    tf2::Transform T_mapCeiling(tilt, tf2::Vector3(1, 2, 3));
+
+    tf2::Quaternion down;
+    down.setRPY(M_PI, 0, 0);
+
+    FiducialMap fiducials;
+    int id = 1;
+    for (int x = -2; x <= 2; x++) {
+        for (int y = -1; y <= 1; y++) {
+            tf2::Transform T_ceilingFid(down, tf2::Vector3(x, y, 0));
+            fiducials[id] = Fiducial(id, TransformWithVariance(T_mapCeiling * T_ceilingFid, 0.1));
+            id++;
+        }
+    }
+    return fiducials;
+}
+
+TEST (MapEdit, move_origin) {
+    FiducialMap fiducials = tiltedCeiling(0.0);
+    tf2::Transform before = fiducials[1].pose.transform;
+
+    tf2::Quaternion q;
+    q.setRPY(0, 0, M_PI / 2);
+    tf2::Transform T(q, tf2::Vector3(-1, -2, 0));
+    transformFiducials(fiducials, T);
+
+    tf2::Vector3 p = fiducials[1].pose.transform.getOrigin();
+    tf2::Vector3 expected = T * before.getOrigin();
+    ASSERT_NEAR(expected.x(), p.x(), 1e-9);
+    ASSERT_NEAR(expected.y(), p.y(), 1e-9);
+    ASSERT_NEAR(expected.z(), p.z(), 1e-9);
+    ASSERT_DOUBLE_EQ(0.1, fiducials[1].pose.variance);
+}
+
+TEST (MapEdit, fit_and_level) {
+    double slope = 0.1;
+    FiducialMap fiducials = tiltedCeiling(slope);
+
+    PlaneFit fit;
+    ASSERT_TRUE(fitPlane(fiducials, fit));
+    ASSERT_EQ(15, fit.numFiducials);
+    ASSERT_NEAR(0.0, fit.rmsError, 1e-9);
+    ASSERT_NEAR(std::sin(slope), fit.normal.x(), 1e-9);
+    ASSERT_NEAR(std::cos(slope), fit.normal.z(), 1e-9);
+
+    transformFiducials(fiducials, levelingTransform(fit));
+    ASSERT_TRUE(fitPlane(fiducials, fit));
+    ASSERT_NEAR(1.0, fit.normal.z(), 1e-9);
+    ASSERT_NEAR(3.0, fit.centroid.z(), 1e-9);
+
+    // Still facing straight down
+    tf2::Vector3 z = fiducials[1].pose.transform.getBasis().getColumn(2);
+    ASSERT_NEAR(-1.0, z.z(), 1e-9);
+}
+
+TEST (MapEdit, project) {
+    FiducialMap fiducials = tiltedCeiling(0.0);
+
+    // One fiducial below the ceiling and turned a little
+    tf2::Transform &T = fiducials[5].pose.transform;
+    T.setOrigin(T.getOrigin() + tf2::Vector3(0, 0, -0.3));
+    tf2::Quaternion turn;
+    turn.setRPY(0.05, -0.05, 0.2);
+    T.setRotation(turn * T.getRotation());
+
+    PlaneFit fit;
+    ASSERT_TRUE(fitPlane(fiducials, fit));
+    ASSERT_GT(fit.maxError, 0.2);
+
+    projectOntoPlane(fiducials, fit);
+    for (const auto &map_pair : fiducials) {
+        const tf2::Transform &t = map_pair.second.pose.transform;
+        ASSERT_NEAR(0.0, (t.getOrigin() - fit.centroid).dot(fit.normal), 1e-9);
+        ASSERT_NEAR(-1.0, t.getBasis().getColumn(2).dot(fit.normal), 1e-9);
+    }
+
+    // The turn about the normal is kept
+    double roll, pitch, yaw;
+    fiducials[5].pose.transform.getBasis().getRPY(roll, pitch, yaw);
+    ASSERT_GT(std::fabs(yaw - M_PI), 0.1);
+}
+
+TEST (MapEdit, degenerate) {
+    FiducialMap fiducials;
+    PlaneFit fit;
+    for (int id = 1; id <= 4; id++) {
+        fiducials[id] = Fiducial(
+            id, TransformWithVariance(tf2::Transform(tf2::Quaternion::getIdentity(),
+                                                     tf2::Vector3(id, 0, 0)), 0.1));
+        if (id < 3) {
+            ASSERT_FALSE(fitPlane(fiducials, fit));
+        }
+    }
+    // In a line
+    ASSERT_FALSE(fitPlane(fiducials, fit));
+}
+
+TEST (MapEdit, rotation_between) {
+    tf2::Vector3 a(0, 0, 1);
+    tf2::Vector3 b(0, 0, -1);
+    tf2::Vector3 r = tf2::Transform(rotationBetween(a, b)) * a;
+    ASSERT_NEAR(-1.0, r.z(), 1e-9);
+
+    tf2::Vector3 c(1, 1, 0);
+    r = tf2::Transform(rotationBetween(a, c)) * a;
+    ASSERT_NEAR(std::sqrt(0.5), r.x(), 1e-9);
+    ASSERT_NEAR(std::sqrt(0.5), r.y(), 1e-9);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/map_params.h>
+
+TEST (MapParams, offline_values) {
+    MapParams params;
+    ASSERT_TRUE(params.nodeHandle() == nullptr);
+    ASSERT_TRUE(params.set("base_frame=base_link"));
+    ASSERT_FALSE(params.set("base_frame"));
+    params.set("publish_tf", "false");
+    params.set("optimize_interval", "25");
+    params.set("visibility_range", "12.5");
+    params.set("covariance_diagonal", "[0.1, 0.2, 0.3, 0.4, 0.5, 0.6]");
+
+    std::string frame;
+    params.param<std::string>("base_frame", frame, "base_footprint");
+    ASSERT_EQ("base_link", frame);
+
+    bool publish;
+    params.param<bool>("publish_tf", publish, true);
+    ASSERT_FALSE(publish);
+
+    int interval;
+    params.param<int>("optimize_interval", interval, 100);
+    ASSERT_EQ(25, interval);
+
+    double range;
+    params.param<double>("visibility_range", range, 10.0);
+    ASSERT_DOUBLE_EQ(12.5, range);
+
+    std::vector<double> diagonal;
+    ASSERT_TRUE(params.getParam("covariance_diagonal", diagonal));
+    ASSERT_EQ(6, diagonal.size());
+    ASSERT_DOUBLE_EQ(0.6, diagonal[5]);
+}
+
+TEST (MapParams, defaults) {
+    MapParams params;
+    params.set("optimize_interval", "often");
+
+    int interval;
+    params.param<int>("optimize_interval", interval, 100);
+    ASSERT_EQ(100, interval);
+
+    double range;
+    params.param<double>("visibility_range", range, 10.0);
+    ASSERT_DOUBLE_EQ(10.0, range);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/map_stats.h>
+
+#include <fiducial_msgs/trace.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+TEST (TimingHistogram, buckets) {
+    TimingHistogram h("update");
+    ASSERT_EQ("update", h.getName());
+    ASSERT_EQ(0, h.count());
+
+    h.record(5e-6);
+    h.record(15e-6);
+    h.record(0.001);
+    h.record(100.0);
+
+    ASSERT_EQ(4, h.count());
+    ASSERT_EQ(1, h.bucketCount(0));
+    ASSERT_EQ(1, h.bucketCount(1));
+    ASSERT_EQ(1, h.bucketCount(TimingHistogram::numBuckets - 1));
+    ASSERT_NEAR(100.0, h.maxSeconds(), 1e-6);
+    ASSERT_NEAR(100.001020, h.totalSeconds(), 1e-6);
+
+    // 1ms falls in the first bucket whose bound is above it
+    int i = 0;
+    while (TimingHistogram::bucketBound(i) < 0.001) {
+        i++;
+    }
+    ASSERT_EQ(1, h.bucketCount(i));
+    ASSERT_GE(0.001, TimingHistogram::bucketBound(i - 1));
+
+    h.reset();
+    ASSERT_EQ(0, h.count());
+    ASSERT_EQ(0.0, h.maxSeconds());
+}
+
+TEST (TraceBuffer, keeps_latest) {
+    fiducial_msgs::TraceBuffer off;
+    off.record("update", 1, ros::Time(10.0), 0, 100);
+    ASSERT_FALSE(off.enabled());
+    ASSERT_EQ(0, off.size());
+
+    fiducial_msgs::TraceBuffer trace(3);
+    for (int i = 0; i < 5; i++) {
+        trace.record("update", i, ros::Time(10.0 + i), i * 1000, i * 1000 + 500);
+    }
+    { fiducial_msgs::TraceSpan span(trace, "apply_update", 5, ros::Time(15.0)); }
+
+    std::vector<fiducial_msgs::TraceEvent> events = trace.snapshot();
+    ASSERT_EQ(3, events.size());
+    ASSERT_EQ(3, events[0].seq);
+    ASSERT_EQ(4, events[1].seq);
+    ASSERT_STREQ("apply_update", events[2].name);
+    ASSERT_DOUBLE_EQ(15.0, events[2].stamp);
+    ASSERT_LE(events[2].start, events[2].end);
+
+    char filename[] = "/tmp/trace_testXXXXXX";
+    close(mkstemp(filename));
+    ASSERT_TRUE(trace.dump(filename, "test"));
+    std::ifstream in(filename);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    remove(filename);
+    std::string json = ss.str();
+    ASSERT_NE(std::string::npos, json.find("\"traceEvents\""));
+    ASSERT_NE(std::string::npos, json.find("\"name\":\"test\""));
+    ASSERT_NE(std::string::npos, json.find("\"ts\":3.000,\"dur\":0.500"));
+    ASSERT_EQ(std::string::npos, json.find("\"seq\":2,"));
+}
+
+TEST (LinkComponents, incremental) {
+    LinkComponents c;
+    c.add(1);
+    c.add(2);
+    c.add(3);
+    c.add(4);
+    ASSERT_EQ(4, c.numComponents());
+    ASSERT_EQ(1, c.largestComponent());
+
+    ASSERT_TRUE(c.link(1, 2));
+    ASSERT_FALSE(c.link(2, 1));
+    ASSERT_TRUE(c.link(3, 4));
+    ASSERT_EQ(2, c.numComponents());
+    ASSERT_EQ(2, c.numLinks());
+
+    // A loop doesn't join anything new
+    ASSERT_TRUE(c.link(2, 3));
+    ASSERT_TRUE(c.link(4, 1));
+    ASSERT_EQ(1, c.numComponents());
+    ASSERT_EQ(4, c.largestComponent());
+    ASSERT_EQ(4, c.numLinks());
+    ASSERT_EQ(4, c.numNodes());
+}
+
+TEST (LinkComponents, rebuild) {
+    FiducialMap fiducials;
+    for (int id = 1; id <= 5; id++) {
+        fiducials[id] = Fiducial(id, TransformWithVariance(tf2::Transform::getIdentity(), 1.0));
+    }
+    fiducials[1].links.insert(2);
+    fiducials[1].links.insert(3);
+    fiducials[2].links.insert(1);
+    fiducials[3].links.insert(1);
+    // Linked to a fiducial that isn't in the map
+    fiducials[4].links.insert(9);
+
+    LinkComponents c;
+    c.rebuild(fiducials);
+    ASSERT_EQ(5, c.numNodes());
+    ASSERT_EQ(2, c.numLinks());
+    ASSERT_EQ(3, c.numComponents());
+    ASSERT_EQ(3, c.largestComponent());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
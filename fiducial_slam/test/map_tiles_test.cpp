@@ -0,0 +1,156 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/map_tiles.h>
+
+#include <cstdlib>
+#include <string>
+
+static std::string makeTempDir() {
+    char tmpl[] = "/tmp/map_tiles_testXXXXXX";
+    return std::string(mkdtemp(tmpl));
+}
+
+static Fiducial makeFiducial(int id, double x, double y) {
+    tf2::Transform t(tf2::Quaternion::getIdentity(), tf2::Vector3(x, y, 1.0));
+    Fiducial f(id, TransformWithVariance(t, 0.01));
+    f.numObs = id;
+    return f;
+}
+
+// Four fiducials in each of four 10m tiles
+static void fillMap(FiducialMap &fiducials) {
+    int id = 0;
+    for (double x : {5.0, 15.0}) {
+        for (double y : {5.0, 15.0}) {
+            for (int i = 0; i < 4; i++) {
+                fiducials[id] = makeFiducial(id, x + i * 0.5, y);
+                id++;
+            }
+        }
+    }
+}
+
+TEST (MapTiles, save_and_load_on_demand) {
+    std::string dir = makeTempDir();
+    MapTiles tiles;
+    tiles.configure(dir, 10.0, 100);
+
+    FiducialMap fiducials;
+    fillMap(fiducials);
+    std::vector<int> loaded;
+    tiles.assign(fiducials, loaded);
+    ASSERT_TRUE(loaded.empty());
+    ASSERT_TRUE(tiles.save(fiducials));
+
+    MapTiles other;
+    other.configure(dir, 10.0, 100);
+    ASSERT_TRUE(other.loadIndex());
+    ASSERT_FALSE(other.empty());
+
+    MapTiles::TileKey key;
+    ASSERT_TRUE(other.lookup(6, key));
+    ASSERT_EQ(MapTiles::TileKey(0, 1), key);
+    ASSERT_FALSE(other.isResident(key));
+
+    FiducialMap partial;
+    ASSERT_TRUE(other.load(key, partial, loaded));
+    ASSERT_EQ(4, partial.size());
+    ASSERT_EQ(4, loaded.size());
+    ASSERT_EQ(6, partial.find(6)->second.numObs);
+    ASSERT_NEAR(partial.find(6)->second.pose.transform.getOrigin().x(), 6.0, 1e-6);
+
+    std::vector<MapTiles::TileKey> near;
+    other.tilesNear(tf2::Vector3(9, 9, 0), 2.0, near);
+    ASSERT_EQ(4, near.size());
+}
+
+TEST (MapTiles, remove) {
+    std::string dir = makeTempDir();
+    MapTiles tiles;
+    tiles.configure(dir, 10.0, 100);
+
+    FiducialMap fiducials;
+    fillMap(fiducials);
+    std::vector<int> loaded;
+    tiles.assign(fiducials, loaded);
+
+    fiducials.erase(6);
+    ASSERT_TRUE(tiles.remove(6, true, fiducials));
+    ASSERT_FALSE(tiles.remove(6, true, fiducials));
+
+    MapTiles other;
+    other.configure(dir, 10.0, 100);
+    ASSERT_TRUE(other.loadIndex());
+    MapTiles::TileKey key;
+    ASSERT_FALSE(other.lookup(6, key));
+    ASSERT_TRUE(other.lookup(5, key));
+
+    FiducialMap partial;
+    ASSERT_TRUE(other.load(key, partial, loaded));
+    ASSERT_EQ(3, partial.size());
+    ASSERT_EQ(0, partial.count(6));
+}
+
+TEST (MapTiles, evicts_least_recently_used) {
+    std::string dir = makeTempDir();
+    MapTiles tiles;
+    tiles.configure(dir, 10.0, 8);
+
+    FiducialMap fiducials;
+    fillMap(fiducials);
+    std::vector<int> loaded;
+    tiles.assign(fiducials, loaded);
+
+    // Tiles were created in id order, so (0, 0) is the oldest
+    std::set<MapTiles::TileKey> keep;
+    keep.insert(MapTiles::TileKey(1, 1));
+    tiles.touch(MapTiles::TileKey(0, 0));
+
+    std::vector<int> removed;
+    tiles.evict(keep, true, fiducials, removed);
+
+    ASSERT_EQ(8, fiducials.size());
+    ASSERT_EQ(8, removed.size());
+    ASSERT_TRUE(tiles.isResident(MapTiles::TileKey(0, 0)));
+    ASSERT_TRUE(tiles.isResident(MapTiles::TileKey(1, 1)));
+    ASSERT_FALSE(tiles.isResident(MapTiles::TileKey(0, 1)));
+    ASSERT_FALSE(tiles.isResident(MapTiles::TileKey(1, 0)));
+
+    // Evicted tiles come back from disk
+    loaded.clear();
+    ASSERT_TRUE(tiles.load(MapTiles::TileKey(0, 1), fiducials, loaded));
+    ASSERT_EQ(4, loaded.size());
+    ASSERT_EQ(12, fiducials.size());
+}
+
+TEST (MapTiles, assigns_new_fiducials) {
+    std::string dir = makeTempDir();
+    MapTiles tiles;
+    tiles.configure(dir, 10.0, 100);
+
+    FiducialMap fiducials;
+    fillMap(fiducials);
+    std::vector<int> loaded;
+    tiles.assign(fiducials, loaded);
+
+    MapTiles::TileKey key;
+    fiducials[100] = makeFiducial(100, 25.0, 5.0);
+    ASSERT_FALSE(tiles.lookup(100, key));
+    tiles.assign(fiducials, loaded);
+    ASSERT_TRUE(tiles.lookup(100, key));
+    ASSERT_EQ(MapTiles::TileKey(2, 0), key);
+
+    // Once removed, a fiducial with the same id is new again
+    fiducials.erase(100);
+    ASSERT_TRUE(tiles.remove(100, false, fiducials));
+    fiducials[100] = makeFiducial(100, 5.0, 25.0);
+    tiles.assign(fiducials, loaded);
+    ASSERT_TRUE(tiles.lookup(100, key));
+    ASSERT_EQ(MapTiles::TileKey(0, 2), key);
+    ASSERT_TRUE(loaded.empty());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,141 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/frame_collector.h>
+#include <fiducial_slam/map.h>
+#include <fiducial_slam/map_params.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <unistd.h>
+
+// Count the heap allocations made by each thread
+static thread_local long allocations = 0;
+
+void *operator new(std::size_t size) {
+    allocations++;
+    void *p = std::malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static tf2::Transform makeTransform(double x, double y, double z, double roll, double yaw) {
+    tf2::Quaternion q;
+    q.setRPY(roll, 0, yaw);
+    return tf2::Transform(q, tf2::Vector3(x, y, z));
+}
+
+static geometry_msgs::TransformStamped toStamped(const tf2::Transform &T,
+                                                 const std::string &parent,
+                                                 const std::string &child,
+                                                 const ros::Time &stamp) {
+    geometry_msgs::TransformStamped msg;
+    msg.header.frame_id = parent;
+    msg.header.stamp = stamp;
+    msg.child_frame_id = child;
+    msg.transform = tf2::toMsg(T);
+    return msg;
+}
+
+// Frames passed through FrameCollector to Map::update, as the node does,
+// must not touch the heap on the frame thread once warmed up. The map
+// thread copies the map for each snapshot, so isn't counted
+TEST (Map, frame_thread_allocation_free) {
+    const int side = 5;
+    const int warmup = 50;
+    const int frames = 500;
+
+    // Fiducials a meter apart on a ceiling, facing down
+    std::vector<tf2::Transform> fids;
+    char mapFile[] = "/tmp/map_update_testXXXXXX";
+    FILE *fp = fdopen(mkstemp(mapFile), "w");
+    for (int i = 0; i < side * side; i++) {
+        fids.push_back(makeTransform(i % side, i / side, 3.0, M_PI, 0));
+        writeFiducial(fp, Fiducial(i, TransformWithVariance(fids[i], 0.01)));
+    }
+    fclose(fp);
+
+    MapParams params;
+    params.set("initial_map_file", mapFile);
+    params.set("map_file", std::string(mapFile) + ".out");
+    params.set("background_map_update", "true");
+    params.set("optimize_interval", "0");
+    params.set("tf_timeout", "0");
+    params.set("publish_tf", "false");
+    params.set("base_frame", "base_link");
+
+    ros::Time stamp(1000.0);
+    ros::Time::setNow(stamp);
+    Map map(params);
+    remove(mapFile);
+
+    // Camera looking straight up from the top of the robot
+    tf2::Transform T_baseCam = makeTransform(0, 0, 0.5, 0, 0);
+    map.tfBuffer.setTransform(toStamped(T_baseCam, "base_link", "camera", stamp), "test", true);
+
+    FrameCollector collector;
+    collector.configure(1, 0.0, false, 1.0,
+                        [&map](std::vector<Observation> &obs, const ros::Time &time) {
+                            map.update(obs, time);
+                        });
+
+    fiducial_msgs::FiducialTransformArray msg;
+    msg.header.frame_id = "camera";
+    long frameAllocations = 0;
+
+    for (int f = 0; f < warmup + frames; f++) {
+        // Drive a circle under the fiducials, with odometry that agrees
+        double a = 2 * M_PI * f / 200;
+        tf2::Transform T_mapBase =
+            makeTransform(2.0 + std::cos(a), 2.0 + std::sin(a), 0, 0, a + M_PI / 2);
+        stamp += ros::Duration(0.1);
+        ros::Time::setNow(stamp);
+        map.tfBuffer.setTransform(toStamped(T_mapBase, "odom", "base_link", stamp), "test");
+
+        tf2::Transform T_camMap = (T_mapBase * T_baseCam).inverse();
+        msg.header.stamp = stamp;
+        msg.transforms.clear();
+        for (int i = 0; i < side * side; i++) {
+            fiducial_msgs::FiducialTransform ft;
+            ft.fiducial_id = i;
+            ft.transform = tf2::toMsg(T_camMap * fids[i]);
+            ft.object_error = 0.01;
+            msg.transforms.push_back(ft);
+        }
+
+        long before = allocations;
+        collector.add(msg, 0);
+        if (f >= warmup) {
+            frameAllocations += allocations - before;
+        }
+
+        // Let the map thread take each frame on its own, so that the buffers
+        // it hands back don't depend on how it is scheduled
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(map.updateMutex);
+                if (map.updateQueue.empty()) {
+                    break;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    ASSERT_GT(map.numPoseFrames, (uint64_t)frames);
+    ASSERT_EQ(0, frameAllocations);
+}
+
+int main(int argc, char **argv) {
+  ros::Time::init();
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/observation.h>
+
+static geometry_msgs::Transform makeTransform(double x, double y, double z) {
+    geometry_msgs::Transform t;
+    t.translation.x = x;
+    t.translation.y = y;
+    t.translation.z = z;
+    t.rotation.w = 1.0;
+    return t;
+}
+
+TEST (Observation, lazy_inverse) {
+    int frame = FrameIds::intern("camera");
+    ASSERT_EQ(frame, FrameIds::intern("camera"));
+    ASSERT_EQ("camera", FrameIds::name(frame));
+
+    Observation o(3, TransformWithVariance(makeTransform(1, 2, 3), 0.1), ros::Time(5), frame);
+    tf2::Vector3 p = o.T_fidCam().getOrigin();
+    ASSERT_NEAR(-1.0, p.x(), 1e-9);
+    ASSERT_NEAR(-2.0, p.y(), 1e-9);
+    ASSERT_NEAR(-3.0, p.z(), 1e-9);
+    ASSERT_EQ("camera", o.frameId());
+}
+
+TEST (Observation, reframe_keeps_view) {
+    Observation o(3, TransformWithVariance(makeTransform(1, 2, 2), 0.1), ros::Time(5), 0);
+    ASSERT_NEAR(1.25, o.offAxis2, 1e-9);
+
+    // A camera looking the other way, where the fiducial is behind it
+    tf2::Quaternion q;
+    q.setRPY(M_PI, 0, 0);
+    o.reframe(tf2::Transform(q, tf2::Vector3(0, 0, 0.5)), 1, ros::Time(6));
+    ASSERT_NEAR(-1.5, o.T_camFid.transform.getOrigin().z(), 1e-9);
+    ASSERT_NEAR(1.25, o.offAxis2, 1e-9);
+    ASSERT_EQ(1, o.frame);
+}
+
+TEST (MapUpdateQueue, drops_oldest) {
+    MapUpdateQueue queue(2);
+    std::vector<Observation> obs;
+    tf2::Stamped<TransformWithVariance> T_mapCam;
+
+    for (int i = 0; i < 3; i++) {
+        obs.emplace_back(i, TransformWithVariance(makeTransform(i, 0, 1), 0.1), ros::Time(i), 0);
+        bool kept = queue.push(obs, ros::Time(i), T_mapCam, 1, 0);
+        ASSERT_EQ(i < 2, kept);
+        ASSERT_TRUE(obs.empty());
+    }
+
+    std::vector<MapUpdate> batch;
+    ASSERT_EQ(2, queue.popAll(batch));
+    ASSERT_EQ(1, batch[0].obs[0].fid);
+    ASSERT_EQ(2, batch[1].obs[0].fid);
+    ASSERT_TRUE(queue.empty());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
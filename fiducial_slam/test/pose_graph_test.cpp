@@ -0,0 +1,153 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/pose_graph.h>
+
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/LinearMath/Vector3.h>
+#include <tf2/LinearMath/Quaternion.h>
+
+#include <chrono>
+
+static tf2::Transform transformfromrpy(double x, double y, double z,
+                                       double roll, double pitch, double yaw) {
+    tf2::Quaternion q;
+    q.setRPY(roll, pitch, yaw);
+    return tf2::Transform(q, tf2::Vector3(x, y, z));
+}
+
+// Fiducials on a ring, with a relative observation between neighbours
+// and a drifted initial estimate of each pose
+static PoseGraph makeRing(int n, std::vector<tf2::Transform> &truth) {
+    PoseGraph graph;
+    truth.clear();
+
+    for (int i = 0; i < n; i++) {
+        double a = 2.0 * M_PI * i / n;
+        truth.push_back(transformfromrpy(3.0 * cos(a), 3.0 * sin(a), 0.5, M_PI / 2, 0, a));
+    }
+
+    for (int i = 0; i < n; i++) {
+        // First fiducial is the map origin, the rest drift progressively
+        tf2::Transform drift = transformfromrpy(0.02 * i, -0.01 * i, 0.005 * i, 0, 0, 0.01 * i);
+        double var = (i == 0) ? 0.0 : 1.0;
+        graph.addNode(i, TransformWithCovariance(drift * truth[i], var));
+    }
+
+    for (int i = 0; i < n; i++) {
+        int j = (i + 1) % n;
+        graph.addEdge(i, j, TransformWithCovariance(truth[i].inverse() * truth[j], 1e-4));
+    }
+
+    return graph;
+}
+
+TEST (PoseGraph, ring_closes) {
+    std::vector<tf2::Transform> truth;
+    PoseGraph graph = makeRing(12, truth);
+
+    double before = graph.error();
+    double after = graph.optimize(20);
+
+    ASSERT_LT(after, before);
+
+    for (const auto &node_pair : graph.nodes) {
+        const tf2::Transform &pose = node_pair.second.pose;
+        const tf2::Transform &expected = truth[node_pair.first];
+        ASSERT_NEAR(pose.getOrigin().distance(expected.getOrigin()), 0, 0.01);
+        ASSERT_NEAR(pose.getRotation().angleShortestPath(expected.getRotation()), 0, 0.01);
+    }
+
+    // The origin doesn't move
+    ASSERT_NEAR(graph.nodes[0].pose.getOrigin().distance(truth[0].getOrigin()), 0, 1e-12);
+}
+
+TEST (PoseGraph, reversed_edges_fuse) {
+    auto t = transformfromrpy(1, 2, 0, 0, 0, 0.5);
+
+    PoseGraph graph;
+    graph.addEdge(3, 1, TransformWithCovariance(t, 0.1));
+    graph.addEdge(1, 3, TransformWithCovariance(t.inverse(), 0.1));
+
+    ASSERT_EQ(1, graph.edges.size());
+    const PoseGraph::Edge &e = graph.edges.begin()->second;
+    ASSERT_EQ(1, e.from);
+    ASSERT_EQ(3, e.to);
+    ASSERT_EQ(2, e.numObs);
+    ASSERT_NEAR(e.T_fromTo.transform.getOrigin().distance(t.inverse().getOrigin()), 0, 1e-9);
+}
+
+TEST (PoseGraph, repeated_edges_average) {
+    auto t = transformfromrpy(1, 2, 0, 0, 0, 0.5);
+
+    PoseGraph graph;
+    for (int i = 0; i < 100; i++) {
+        graph.addEdge(1, 3, TransformWithCovariance(t, 0.1));
+    }
+
+    const PoseGraph::Edge &e = graph.edges.begin()->second;
+    ASSERT_EQ(100, e.numObs);
+    ASSERT_NEAR(e.T_fromTo.transform.getOrigin().distance(t.getOrigin()), 0, 1e-9);
+    ASSERT_NEAR(e.T_fromTo.variance(), 0.1, 1e-9);
+}
+
+TEST (PoseGraph, remove_node) {
+    std::vector<tf2::Transform> truth;
+    PoseGraph graph = makeRing(6, truth);
+    ASSERT_EQ(6, graph.edges.size());
+
+    graph.removeNode(3);
+    ASSERT_EQ(5, graph.nodes.size());
+    ASSERT_EQ(4, graph.edges.size());
+    for (const auto &edge_pair : graph.edges) {
+        ASSERT_NE(3, edge_pair.second.from);
+        ASSERT_NE(3, edge_pair.second.to);
+    }
+}
+
+TEST (PoseGraph, background_optimizer) {
+    std::vector<tf2::Transform> truth;
+    PoseGraph graph = makeRing(8, truth);
+
+    PoseGraphOptimizer optimizer;
+    ASSERT_TRUE(optimizer.request(graph, 20));
+
+    PoseGraph result;
+    auto start = std::chrono::steady_clock::now();
+    while (!optimizer.takeResult(result)) {
+        ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    ASSERT_FALSE(optimizer.busy());
+    ASSERT_LT(result.error(), graph.error());
+}
+
+TEST (PoseGraph, chain_poses) {
+    std::vector<tf2::Transform> truth;
+    PoseGraph graph = makeRing(6, truth);
+
+    std::map<int, TransformWithCovariance> poses;
+    graph.chainPoses(0, TransformWithCovariance(truth[0], 0.0), poses);
+
+    ASSERT_EQ(6, poses.size());
+    for (const auto &pose_pair : poses) {
+        const tf2::Transform &expected = truth[pose_pair.first];
+        ASSERT_NEAR(pose_pair.second.transform.getOrigin().distance(expected.getOrigin()), 0, 1e-9);
+    }
+
+    // Fiducials further round the ring are less certain
+    ASSERT_LT(poses[1].variance(), poses[3].variance());
+
+    // Edges agree with the true poses, but not the drifted ones
+    const PoseGraph::Edge &edge = graph.edges.rbegin()->second;
+    ASSERT_GT(graph.edgeError(edge), 1.0);
+    for (auto &node_pair : graph.nodes) {
+        node_pair.second.pose = truth[node_pair.first];
+    }
+    ASSERT_NEAR(graph.edgeError(edge), 0, 1e-9);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
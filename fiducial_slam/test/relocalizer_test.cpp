@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/relocalizer.h>
+
+#include <tf2/LinearMath/Quaternion.h>
+
+static tf2::Transform transformfromrpy(double x, double y, double z,
+                                       double roll, double pitch, double yaw) {
+    tf2::Quaternion q;
+    q.setRPY(roll, pitch, yaw);
+    return tf2::Transform(q, tf2::Vector3(x, y, z));
+}
+
+// A row of fiducials on a wall, and another row on the opposite wall
+static FiducialMap makeMap() {
+    FiducialMap fiducials;
+    for (int i = 0; i < 5; i++) {
+        auto T = transformfromrpy(i * 1.0, 3.0, 1.5, M_PI / 2, 0, M_PI);
+        fiducials[i] = Fiducial(i, TransformWithVariance(T, 0.01));
+        T = transformfromrpy(i * 1.0, -3.0, 1.5, M_PI / 2, 0, 0);
+        fiducials[10 + i] = Fiducial(10 + i, TransformWithVariance(T, 0.01));
+    }
+    return fiducials;
+}
+
+// What a camera at T_mapCam would see of the given fiducials
+static std::vector<std::pair<int, tf2::Transform>> observe(const FiducialMap &fiducials,
+                                                           const tf2::Transform &T_mapCam,
+                                                           const std::vector<int> &ids) {
+    std::vector<std::pair<int, tf2::Transform>> observed;
+    for (int id : ids) {
+        observed.push_back(
+            std::make_pair(id, T_mapCam.inverse() * fiducials.find(id)->second.pose.transform));
+    }
+    return observed;
+}
+
+TEST (Relocalizer, consistent_frame) {
+    FiducialMap fiducials = makeMap();
+    Relocalizer reloc;
+    reloc.build(fiducials, 5.0);
+    ASSERT_GT(reloc.numPairs(), 0);
+
+    auto T_mapCam = transformfromrpy(2.0, 0.0, 1.0, -M_PI / 2, 0, 0);
+    auto observed = observe(fiducials, T_mapCam, {1, 2, 3});
+
+    std::vector<int> inliers;
+    ASSERT_EQ(3, reloc.match(fiducials, observed, inliers));
+    ASSERT_EQ(std::vector<int>({1, 2, 3}), inliers);
+}
+
+TEST (Relocalizer, rejects_misidentified) {
+    FiducialMap fiducials = makeMap();
+    Relocalizer reloc;
+    reloc.build(fiducials, 5.0);
+
+    auto T_mapCam = transformfromrpy(2.0, 0.0, 1.0, -M_PI / 2, 0, 0);
+    auto observed = observe(fiducials, T_mapCam, {1, 2, 3});
+
+    // A second copy of fiducial 12 is seen where 4 should be, and an
+    // unknown fiducial is ignored
+    auto extra = observe(fiducials, T_mapCam, {4});
+    observed.push_back(std::make_pair(12, extra[0].second));
+    observed.push_back(std::make_pair(99, extra[0].second));
+
+    std::vector<int> inliers;
+    ASSERT_EQ(3, reloc.match(fiducials, observed, inliers));
+    ASSERT_EQ(std::vector<int>({1, 2, 3}), inliers);
+}
+
+TEST (Relocalizer, no_agreement) {
+    FiducialMap fiducials = makeMap();
+    Relocalizer reloc;
+    reloc.build(fiducials, 5.0);
+
+    // Fiducials 0 and 14 seen next to each other
+    auto T_mapCam = transformfromrpy(2.0, 0.0, 1.0, -M_PI / 2, 0, 0);
+    auto observed = observe(fiducials, T_mapCam, {1, 2});
+    observed[1].first = 14;
+
+    std::vector<int> inliers;
+    ASSERT_EQ(0, reloc.match(fiducials, observed, inliers));
+    ASSERT_TRUE(inliers.empty());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
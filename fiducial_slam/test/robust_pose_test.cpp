@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/robust_pose.h>
+
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/LinearMath/Vector3.h>
+#include <tf2/LinearMath/Quaternion.h>
+
+static tf2::Transform transformfromrpy(double x, double y, double z,
+                                       double roll, double pitch, double yaw) {
+    tf2::Quaternion q;
+    q.setRPY(roll, pitch, yaw);
+    return tf2::Transform(q, tf2::Vector3(x, y, z));
+}
+
+// Noisy estimates around the pose (1, 2, 0.1, 0, 0, 0.3)
+static std::vector<TransformWithCovariance> makeEstimates() {
+    std::vector<TransformWithCovariance> ests;
+    ests.push_back(TransformWithCovariance(transformfromrpy(1.01, 2.00, 0.10, 0, 0, 0.30), 1e-3));
+    ests.push_back(TransformWithCovariance(transformfromrpy(0.99, 2.01, 0.11, 0, 0.01, 0.29), 1e-3));
+    ests.push_back(TransformWithCovariance(transformfromrpy(1.00, 1.99, 0.09, 0.01, 0, 0.31), 2e-3));
+    ests.push_back(TransformWithCovariance(transformfromrpy(1.02, 2.01, 0.10, 0, 0, 0.30), 2e-3));
+    return ests;
+}
+
+TEST (RobustPoseSolver, single_estimate) {
+    auto t = transformfromrpy(1, 2, 3, 0.1, 0.2, 0.3);
+    RobustPoseSolver solver;
+    solver.outlierThreshold = 5.0;
+    solver.add(TransformWithCovariance(t, 0.01));
+
+    TransformWithCovariance result;
+    ASSERT_EQ(1, solver.solve(result));
+    ASSERT_NEAR(result.transform.getOrigin().distance(t.getOrigin()), 0, 1e-9);
+    ASSERT_NEAR(result.variance(), 0.01, 1e-6);
+}
+
+TEST (RobustPoseSolver, order_independent) {
+    auto ests = makeEstimates();
+
+    RobustPoseSolver forward;
+    RobustPoseSolver backward;
+    for (size_t i = 0; i < ests.size(); i++) {
+        forward.add(ests[i]);
+        backward.add(ests[ests.size() - 1 - i]);
+    }
+
+    TransformWithCovariance r1, r2;
+    ASSERT_EQ(4, forward.solve(r1));
+    ASSERT_EQ(4, backward.solve(r2));
+
+    ASSERT_NEAR(r1.transform.getOrigin().distance(r2.transform.getOrigin()), 0, 1e-9);
+    ASSERT_NEAR(r1.transform.getRotation().angleShortestPath(r2.transform.getRotation()), 0, 1e-9);
+    ASSERT_TRUE(r1.covariance.isApprox(r2.covariance, 1e-9));
+
+    // Fusing makes the result more certain than any single estimate
+    ASSERT_LT(r1.variance(), 1e-3);
+}
+
+TEST (RobustPoseSolver, rejects_outlier) {
+    auto ests = makeEstimates();
+    auto truth = transformfromrpy(1, 2, 0.1, 0, 0, 0.3);
+
+    RobustPoseSolver solver;
+    solver.outlierThreshold = 5.0;
+    solver.add(TransformWithCovariance(transformfromrpy(3, 0, 0.5, 0.5, 0, -1), 1e-3));
+    for (const auto& e : ests) {
+        solver.add(e);
+    }
+
+    TransformWithCovariance result;
+    ASSERT_EQ(4, solver.solve(result));
+    ASSERT_FALSE(solver.isInlier(0));
+    ASSERT_NEAR(result.transform.getOrigin().distance(truth.getOrigin()), 0, 0.02);
+    ASSERT_NEAR(result.transform.getRotation().angleShortestPath(truth.getRotation()), 0, 0.02);
+}
+
+TEST (RobustPoseSolver, capacity) {
+    RobustPoseSolver solver;
+    auto t = transformfromrpy(1, 2, 3, 0, 0, 0);
+    for (int i = 0; i < RobustPoseSolver::maxEstimates; i++) {
+        ASSERT_TRUE(solver.add(TransformWithCovariance(t, 0.1)));
+    }
+    ASSERT_FALSE(solver.add(TransformWithCovariance(t, 0.1)));
+
+    solver.clear();
+    ASSERT_EQ(0, solver.size());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/spatial_index.h>
+
+#include <tf2/LinearMath/Quaternion.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+// Fiducials scattered over a few floors of a building
+static std::map<int, tf2::Vector3> makePoints(SpatialIndex &index) {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> xy(-50.0, 50.0);
+    std::uniform_int_distribution<int> floor(0, 3);
+
+    std::map<int, tf2::Vector3> points;
+    for (int id = 0; id < 2000; id++) {
+        tf2::Vector3 p(xy(rng), xy(rng), floor(rng) * 3.0 + 2.5);
+        points[id] = p;
+        index.update(id, p);
+    }
+    return points;
+}
+
+TEST (SpatialIndex, radius_matches_brute_force) {
+    SpatialIndex index(2.0);
+    auto points = makePoints(index);
+    ASSERT_EQ(points.size(), index.size());
+
+    for (double range : {0.5, 3.0, 12.0, 200.0}) {
+        tf2::Vector3 center(3.0, -7.0, 5.5);
+        std::vector<int> ids;
+        index.queryRadius(center, range, ids);
+        std::sort(ids.begin(), ids.end());
+
+        std::vector<int> expected;
+        for (const auto &p : points) {
+            if (p.second.distance(center) <= range) {
+                expected.push_back(p.first);
+            }
+        }
+        ASSERT_EQ(expected, ids);
+    }
+}
+
+TEST (SpatialIndex, move_and_remove) {
+    SpatialIndex index(1.0);
+    index.update(1, tf2::Vector3(0.5, 0.5, 0.5));
+    index.update(2, tf2::Vector3(10, 10, 0));
+
+    // Move 1 next to 2
+    index.update(1, tf2::Vector3(10.2, 10, 0));
+    std::vector<int> ids;
+    index.queryRadius(tf2::Vector3(10, 10, 0), 0.5, ids);
+    std::sort(ids.begin(), ids.end());
+    ASSERT_EQ(std::vector<int>({1, 2}), ids);
+
+    ids.clear();
+    index.queryRadius(tf2::Vector3(0, 0, 0), 2.0, ids);
+    ASSERT_TRUE(ids.empty());
+
+    index.remove(2);
+    ids.clear();
+    index.queryRadius(tf2::Vector3(10, 10, 0), 0.5, ids);
+    ASSERT_EQ(std::vector<int>({1}), ids);
+    ASSERT_EQ(1, index.size());
+}
+
+TEST (SpatialIndex, frustum) {
+    SpatialIndex index(2.0);
+    index.update(1, tf2::Vector3(5, 0, 0));     // ahead
+    index.update(2, tf2::Vector3(-5, 0, 0));    // behind
+    index.update(3, tf2::Vector3(5, 10, 0));    // outside horizontal fov
+    index.update(4, tf2::Vector3(20, 0, 0));    // out of range
+    index.update(5, tf2::Vector3(5, 1, 0.5));   // ahead, off axis
+
+    // Camera at the origin looking along +x, with y to the left and z up
+    tf2::Matrix3x3 R(0, 0, 1,
+                     -1, 0, 0,
+                     0, -1, 0);
+    tf2::Transform T_mapCam(R, tf2::Vector3(0, 0, 0));
+
+    std::vector<int> ids;
+    index.queryFrustum(T_mapCam, M_PI / 2, M_PI / 3, 10.0, ids);
+    std::sort(ids.begin(), ids.end());
+    ASSERT_EQ(std::vector<int>({1, 5}), ids);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+
+#include <fiducial_slam/transform_with_covariance.h>
+
+#include <tf2/LinearMath/Transform.h>
+#include <tf2/LinearMath/Vector3.h>
+#include <tf2/LinearMath/Quaternion.h>
+
+static tf2::Quaternion quaternionfromrpy(double roll, double pitch, double yaw) {
+    tf2::Quaternion q;
+    q.setRPY(roll, pitch, yaw);
+    return q;
+}
+
+// Covariance that is the outer product of a single perturbation
+static Covariance6 rankOne(const Vector6 &d) {
+    return d * d.transpose();
+}
+
+TEST (TransformWithCovariance, identity_composition_adds) {
+    auto t = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(0,0,0));
+
+    auto tc1 = TransformWithCovariance(t, 0.1);
+    auto tc2 = TransformWithCovariance(t, 0.2);
+
+    auto out_tc = tc1 * tc2;
+
+    for (int i = 0; i < 6; i++) {
+        ASSERT_NEAR(out_tc.covariance(i, i), 0.3, 1e-12);
+    }
+}
+
+TEST (TransformWithCovariance, rotation_becomes_translation) {
+    // Yaw uncertainty at the origin becomes lateral uncertainty 1m away
+    Covariance6 cov = Covariance6::Zero();
+    cov(5, 5) = 0.01;
+
+    auto tc1 = TransformWithCovariance(tf2::Transform::getIdentity(), cov);
+    auto t2 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(1,0,0));
+
+    auto out_tc = tc1 * t2;
+
+    ASSERT_NEAR(out_tc.covariance(0, 0), 0, 1e-12);
+    ASSERT_NEAR(out_tc.covariance(1, 1), 0.01, 1e-12);
+    ASSERT_NEAR(out_tc.covariance(5, 5), 0.01, 1e-12);
+}
+
+TEST (TransformWithCovariance, composition_matches_perturbation) {
+    auto t1 = tf2::Transform(quaternionfromrpy(0.1,-0.2,0.7), tf2::Vector3(1,2,0.5));
+    auto t2 = tf2::Transform(quaternionfromrpy(-0.3,0.2,1.1), tf2::Vector3(0.4,-1,2));
+
+    Vector6 d;
+    d << 1e-4, -2e-4, 3e-4, 2e-4, 1e-4, -3e-4;
+
+    // A rank one covariance should propagate to the outer product of the
+    // perturbation that it causes in the composed transform
+    auto tc1 = TransformWithCovariance(t1, rankOne(d));
+    auto tc2 = TransformWithCovariance(t2, Covariance6::Zero());
+    auto out_tc = tc1 * tc2;
+
+    Vector6 expected = transformDelta(t1 * t2, applyTransformDelta(t1, d) * t2);
+    Covariance6 diff = out_tc.covariance - rankOne(expected);
+    ASSERT_LT(diff.cwiseAbs().maxCoeff(), 1e-3 * expected.squaredNorm());
+
+    // Same again for the right hand side
+    tc1 = TransformWithCovariance(t1, Covariance6::Zero());
+    tc2 = TransformWithCovariance(t2, rankOne(d));
+    out_tc = tc1 * tc2;
+
+    expected = transformDelta(t1 * t2, t1 * applyTransformDelta(t2, d));
+    diff = out_tc.covariance - rankOne(expected);
+    ASSERT_LT(diff.cwiseAbs().maxCoeff(), 1e-3 * expected.squaredNorm());
+}
+
+TEST (TransformWithCovariance, inverse_matches_perturbation) {
+    auto t = tf2::Transform(quaternionfromrpy(0.3,0.1,-0.8), tf2::Vector3(-1,2,0.3));
+
+    Vector6 d;
+    d << -1e-4, 2e-4, 1e-4, 3e-4, -1e-4, 2e-4;
+
+    auto tc = TransformWithCovariance(t, rankOne(d));
+    auto out_tc = tc.inverse();
+
+    Vector6 expected = transformDelta(t.inverse(), applyTransformDelta(t, d).inverse());
+    Covariance6 diff = out_tc.covariance - rankOne(expected);
+    ASSERT_LT(diff.cwiseAbs().maxCoeff(), 1e-3 * expected.squaredNorm());
+
+    // Inverting twice gets back to where we started
+    auto back_tc = out_tc.inverse();
+    diff = back_tc.covariance - tc.covariance;
+    ASSERT_LT(diff.cwiseAbs().maxCoeff(), 1e-15);
+}
+
+TEST (TransformWithCovariance, equal_fusion_halves) {
+    auto t1 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(0,0,0));
+    auto t2 = tf2::Transform(quaternionfromrpy(0,0,0.1), tf2::Vector3(0.1,0,0));
+
+    auto tc1 = TransformWithCovariance(t1, 0.3);
+    auto tc2 = TransformWithCovariance(t2, 0.3);
+
+    tc1.update(tc2);
+
+    // Make sure that the new mean is half way between the originals
+    ASSERT_NEAR(tc1.transform.getOrigin().x(), 0.05, 1e-9);
+    ASSERT_NEAR(tc1.transform.getRotation().getAngle(), 0.05, 1e-9);
+
+    // Two equal estimates give half the variance
+    for (int i = 0; i < 6; i++) {
+        ASSERT_NEAR(tc1.covariance(i, i), 0.15, 1e-9);
+    }
+}
+
+TEST (TransformWithCovariance, per_axis_weighting) {
+    auto t1 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(0,0,0));
+    auto t2 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(1,1,0));
+
+    // First estimate is good in x but poor in y, second the opposite
+    Covariance6 cov1 = isotropicCovariance(0.01);
+    cov1(1, 1) = 100;
+    Covariance6 cov2 = isotropicCovariance(0.01);
+    cov2(0, 0) = 100;
+
+    auto tc1 = TransformWithCovariance(t1, cov1);
+    tc1.update(TransformWithCovariance(t2, cov2));
+
+    ASSERT_NEAR(tc1.transform.getOrigin().x(), 0, 1e-3);
+    ASSERT_NEAR(tc1.transform.getOrigin().y(), 1, 1e-3);
+    ASSERT_LT(tc1.covariance(0, 0), 0.01);
+    ASSERT_LT(tc1.covariance(1, 1), 0.01);
+}
+
+TEST (TransformWithCovariance, exact_prior_is_kept) {
+    auto t1 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(0,0,0));
+    auto t2 = tf2::Transform(quaternionfromrpy(0.2,0,0), tf2::Vector3(1,0,0));
+
+    auto tc1 = TransformWithCovariance(t1, 0.0);
+    tc1.update(TransformWithCovariance(t2, 0.5));
+
+    ASSERT_NEAR(tc1.transform.getOrigin().x(), 0, 1e-9);
+    ASSERT_NEAR(tc1.transform.getRotation().getAngle(), 0, 1e-6);
+    ASSERT_NEAR(tc1.covariance.cwiseAbs().maxCoeff(), 0, 1e-9);
+}
+
+TEST (TransformWithCovariance, mahalanobis) {
+    auto t1 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(0,0,0));
+    auto t2 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(0.2,0,0));
+
+    auto tc1 = TransformWithCovariance(t1, 0.01);
+    auto tc2 = TransformWithCovariance(t2, 0.01);
+
+    // 0.2^2 / (0.01 + 0.01)
+    ASSERT_NEAR(tc1.mahalanobis2(tc2), 2.0, 1e-6);
+}
+
+TEST (TransformWithCovariance, to_pose) {
+    Covariance6 cov = isotropicCovariance(0.1);
+    cov(0, 1) = cov(1, 0) = 0.05;
+
+    auto in = tf2::Stamped<TransformWithCovariance>(
+        TransformWithCovariance(tf2::Transform::getIdentity(), cov), ros::Time(10.0), "map");
+    auto msg = toPose(in);
+
+    ASSERT_EQ("map", msg.header.frame_id);
+    ASSERT_DOUBLE_EQ(0.1, msg.pose.covariance[0]);
+    ASSERT_DOUBLE_EQ(0.05, msg.pose.covariance[1]);
+    ASSERT_DOUBLE_EQ(0.05, msg.pose.covariance[6]);
+    ASSERT_DOUBLE_EQ(0.1, msg.pose.covariance[35]);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -125,6 +125,67 @@ TEST (TransformWithVariance, different_with_similar_variance) {
     ASSERT_GT(out_tv.variance, 0.2);
 }
 
+TEST (TransformBatch, matches_pairwise) {
+    auto t1 = tf2::Transform(quaternionfromrpy(0,0,0), tf2::Vector3(0,0,0));
+    auto t2 = tf2::Transform(quaternionfromrpy(0.2,0,0), tf2::Vector3(0.3,0.1,0));
+
+    auto tv1 = TransformWithVariance(t1, 0.1);
+    auto tv2 = TransformWithVariance(t2, 0.2);
+
+    TransformBatch batch;
+    batch.add(tv1);
+    batch.add(tv2);
+    auto fused = batch.fuse();
+    auto pairwise = averageTransforms(tv1, tv2);
+
+    // Position and variance are the same, and rotation close to the slerp
+    ASSERT_NEAR(fused.transform.getOrigin().x(), pairwise.transform.getOrigin().x(), 1e-9);
+    ASSERT_NEAR(fused.transform.getOrigin().y(), pairwise.transform.getOrigin().y(), 1e-9);
+    ASSERT_NEAR(fused.variance, pairwise.variance, 1e-9);
+    ASSERT_NEAR(fused.transform.getRotation().angleShortestPath(pairwise.transform.getRotation()),
+                0, 1e-3);
+}
+
+TEST (TransformBatch, order_independent) {
+    std::vector<TransformWithVariance> estimates;
+    estimates.push_back(TransformWithVariance(
+        tf2::Transform(quaternionfromrpy(0.1,0,0), tf2::Vector3(0,0,0)), 0.1));
+    estimates.push_back(TransformWithVariance(
+        tf2::Transform(quaternionfromrpy(0,0.2,0), tf2::Vector3(0.2,0,0)), 0.3));
+    // Same rotation as the first, with the opposite sign
+    estimates.push_back(TransformWithVariance(
+        tf2::Transform(-quaternionfromrpy(0.1,0,0.1), tf2::Vector3(0,0.2,0)), 0.2));
+
+    TransformBatch forward, backward;
+    for (size_t i = 0; i < estimates.size(); i++) {
+        forward.add(estimates[i]);
+        backward.add(estimates[estimates.size() - 1 - i]);
+    }
+    auto a = forward.fuse();
+    auto b = backward.fuse();
+
+    ASSERT_NEAR(a.transform.getOrigin().distance(b.transform.getOrigin()), 0, 1e-12);
+    ASSERT_NEAR(a.transform.getRotation().angleShortestPath(b.transform.getRotation()), 0, 1e-9);
+    ASSERT_NEAR(a.variance, b.variance, 1e-12);
+
+    // The average rotation is within the spread of the estimates
+    ASSERT_LT(a.transform.getRotation().angleShortestPath(quaternionfromrpy(0.1,0,0)), 0.2);
+}
+
+TEST (TransformBatch, agreeing_estimates) {
+    auto t = tf2::Transform(quaternionfromrpy(0.3,0.2,0.1), tf2::Vector3(1,2,3));
+
+    TransformBatch batch;
+    for (int i = 0; i < 4; i++) {
+        batch.add(TransformWithVariance(t, 0.4));
+    }
+    auto fused = batch.fuse();
+
+    ASSERT_NEAR(fused.transform.getOrigin().distance(t.getOrigin()), 0, 1e-9);
+    ASSERT_NEAR(fused.transform.getRotation().angleShortestPath(t.getRotation()), 0, 1e-6);
+    ASSERT_NEAR(fused.variance, 0.1, 1e-9);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();